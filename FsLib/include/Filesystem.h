@@ -1,6 +1,9 @@
 #pragma once
 #include "FsLogger.h"
 #include "FsString.h"
+#include "FsFreeSpaceTree.h"
+#include "FsFreeExtentIndex.h"
+#include "FsAtomic.h"
 
 class FsBitStream;
 class FsFilesystem;
@@ -12,9 +15,30 @@ typedef FsString FsFileNameString;
 typedef FsArray<uint64> FsBlockArray;
 
 #define FS_MAGIC 0x1234567890ABCDEF
-#define FS_VERSION "Version 1"
+#define FS_VERSION "Version 5"
+#define FS_VERSION_1 "Version 1" // Did not store the used block count in the header
+#define FS_VERSION_2 "Version 2" // Did not store how much of each file has been written
+#define FS_VERSION_3 "Version 3" // Stored file content in a chain of chunks, each starting with a header pointing at the next
+#define FS_VERSION_4 "Version 4" // Could not store small files in their directory entry
+#define FS_VERSION_NUMBER 5
 #define FS_HEADER_MAXSIZE 4096
 
+// The amount of blocks in each allocation group. Must be a multiple of 64 so groups never share a word of the block buffer.
+#define FS_ALLOCATION_GROUP_BLOCKS (FS_BLOCK_GROUP_SIZE * 16)
+
+// Allocations of at least this many blocks take the smallest free run that fits rather than the next one after the goal,
+// so large holes are kept for large files.
+#define FS_BEST_FIT_MIN_BLOCKS 64
+
+// The most files that are tracked for sequential reading at once. The one read longest ago is dropped to make room for another.
+#define FS_MAX_READ_AHEAD_STREAMS 16
+
+// The starting value of FsFilesystem::HashBytes, the FNV-1a offset basis
+#define FS_HASH_SEED 14695981039346656037ull
+
+// Set in the tag of every read ahead request, so its completion can be told apart from requests made by RunIoRequests
+#define FS_READ_AHEAD_TAG (1ull << 63)
+
 struct FsPath : public FsFileNameString
 {
 public:
@@ -53,6 +77,7 @@ public:
 	FsPath GetFirstPath() const;
 };
 
+// The header at the start of a directory's block. Files stored before block maps started every chunk with one of these too.
 struct FsFileChunkHeader
 {
 	// The block index of the next block in the file.
@@ -64,19 +89,145 @@ struct FsFileChunkHeader
 	void Serialize(FsBitStream& BitStream);
 };
 
+// A run of contiguous blocks holding part of a file's content. The blocks hold nothing but content.
+struct FsFileExtent
+{
+	// Where the extent starts in the file, in blocks
+	uint64 FileBlockIndex = 0;
+
+	// Where the extent starts on the partition
+	uint64 StartBlockIndex = 0;
+	uint64 Blocks = 0;
+
+	void Serialize(FsBitStream& BitStream);
+};
+
+typedef FsArray<FsFileExtent> FsFileExtentArray;
+
+// The start of each block of a file's block map, followed by ExtentCount extents
+struct FsBlockMapHeader
+{
+	uint64 ExtentCount = 0;
+
+	// The next block of the map when the extents don't fit in one block, 0 for the last block
+	uint64 NextMapBlockIndex = 0;
+
+	void Serialize(FsBitStream& BitStream);
+};
+
+// Where all of a file's content lives, in file order. Parts of the file no extent covers are holes, they have no blocks and read as zeros.
+struct FsBlockMap
+{
+	FsFileExtentArray Extents;
+
+	// The blocks the map itself is stored in, in the order they are chained
+	FsBlockArray MapBlocks;
+
+	// The amount of content blocks, not counting holes or the map blocks
+	uint64 GetBlockCount() const;
+
+	// The file block just past the last extent
+	uint64 GetEndFileBlockIndex() const;
+};
+
+// The part of a read or write that lands in one extent
+struct FsContentRange
+{
+	uint64 FileOffset = 0;
+	uint64 AbsoluteOffset = 0;
+	uint64 Length = 0;
+};
+
+// A run of contiguous blocks on the partition
+struct FsBlockRun
+{
+	uint64 StartBlockIndex = 0;
+	uint64 Blocks = 0;
+};
+
+typedef FsArray<FsBlockRun> FsBlockRunArray;
+
+// One range of a vectored read, Length bytes at Offset on the partition are read into Destination
+struct FsReadSegment
+{
+	uint64 Offset = 0;
+	uint64 Length = 0;
+	uint8* Destination = nullptr;
+};
+
+// One range of a vectored write, Length bytes from Source are written to Offset on the partition
+struct FsWriteSegment
+{
+	uint64 Offset = 0;
+	uint64 Length = 0;
+	const uint8* Source = nullptr;
+};
+
+enum class FsIoOperation : uint8
+{
+	Read,
+	Write
+};
+
+// A read or write handed to the storage with SubmitIo, the buffer must stay valid until the request completes
+struct FsIoRequest
+{
+	// Given back in the completion so the caller can tell its requests apart
+	uint64 Tag = 0;
+	FsIoOperation Operation = FsIoOperation::Read;
+	uint64 Offset = 0;
+	uint64 Length = 0;
+
+	// Filled by reads
+	uint8* Destination = nullptr;
+
+	// Used by writes
+	const uint8* Source = nullptr;
+};
+
+struct FsIoCompletion
+{
+	uint64 Tag = 0;
+	bool bSucceeded = false;
+};
+
+// A range of blocks with its own free space tree and lock, so writers in different groups never wait on each other
+struct FsAllocationGroup
+{
+	uint64 StartBlockIndex = 0;
+	uint64 EndBlockIndex = 0;
+
+	// Next fit cursor, the block after the most recent allocation in this group
+	uint64 NextFitBlockIndex = 0;
+
+	FsFreeSpaceTree FreeSpaceTree;
+
+	// The same free runs ordered by length, for best fit allocations
+	FsFreeExtentIndex FreeExtentIndex;
+	FsSpinLock Lock;
+};
+
 struct FsFileDescriptor
 {
 	FsPath FileName{};
 
-	// The offset of the first file chunk
+	// The offset of the first block of the file's block map, 0 if the file has no blocks. Directories point at their single block.
 	uint64 FileOffset = 0;
 
 	// The total size of the file in bytes
 	uint64 FileSize = 0;
 
+	// The file has never been written past this offset, so everything after it reads back as zeros without touching its blocks.
+	// Extending or preallocating a file only moves FileSize, so the new blocks never need to be cleared. Blocks given to holes below it are cleared as they are allocated.
+	uint64 WrittenSize = 0;
+
 	// If this file descriptor is a directory
 	bool bIsDirectory = false;
 
+	// The content of a small file, kept in the directory entry so the file has no blocks.
+	// When not empty the file has no block map and this holds everything up to WrittenSize.
+	FsArray<uint8> InlineData;
+
 	void Serialize(FsBitStream& BitStream);
 
 	// copy assignment
@@ -85,14 +236,33 @@ struct FsFileDescriptor
 		FileName = InFileDescriptor.FileName;
 		FileOffset = InFileDescriptor.FileOffset;
 		FileSize = InFileDescriptor.FileSize;
+		WrittenSize = InFileDescriptor.WrittenSize;
 		bIsDirectory = InFileDescriptor.bIsDirectory;
+		InlineData = InFileDescriptor.InlineData;
 		return *this;
 	}
 
 	// equals operator
 	bool operator==(const FsFileDescriptor& InFileDescriptor) const
 	{
-		return FileName == InFileDescriptor.FileName && FileOffset == InFileDescriptor.FileOffset && FileSize == InFileDescriptor.FileSize && bIsDirectory == InFileDescriptor.bIsDirectory;
+		if (!(FileName == InFileDescriptor.FileName && FileOffset == InFileDescriptor.FileOffset && FileSize == InFileDescriptor.FileSize && WrittenSize == InFileDescriptor.WrittenSize && bIsDirectory == InFileDescriptor.bIsDirectory))
+		{
+			return false;
+		}
+
+		if (InlineData.Length() != InFileDescriptor.InlineData.Length())
+		{
+			return false;
+		}
+
+		for (uint64 i = 0; i < InlineData.Length(); i++)
+		{
+			if (InlineData[i] != InFileDescriptor.InlineData[i])
+			{
+				return false;
+			}
+		}
+		return true;
 	}
 
 };
@@ -110,15 +280,28 @@ struct FsFilesystemHeader
 {
 	uint64 MagicNumber = FS_MAGIC;
 	FsFixedLengthString<32> FilesystemVersion = FS_VERSION;
+
+	// The amount of blocks marked as in use in the block buffer. Kept up to date by SetBlocksInUse.
+	uint64 UsedBlocks = 0;
+
 	FsDirectoryDescriptor RootDirectory;
 
 	void Serialize(FsBitStream& BitStream);
+
+	// The version as a number, so older layouts can be told apart when reading
+	uint64 GetVersionNumber() const;
+
+	// Where UsedBlocks starts in the saved header, in bytes
+	uint64 GetUsedBlocksOffset() const;
 };
 
-struct FsCachedChunkList
+struct FsCachedBlockMap
 {
 	FsPath FileName;
-	FsArray<FsFileChunkHeader> Chunks;
+
+	// Checked before the name, so most entries are skipped without comparing strings
+	uint64 FileNameHash = 0;
+	FsBlockMap BlockMap;
 };
 
 struct FsCachedDirectory
@@ -127,12 +310,160 @@ struct FsCachedDirectory
 	FsDirectoryDescriptor Directory;
 };
 
-struct FsReadCache
+// A file being read in order, with the content past the last read fetched before it is asked for
+struct FsReadAheadStream
+{
+	FsPath FileName;
+	uint64 FileNameHash = 0;
+
+	// Goes in the tag of this stream's requests, after FS_READ_AHEAD_TAG
+	uint64 Id = 0;
+
+	// Where the next read starts if the file is still being read in order
+	uint64 NextReadOffset = 0;
+
+	// How much is read ahead next time. Doubles each time read ahead content is used, and drops back to nothing when the file is read out of order.
+	uint64 WindowBytes = 0;
+
+	// The content read ahead, Data[0] is at DataOffset in the file
+	uint64 DataOffset = 0;
+	FsArray<uint8> Data;
+
+	// Requests still filling Data. Data can't be used or freed until they have finished.
+	uint64 PendingRequests = 0;
+	bool bFailed = false;
+
+	// When the stream was last read, for dropping the stream read longest ago
+	uint64 LastUsed = 0;
+};
+
+// How PreallocateFile treats the size of the file
+enum class FsPreallocateMode : uint8
+{
+	// The file size grows to the preallocated length, the new range reads back as zeros
+	ExtendSize,
+
+	// Only blocks are reserved, the file size stays the same until something is written
+	KeepSize
+};
+
+// When blocks freed by deleting files are passed to Discard
+enum class FsDiscardMode : uint8
+{
+	// Never discard
+	Off,
+
+	// Discard the freed blocks as soon as they are freed
+	Immediate,
+
+	// Collect freed blocks and discard them in large batches, when enough have built up or on FlushDiscards
+	Deferred
+};
+
+// How writes are read back to check they landed
+enum class FsWriteVerifyMode : uint8
+{
+	// Trust the storage, nothing is read back
+	Off,
+
+	// Every write is read back and compared byte by byte
+	Full,
+
+	// One in every WriteVerifySampleInterval writes is read back and compared
+	Sampled,
+
+	// Every write is read back a piece at a time and a hash of it compared with a hash of the source,
+	// so large writes don't need a second buffer as large as them
+	Checksum
+};
+
+// Options chosen when the filesystem is mounted, they are not saved to the partition
+struct FsMountOptions
+{
+	// Keep appended data in memory and only allocate blocks for it once the file is flushed,
+	// so a file written in many small pieces gets its blocks in one contiguous allocation.
+	bool bDelayedAllocation = false;
+
+	// A file with this much data staged is flushed straight away
+	uint64 MaxDelayedBytesPerFile = 64ull * 1024 * 1024;
+
+	FsDiscardMode DiscardMode = FsDiscardMode::Immediate;
+
+	// With deferred discard, pending discards are sent once this many blocks have been freed
+	uint64 DeferredDiscardBlocks = 64ull * 1024;
+
+	// Reading writes back costs at least as much IO as the writes, so production mounts can turn it off or down
+	FsWriteVerifyMode WriteVerifyMode = FsWriteVerifyMode::Full;
+	uint64 WriteVerifySampleInterval = 16;
+
+	// The most reads or writes ReadV and WriteV keep in flight at once through SubmitIo
+	uint64 IoQueueDepth = 8;
+
+	// The most a file being read in order is read ahead of the reader. 0 turns read ahead off.
+	uint64 ReadAheadMaxBytes = 4ull * 1024 * 1024;
+
+	// Hold small writes to a file in memory and commit them to the file as one larger write,
+	// once enough is buffered, once the oldest buffered write is old enough, or when the file is flushed.
+	bool bWriteBack = false;
+
+	// A file with this much buffered is committed straight away. Writes at least this long are never buffered.
+	uint64 WriteBackMaxBytes = 1024ull * 1024;
+
+	// Buffered writes older than this are committed on the next write to any file. Needs GetTimeMilliseconds, 0 means no limit.
+	uint64 WriteBackMaxAgeMilliseconds = 2000;
+
+	// Files no larger than this are stored in their directory entry instead of in blocks, while their directory has room for them.
+	// They move to blocks once they grow past it. 0 turns inline files off.
+	uint64 InlineFileMaxBytes = 512;
+};
+
+// Data appended to a file that has not been given blocks yet
+struct FsDelayedWrite
 {
-	uint64 BlockIndex = 0;
+	FsPath FileName;
+
+	// Where the staged data goes in the file, always at or past the space the file has blocks for
+	uint64 FileOffset = 0;
+	FsArray<uint8> Data;
+
+	// Free blocks held back so the flush can't run out of space
+	uint64 ReservedBlocks = 0;
+};
+
+// Writes to a file that are buffered by write-back and not committed to the file yet.
+// Unlike delayed allocation no blocks are held back, so running out of space only shows up when the writes are committed.
+struct FsWriteBack
+{
+	FsPath FileName;
+	uint64 FileNameHash = 0;
+
+	// The buffered writes always cover one unbroken range of the file, starting here
+	uint64 FileOffset = 0;
 	FsArray<uint8> Data;
+
+	// When the oldest buffered write was made, from GetTimeMilliseconds
+	uint64 FirstWriteTime = 0;
+};
+
+// The progress of a whole volume defragmentation pass, kept by the caller between steps
+struct FsDefragmentPass
+{
+	// Every file on the volume, gathered by the first step
+	FsArray<FsPath> Files;
+	uint64 NextFileIndex = 0;
+	bool bStarted = false;
+
+	uint64 FilesDefragmented = 0;
+	uint64 BytesMoved = 0;
+
+	bool IsComplete() const
+	{
+		return bStarted && NextFileIndex >= Files.Length();
+	}
 };
 
+// Calls must not overlap, the caller serializes them if it calls in from several threads.
+// Only the block allocator takes its own locks. Directories, block maps, staged and buffered writes and read ahead are not guarded.
 class FsFilesystem
 {
 public:
@@ -142,7 +473,7 @@ public:
 	{}
 	~FsFilesystem() {}
 
-	void Initialize();
+	void Initialize(const FsMountOptions& InMountOptions = FsMountOptions());
 
 	// Creates a file or opens it if it already exists.
 	// Returns true if the file was created or opened.
@@ -162,6 +493,37 @@ public:
 	bool GetFile(const FsPath& InFileName, FsFileDescriptor& OutFileDescriptor);
 	bool GetFileSize(const FsPath& InFileName, uint64& OutFileSize);
 	bool GetTotalAndFreeBytes(uint64& OutTotalBytes, uint64& OutFreeBytes);
+
+	// Moves a file whose extents are spread over the partition into as few contiguous runs as possible.
+	// The data is copied to the new blocks before the file is pointed at them, so the file is never left half moved.
+	bool DefragmentFile(const FsPath& InPath, uint64* OutBytesMoved = nullptr);
+
+	// Defragments files until about MaxBytesToMove bytes have been moved, so a volume can be defragmented a slice at a time between other work.
+	// A file is always moved in one go, so a slice can go over the budget by up to one file. Returns true once the pass has finished.
+	bool DefragmentVolumeStep(FsDefragmentPass& Pass, uint64 MaxBytesToMove);
+
+	// The amount of separate runs of blocks the file is stored in, 1 means the file is contiguous
+	uint64 GetFileFragmentCount(const FsPath& InPath);
+
+	// Allocates blocks for and writes out any data staged for the file by delayed allocation.
+	// Does nothing if delayed allocation is off or nothing is staged.
+	bool FlushFile(const FsPath& InPath);
+
+	// Gives the file enough blocks for Length bytes of content in as few contiguous runs as possible, without writing the content.
+	// The preallocated range reads back as zeros until it is written.
+	bool PreallocateFile(const FsPath& InPath, uint64 Length, FsPreallocateMode Mode);
+
+	// Sets the file's size to NewSize. Shrinking frees every block past the new end in one go, including space preallocated past the old size.
+	// Growing leaves a hole, so it takes no blocks until the new range is written.
+	bool TruncateFile(const FsPath& InPath, uint64 NewSize);
+	bool FlushAllFiles();
+
+	// Sends every pending discard to the storage. Only needed with deferred discard, such as before unmounting.
+	bool FlushDiscards();
+
+	// Counts the used blocks by scanning the whole block buffer and compares it against the stored used block count.
+	// If they differ, the stored count is corrected and saved. Returns false if the stored count was wrong.
+	bool RecountUsedBlocks();
 	uint64 GetTotalUsableSpace()
 	{
 		return GetContentEndOffset() - GetContentStartOffset();
@@ -183,46 +545,290 @@ public:
 		return BlockSize;
 	}
 
+	const FsMountOptions& GetMountOptions() const
+	{
+		return MountOptions;
+	}
+
 protected:
 
-	void ValidateFileWrite(const FsPath& InPath, const uint8* Source, uint64 InOffset, uint64 InLength);
+	// Reads the write back and checks it matches the source, as WriteVerifyMode asks. Returns false if it doesn't.
+	bool ValidateFileWrite(const FsPath& InPath, const uint8* Source, uint64 InOffset, uint64 InLength);
+	bool ValidateFileWriteChecksum(const FsPath& NormalizedPath, const uint8* Source, uint64 InOffset, uint64 InLength);
+
+	// Whether the write being finished should be read back, counting writes for sampled verification
+	bool ShouldVerifyWrite();
+	uint64 WritesSinceVerify = 0;
 
 	void LogAllFiles_Internal(const FsDirectoryDescriptor& CurrentDirectory, uint64 Depth);
 
-	bool CreateDirectory_Internal(const FsPath& InDirectoryName, FsDirectoryDescriptor& CurrentDirectory, bool& bOutNeedsResave);
+	bool CreateDirectory_Internal(const FsPath& InDirectoryName, const FsPath& CurrentDirectoryPath, FsDirectoryDescriptor& CurrentDirectory, bool& bOutNeedsResave);
 	bool GetDirectory_Internal(const FsPath& InDirectoryName, const FsDirectoryDescriptor& CurrentDirectory, FsDirectoryDescriptor& OutDirectory, FsFileDescriptor* OutDirectoryFile);
-	bool CreateFile_Internal(const FsPath& FileName, FsDirectoryDescriptor& CurrentDirectory, bool& bOutNeedsResave);
+	bool CreateFile_Internal(const FsPath& FileName, const FsPath& CurrentDirectoryPath, FsDirectoryDescriptor& CurrentDirectory, bool& bOutNeedsResave);
+
+	// Reads the file's block map, or copies it from the cache.
+	bool LoadBlockMap(const FsPath& InPath, const FsFileDescriptor& FileDescriptor, FsBlockMap& OutBlockMap);
+
+	// Returns the file's cached block map, loading it first if needed. Only valid until the cache next changes.
+	const FsBlockMap* GetBlockMap(const FsPath& InPath, const FsFileDescriptor& FileDescriptor);
+
+	// Writes the block map to its blocks, taking or freeing map blocks so the extents fit, and points the file at it.
+	// Only updates the file descriptor, the caller saves its directory.
+	// If OutFreedMapRuns is given, map blocks no longer needed are added to it instead of being freed, so the caller can free them once the directory no longer points at them.
+	bool SaveBlockMap(const FsPath& InPath, FsFileDescriptor& FileDescriptor, FsBlockMap& InOutBlockMap, FsBlockRunArray* OutFreedMapRuns = nullptr);
+
+	// Maps a run of blocks into the file at FileBlockIndex, which must be in a hole.
+	// Joins the run onto the extents either side of it when it carries straight on from them in both the file and the partition.
+	static void AddExtent(FsBlockMap& InOutBlockMap, uint64 FileBlockIndex, const FsBlockRun& Run);
+
+	// Finds the first extent that ends after FileBlockIndex with a binary search. Returns the extent count if there is none.
+	static uint64 FindExtentIndex(const FsFileExtentArray& Extents, uint64 FileBlockIndex);
+
+	// Splits Length bytes of the file starting at Offset into the part that lands in each extent
+	void GetContentRanges(const FsFileExtentArray& Extents, uint64 Offset, uint64 Length, FsArray<FsContentRange>& OutRanges) const;
+
+	// The amount of extents that fit in one block of a block map
+	uint64 GetExtentsPerMapBlock() const
+	{
+		return (BlockSize - sizeof(FsBlockMapHeader)) / sizeof(FsFileExtent);
+	}
+
+	// Gets the runs of blocks holding the file's content.
+	static FsBlockRunArray GetBlockRunsForExtents(const FsFileExtentArray& Extents);
+
+	// Gets every run of blocks owned by the file, its content and its map.
+	static FsBlockRunArray GetBlockRunsForMap(const FsBlockMap& BlockMap);
 
-	// Gets all the chunks for the given file, optionally only getting chunks up to a certain file length.
-	FsArray<FsFileChunkHeader> GetAllChunksForFile(const FsPath& InPath, const FsFileDescriptor& FileDescriptor, const uint64* OptionalFileLength = nullptr);
+	bool WriteToFile_Internal(const FsPath& NormalizedPath, const uint8* Source, uint64 InOffset, uint64 InLength);
 
-	// Compares the file size to the amount of blocks allocated to the file.
-	uint64 GetFreeAllocatedSpaceInFileChunks(const FsPath& InPath, const FsFileDescriptor& FileDescriptor, const FsArray<FsFileChunkHeader>* OptionalInChunks);
+	// Writes to the file past the write-back buffer, staging it if delayed allocation is on
+	bool CommitWrite(const FsPath& NormalizedPath, const uint8* Source, uint64 InOffset, uint64 InLength);
 
-	uint64 GetAllocatedSpaceInFileChunks(const FsArray<FsFileChunkHeader>& InChunks);
+	// Adds the write to the file's write-back buffer, committing what was buffered first if the write doesn't touch it
+	bool BufferWrite(const FsPath& NormalizedPath, const uint8* Source, uint64 InOffset, uint64 InLength);
 
-	bool WriteEntireFile_Internal(FsFileDescriptor& FileDescriptor, const uint8* Source, uint64 Length);
+	// Writes out and drops the file's write-back buffer. Does nothing if nothing is buffered.
+	bool CommitWriteBack(const FsPath& NormalizedPath);
+
+	// Commits every write-back buffer older than WriteBackMaxAgeMilliseconds
+	bool CommitExpiredWriteBacks();
+
+	// Flushes the file, or every file below it if it is a directory, leaving other files' writes in memory
+	bool FlushFilesUnderPath(const FsPath& NormalizedPath);
+	FsWriteBack* GetWriteBack(const FsPath& NormalizedPath);
+	const FsWriteBack* GetWriteBack(const FsPath& NormalizedPath) const;
+
+	// Drops the file's write-back buffer without writing it
+	void DiscardWriteBack(const FsPath& NormalizedPath);
+
+	// Copies whatever is buffered for the part of the file being read over the read
+	void CopyFromWriteBack(const FsPath& NormalizedPath, uint64 Offset, uint8* Destination, uint64 Length) const;
+
+	// Allocates blocks for the holes between Offset and Offset + Length, and saves the block map if it changed.
+	// New blocks below the file's written size are cleared, apart from the range itself when bRangeIsWritten says the caller writes all of it next.
+	// Only updates the file descriptor, the caller saves its directory.
+	bool AllocateFileSpace(const FsPath& NormalizedPath, FsFileDescriptor& File, FsBlockMap& InOutBlockMap, uint64 Offset, uint64 Length, bool bRangeIsWritten);
+
+	// Allocates blocks for one hole and maps them into the file, without saving the map
+	bool AllocateHole(const FsPath& NormalizedPath, FsBlockMap& InOutBlockMap, uint64 FileBlockIndex, uint64 Blocks);
+
+	// Writes an inline file's content to new blocks and empties its InlineData.
+	// Only updates the file descriptor, the caller saves its directory.
+	bool MoveInlineDataToBlocks(const FsPath& NormalizedPath, FsFileDescriptor& File, FsBlockMap& InOutBlockMap);
+
+	// Writes zeros over the file content between StartOffset and EndOffset, which must already have blocks
+	bool ZeroFileRange(const FsPath& NormalizedPath, const FsBlockMap& BlockMap, uint64 StartOffset, uint64 EndOffset);
+	bool StageDelayedWrite(const FsPath& NormalizedPath, uint64 StagingStart, const uint8* Source, uint64 InOffset, uint64 InLength);
+
+	// How many free blocks are held back for a file with this many bytes staged
+	uint64 GetDelayedWriteReservedBlocks(uint64 StagedLength) const;
+	FsDelayedWrite* GetDelayedWrite(const FsPath& NormalizedPath);
+	const FsDelayedWrite* GetDelayedWrite(const FsPath& NormalizedPath) const;
+
+	// Drops the staged data for the file and releases its reserved blocks
+	void DiscardDelayedWrite(const FsPath& NormalizedPath);
+
+	// Drops staged and buffered bytes past NewSize, so truncating a file never writes data it is about to lose
+	void TrimBufferedWrites(const FsPath& NormalizedPath, uint64 NewSize);
+
+	// Grows the reported file size to cover any data staged or buffered for it
+	void ApplyBufferedWriteSize(const FsPath& NormalizedPath, FsFileDescriptor& InOutFileDescriptor) const;
 
 	virtual FilesystemReadResult Read(uint64 Offset, uint64 Length, uint8* Destination) = 0;
 	virtual FilesystemWriteResult Write(uint64 Offset, uint64 Length, const uint8* Source) = 0;
 
+	// Reads or writes several ranges in one call, so storage that can submit them together (such as with preadv and pwritev) only pays for one request.
+	// By default the ranges go through SubmitIo, with up to IoQueueDepth of them in flight at once.
+	virtual FilesystemReadResult ReadV(const FsArray<FsReadSegment>& Segments);
+	virtual FilesystemWriteResult WriteV(const FsArray<FsWriteSegment>& Segments);
+
+	// Starts a read or write without waiting for it to finish. Returns false if it couldn't be started.
+	// Storage that can keep several requests in flight, such as with a pool of worker threads or io_uring, overrides this along with WaitForIoCompletion.
+	// By default the request is carried out straight away with Read or Write, and its completion is held until it is waited for.
+	virtual bool SubmitIo(const FsIoRequest& Request);
+
+	// Blocks until one of the submitted requests has finished. Returns false if nothing is in flight.
+	virtual bool WaitForIoCompletion(FsIoCompletion& OutCompletion);
+
+	// The current time in milliseconds from any fixed starting point, used to commit write-back buffers that have been held too long.
+	// Storage that doesn't override this only commits them on size or flushes.
+	virtual uint64 GetTimeMilliseconds()
+	{
+		return 0;
+	}
+
+	// Tells the storage that a range no longer holds anything, so it can release it, like TRIM on an SSD or punching a hole in an image file.
+	// The range is always whole blocks. Storage that can't do this doesn't need to override it.
+	virtual FilesystemDiscardResult Discard(uint64 /*Offset*/, uint64 /*Length*/)
+	{
+		return FilesystemDiscardResult::Unsupported;
+	}
+
 	friend class CheckImplementer;
 	friend class FsLogger;
 	friend class FsMemory;
 
 	void LoadOrCreateFilesystemHeader();
-	void SaveFilesystemHeader(const FsFilesystemHeader& InHeader);
+	// Saves the header with the current used block count filled in
+	void SaveFilesystemHeader(FsFilesystemHeader& InOutHeader);
+
+	// Rewrites only the used block count in the saved header, leaving the root directory after it alone
+	void SaveUsedBlocksCount();
 	void SetBlocksInUse(const FsBlockArray& BlockIndices, bool bInUse);
+	void SetBlockRunsInUse(const FsBlockRunArray& Runs, bool bInUse);
+
+	// Submits the requests, keeping up to IoQueueDepth of them in flight, and waits for all of them to finish.
+	// Stops submitting after the first failure, but still waits for the requests already in flight.
+	bool RunIoRequests(const FsArray<FsIoRequest>& Requests);
+
+	// Updates the block buffer, used block count and free space tree for one run, without saving anything.
+	// The run must be inside one allocation group, and the caller must hold that group's lock.
+	void SetBlockRunInUse_Internal(const FsBlockRun& Run, bool bInUse);
+
+	// Adds freed blocks to the pending discards, merging them with any pending run they touch.
+	// Returns true once the pending discards should be sent.
+	bool QueueDiscard(const FsBlockRun& Run);
+
+	// Sets a free run's bits so the allocator skips it while it is discarded, or clears them again afterwards.
+	// The run must be inside one allocation group, and the caller must hold that group's lock.
+	void ClaimRunForDiscard(const FsBlockRun& Run, bool bClaim);
+
+	// Writes back the dirty block buffer pages and the used block count.
+	void SaveBlockBufferChanges();
 	void ClearBlockBuffer();
-	FsBitArray ReadBlockBuffer();
+	void LoadBlockBuffer();
+
+	// Marks the block buffer pages holding the bits for the given blocks as needing to be written back.
+	void MarkBlockBufferDirty(uint64 StartBlockIndex, uint64 Blocks);
+
+	// Writes every dirty block buffer page back to the partition, merging adjacent pages into a single write.
+	// The caller must hold BlockBufferFlushLock and no allocation group locks.
+	bool FlushBlockBuffer();
 	FsBlockArray GetFreeBlocks(uint64 NumBlocks);
+
+	// Finds and marks as in use runs of free blocks adding up to Blocks blocks, in as few runs as possible.
+	// The search starts at GoalBlockIndex and wraps around to the start of the partition if nothing after it fits.
+	// Returns an empty array if there is not enough free space, in which case nothing is marked.
+	FsBlockRunArray AllocateBlockRuns(uint64 Blocks, uint64 GoalBlockIndex);
+
+	// Finds and marks a run of Blocks free blocks at or after MinStartBlockIndex in one allocation group.
+	// If bAllowShorterRun is set, the run can be shorter when the group has no run that long.
+	bool AllocateRunInGroup(uint64 GroupIndex, uint64 MinStartBlockIndex, uint64 Blocks, bool bAllowShorterRun, FsBlockRun& OutRun);
+
+	// Finds and marks the shortest free run of at least Blocks blocks in any allocation group, preferring the goal group when runs are as short.
+	bool AllocateBestFitRun(uint64 GoalGroupIndex, uint64 Blocks, FsBlockRun& OutRun);
+
+	// Grows the last extent of a file into the free blocks directly after it, by up to Blocks blocks.
+	// Only updates the extent in InOutBlockMap, the caller saves the map. Returns the amount of blocks added.
+	uint64 ExtendLastExtent(FsBlockMap& InOutBlockMap, uint64 Blocks);
 	bool GetUsedBlocksCount(uint64& OutUsedBlocks);
+	uint64 CountUsedBlocks() const;
 
 	FsDirectoryDescriptor ReadFileAsDirectory(const FsFileDescriptor& FileDescriptor);
+
+	// Adds the path of every file below the given directory to OutFiles
+	void GatherFilePaths(const FsPath& DirectoryPath, const FsDirectoryDescriptor& Directory, FsArray<FsPath>& OutFiles);
+
+	// Counts the runs that are not directly after the run before them
+	static uint64 CountFragments(const FsBlockRunArray& Runs);
+
+	// Rewrites every directory below the given one in the current layout, moving files from before FromVersion's layout too
+	bool UpgradeDirectories(const FsPath& DirectoryPath, FsDirectoryDescriptor& Directory, uint64 FromVersion);
+
+	// Copies a file stored as a chain of chunks to new blocks described by a block map, then frees the chunks
+	bool UpgradeFileToBlockMap(const FsPath& FilePath, FsFileDescriptor& File);
+
+	// The layout directories on the partition are stored in. Only older than FS_VERSION_NUMBER while they are being upgraded.
+	uint64 DirectoryVersion = FS_VERSION_NUMBER;
 	bool SaveDirectory(const FsDirectoryDescriptor& Directory, uint64 AbsoluteOffset);
 
+	// Whether the directory would fit in its block, or in the header for the root directory, once saved
+	bool DirectoryFits(const FsDirectoryDescriptor& Directory) const;
+
+	// Moves inline files out of the directory, largest first, until it fits. Fails if it still doesn't fit without any.
+	// Only updates the file descriptors, the caller saves the directory.
+	bool MakeRoomInDirectory(const FsPath& DirectoryPath, FsDirectoryDescriptor& Directory);
+
 	FsDirectoryDescriptor RootDirectory{};
 
+	// The block buffer is loaded once during Initialize and kept resident, so allocations never have to re-read it.
+	FsBitArray BlockBuffer;
+
+	// One bit per block sized page of the block buffer. Set when the page has changed since it was last written back.
+	FsBitArray DirtyBlockBufferPages;
+
+	// Splits the content blocks into allocation groups and builds their free space trees from the block buffer.
+	void BuildAllocationGroups();
+	uint64 GetAllocationGroupIndex(uint64 BlockIndex) const;
+
+	// Where the first blocks of a new file should go, based on the calling thread's allocation group.
+	uint64 GetNewFileGoalBlockIndex();
+
+	// The content blocks split into groups, each with a summary of its free runs so space can be found without scanning the block buffer.
+	FsArray<FsAllocationGroup> AllocationGroups;
+
+	// Guards the dirty page bits, which are shared by every allocation group. Taken after a group's lock, never before one.
+	FsSpinLock BlockBufferLock;
+
+	// Held while block buffer pages and the used block count are written back, so an older copy of a page is never written over a newer one.
+	// Only ever taken with TryLock, so no thread spins while another one writes. Taken before any allocation group lock.
+	FsSpinLock BlockBufferFlushLock;
+
+	// Counts calls to SaveBlockBufferChanges, so the thread writing back can tell whether anything changed while it wrote
+	volatile uint64 BlockBufferChanges = 0;
+
+	// The amount of blocks in use, persisted in the filesystem header so it never needs to be counted from the block buffer.
+	// Allocation groups update it at the same time, so it is only changed with FsAtomicAdd64.
+	volatile uint64 UsedBlocks = 0;
+
+	FsMountOptions MountOptions;
+
+	// Data waiting for delayed allocation, at most one entry per file
+	FsArray<FsDelayedWrite> DelayedWrites;
+
+	// The blocks held back by every entry in DelayedWrites
+	uint64 ReservedBlocks = 0;
+
+	// Writes waiting to be committed by write-back, at most one entry per file
+	FsArray<FsWriteBack> WriteBacks;
+
+	// Freed runs that have not been discarded yet. Adjacent runs are merged so the storage gets large extents.
+	FsBlockRunArray PendingDiscards;
+	uint64 PendingDiscardBlocks = 0;
+
+	// Set once Discard says the storage can't discard
+	bool bDiscardUnsupported = false;
+
+	// Guards the pending discards, which blocks freed in any allocation group are added to. Only held while the list changes.
+	FsSpinLock PendingDiscardsLock;
+
+	// Free runs FlushDiscards is sending to the storage. Their bits are set so they can't be allocated and written mid discard.
+	// Guarded by BlockBufferLock.
+	FsBlockRunArray DiscardingRuns;
+
+	// Requests the default SubmitIo has already carried out, waiting to be picked up by WaitForIoCompletion
+	FsArray<FsIoCompletion> CompletedIo;
+
 	uint64 PartitionSize;
 	uint64 BlockSize;
 
@@ -235,6 +841,13 @@ protected:
 		return ByteAmount;
 	}
 
+	// The amount of block sized pages needed to store the block buffer.
+	uint64 GetBlockBufferPageCount() const
+	{
+		const uint64 ByteAmount = GetBlockBufferSizeBytes();
+		return ByteAmount % BlockSize == 0 ? ByteAmount / BlockSize : ByteAmount / BlockSize + 1;
+	}
+
 	uint64 GetContentStartOffset() const
 	{
 		const uint64 BlockBufferOffset = GetBlockBufferOffset();
@@ -264,6 +877,12 @@ protected:
 		return BitAmount;
 	}
 
+	// The first block index that can hold content. Blocks before it overlap the header and the block buffer.
+	uint64 GetMinBlockIndex() const
+	{
+		return GetContentStartOffset() / BlockSize;
+	}
+
 	uint64 GetBlockBufferOffset() const
 	{
 		if (BlockSize > FS_HEADER_MAXSIZE)
@@ -277,33 +896,53 @@ protected:
 	{
 		const uint64 Result = GetBlockBufferOffset() + BlockIndex * BlockSize;
 		// Sanity check its aligned to block size
-		fsCheck(Result % BlockSize == 0, "Block index is not aligned to block size");
+		fsCheckDebug(Result % BlockSize == 0, "Block index is not aligned to block size");
 		return Result;
 	}
 
 	uint64 AbsoluteOffsetToBlockIndex(uint64 AbsoluteOffset) const
 	{
-		fsCheck(AbsoluteOffset >= GetBlockBufferOffset(), "Absolute offset is before the block buffer");
-		fsCheck(AbsoluteOffset % BlockSize == 0, "Absolute offset must be aligned to the block size");
+		fsCheckDebug(AbsoluteOffset >= GetBlockBufferOffset(), "Absolute offset is before the block buffer");
+		fsCheckDebug(AbsoluteOffset % BlockSize == 0, "Absolute offset must be aligned to the block size");
 		const uint64 Result = (AbsoluteOffset - GetBlockBufferOffset()) / BlockSize;
 		return Result;
 	}
 
 	bool WriteSingleChunk(const FsBitArray& ChunkData, uint64 AbsoluteOffset);
 
-	void CacheChunks(const FsPath& FileName, const FsArray<FsFileChunkHeader>& Chunks);
-	void ClearCachedChunks(const FsPath& FileName);
-	bool GetCachedChunks(const FsPath& FileName, FsArray<FsFileChunkHeader>& OutChunks);
-	FsArray<FsCachedChunkList> CachedChunks;
+	void CacheBlockMap(const FsPath& FileName, const FsBlockMap& BlockMap);
+	void ClearCachedBlockMap(const FsPath& FileName);
+	FsBlockMap* GetCachedBlockMap(const FsPath& FileName);
+	static uint64 HashFileName(const FsPath& FileName);
+
+	// FNV-1a, carrying on from Hash so a range can be hashed a piece at a time
+	static uint64 HashBytes(const uint8* Data, uint64 Length, uint64 Hash = FS_HASH_SEED);
+	FsArray<FsCachedBlockMap> CachedBlockMaps;
 
 	void CacheDirectory(uint64 Offset, const FsDirectoryDescriptor& Directory);
 	void ClearCachedDirectory(uint64 Offset);
 	bool GetCachedDirectory(uint64 Offset, FsDirectoryDescriptor& OutDirectory);
 	FsArray<FsCachedDirectory> CachedDirectories;
 
-	FsArray<uint8>* CacheRead(uint64 BlockIndex);
-	void ClearCachedRead(uint64 BlockIndex);
-	FsArray<uint8>* GetCachedRead(uint64 BlockIndex);
-	FsArray<FsReadCache> CachedReads;
+	// Copies the read from content already read ahead for the file. Returns false if it isn't all there.
+	bool ReadFromReadAhead(const FsPath& NormalizedPath, uint64 Offset, uint8* Destination, uint64 Length);
+
+	// Tracks whether the file is being read in order after a read, and starts reading the next window ahead once the reader has used up the last one
+	void UpdateReadAhead(const FsPath& NormalizedPath, const FsFileDescriptor& File, uint64 Offset, uint64 Length, bool bReadFromReadAhead);
+
+	// Submits reads for WindowBytes of the file from StartOffset into the stream's buffer, without waiting for them
+	void StartReadAhead(FsReadAheadStream& Stream, const FsPath& NormalizedPath, const FsFileDescriptor& File, uint64 StartOffset, uint64 WindowBytes);
+
+	// Waits for every request still filling the stream's buffer
+	void WaitForReadAhead(FsReadAheadStream& Stream);
+	void OnReadAheadCompleted(const FsIoCompletion& Completion);
+
+	// Forgets the file's stream and what was read ahead for it, for when its content or blocks change
+	void DropReadAhead(const FsPath& NormalizedPath);
+	void RemoveReadAheadStream(uint64 StreamIndex);
+	FsReadAheadStream* GetReadAheadStream(const FsPath& NormalizedPath);
+	FsArray<FsReadAheadStream> ReadAheadStreams;
+	uint64 NextReadAheadId = 1;
+	uint64 ReadAheadClock = 0;
 };
 
@@ -6,6 +6,7 @@
 #include "FsLogger.h"
 #include "FsNew.h"
 #include "FsTypeTraits.h"
+#include "FsBitUtil.h"
 
 template<typename TElement>
 class FsBaseArray;
@@ -151,7 +152,7 @@ public:
 	void Add(const TElement& Element)
 	{
 		EnsureCapacityForNewElements(1);
-		fsCheck(Count < GetCapacity(), "Count is greater than capacity");
+		fsCheckDebug(Count < GetCapacity(), "Count is greater than capacity");
 
 		// Initialize the new memory in place by calling its constructor
 		new(GetData() + Count) TElement(Element);
@@ -164,7 +165,7 @@ public:
 	// @param Element The element to insert
 	void InsertAt(uint64 Index, const TElement& Element)
 	{
-		fsCheck(Index <= Count, "Index out of bounds");
+		fsCheckDebug(Index <= Count, "Index out of bounds");
 		EnsureCapacityForNewElements(1);
 		for (uint64 i = Count; i > Index; i--)
 		{
@@ -200,8 +201,8 @@ public:
 	// @param Amount The number of elements to remove
 	void RemoveAt(uint64 Index, uint64 Amount = 1)
 	{
-		fsCheck(Index < Count, "Index out of bounds");
-		fsCheck(Index + Amount <= Count, "Amount out of bounds");
+		fsCheckDebug(Index < Count, "Index out of bounds");
+		fsCheckDebug(Index + Amount <= Count, "Amount out of bounds");
 		for (uint64 i = Index; i < Count - Amount; i++)
 		{
 			GetData()[i] = GetData()[i + Amount];
@@ -320,14 +321,14 @@ public:
 	// @brief Returns the element at the specified index
 	TElement& operator[](uint64 Index)
 	{
-		fsCheck(Index < Count, "Index out of bounds");
+		fsCheckDebug(Index < Count, "Index out of bounds");
 		return GetData()[Index];
 	}
 
 	// @brief Returns the element at the specified index
 	const TElement& operator[](uint64 Index) const
 	{
-		fsCheck(Index < Count, "Index out of bounds");
+		fsCheckDebug(Index < Count, "Index out of bounds");
 		return GetData()[Index];
 	}
 
@@ -472,8 +473,8 @@ public:
 		// Empty this array to make sure the elements are destructed. Make sure it shrinks to free memory.
 		Empty(true);
 
-		fsCheck(Allocator.GetCapacity() == 0, "Capacity should be 0 after empty");
-		fsCheck(GetData() == nullptr, "Data must be nullptr after emptying");
+		fsCheckDebug(Allocator.GetCapacity() == 0, "Capacity should be 0 after empty");
+		fsCheckDebug(GetData() == nullptr, "Data must be nullptr after emptying");
 
 		FsDirectAllocatorAccessor::SetAllocatorData(&Allocator, Other.Allocator.GetData());
 		FsDirectAllocatorAccessor::SetAllocatorCapacity(&Allocator, Other.Allocator.GetCapacity());
@@ -610,7 +611,7 @@ public:
 	// @return True if the bit is set
 	bool GetBit(uint64 Index) const
 	{
-		fsCheck(Index < BitCount, "Index out of bounds");
+		fsCheckDebug(Index < BitCount, "Index out of bounds");
 		return (InternalArray[Index / 8] & (1 << (Index % 8))) != 0;
 	}
 
@@ -619,7 +620,7 @@ public:
 	// @param bValue The value to set
 	void SetBit(uint64 Index, bool bValue)
 	{
-		fsCheck(Index < BitCount, "Index out of bounds");
+		fsCheckDebug(Index < BitCount, "Index out of bounds");
 		if (bValue)
 		{
 			InternalArray[Index / 8] |= 1 << (Index % 8);
@@ -630,6 +631,74 @@ public:
 		}
 	}
 
+	// @brief Finds the first bit that is not set, checking a 64 bit word at a time
+	// @param StartIndex The first bit to check
+	// @param EndIndex One past the last bit to check
+	// @param OutIndex The index of the clear bit that was found
+	// @return True if a clear bit was found in the range
+	bool FindFirstClearBit(uint64 StartIndex, uint64 EndIndex, uint64& OutIndex) const
+	{
+		return FindFirstBitWithValue(StartIndex, EndIndex, false, OutIndex);
+	}
+
+	// @brief Finds the first bit that is set, checking a 64 bit word at a time
+	// @param StartIndex The first bit to check
+	// @param EndIndex One past the last bit to check
+	// @param OutIndex The index of the set bit that was found
+	// @return True if a set bit was found in the range
+	bool FindFirstSetBit(uint64 StartIndex, uint64 EndIndex, uint64& OutIndex) const
+	{
+		return FindFirstBitWithValue(StartIndex, EndIndex, true, OutIndex);
+	}
+
+	// @brief Counts the set bits in a range, a 64 bit word at a time
+	// @param StartIndex The first bit to count
+	// @param EndIndex One past the last bit to count
+	// @return The number of set bits
+	uint64 CountSetBits(uint64 StartIndex, uint64 EndIndex) const
+	{
+		fsCheckDebug(StartIndex <= EndIndex && EndIndex <= BitCount, "Index out of bounds");
+		const uint8* const Bytes = InternalArray.GetData();
+
+		uint64 Count = 0;
+		uint64 Index = StartIndex;
+		while (Index < EndIndex && Index % 64 != 0)
+		{
+			Count += (Bytes[Index / 8] >> (Index % 8)) & 1;
+			Index++;
+		}
+
+		while (Index + 64 <= EndIndex)
+		{
+			Count += FsCountSetBits64(FsLoadWord64(Bytes + Index / 8));
+			Index += 64;
+		}
+
+		while (Index < EndIndex)
+		{
+			Count += (Bytes[Index / 8] >> (Index % 8)) & 1;
+			Index++;
+		}
+
+		return Count;
+	}
+
+	// @brief Sets all the bits in a range, a 64 bit word at a time
+	// @param StartIndex The first bit to set
+	// @param Amount The number of bits to set
+	void SetBitRange(uint64 StartIndex, uint64 Amount)
+	{
+		SetBitRangeToValue(StartIndex, Amount, true);
+	}
+
+	// @brief Clears all the bits in a range, a 64 bit word at a time
+	// @param StartIndex The first bit to clear
+	// @param Amount The number of bits to clear
+	void ClearBitRange(uint64 StartIndex, uint64 Amount)
+	{
+		SetBitRangeToValue(StartIndex, Amount, false);
+	}
+
 	// @brief Returns the number of bits in the array
 	uint64 BitLength() const
 	{
@@ -707,7 +776,7 @@ public:
 	{
 		Empty();
 
-		fsCheck(InternalArray.Allocator.GetCapacity() == 0, "Capacity should be 0 after empty");
+		fsCheckDebug(InternalArray.Allocator.GetCapacity() == 0, "Capacity should be 0 after empty");
 
 		InternalArray = FsMove(Other.InternalArray);
 
@@ -718,6 +787,96 @@ public:
 	}
 
 protected:
+	bool FindFirstBitWithValue(uint64 StartIndex, uint64 EndIndex, bool bValue, uint64& OutIndex) const
+	{
+		fsCheckDebug(EndIndex <= BitCount, "Index out of bounds");
+		const uint8* const Bytes = InternalArray.GetData();
+
+		// Bit N is stored in byte N / 8, so on little endian targets a 64 bit load puts bit N at position N % 64.
+		// XOR with this to turn every bit we are looking for into a 1
+		const uint64 FlipMask = bValue ? 0ull : ~0ull;
+
+		uint64 Index = StartIndex;
+		while (Index < EndIndex && Index % 64 != 0)
+		{
+			if (((Bytes[Index / 8] >> (Index % 8)) & 1) == static_cast<uint8>(bValue))
+			{
+				OutIndex = Index;
+				return true;
+			}
+			Index++;
+		}
+
+		// Skip over long stretches of bits we are not looking for 128 bits at a time
+		const uint8 SkipByte = bValue ? 0x00 : 0xFF;
+		while (Index + 128 <= EndIndex && FsAre16BytesEqualTo(Bytes + Index / 8, SkipByte))
+		{
+			Index += 128;
+		}
+
+		while (Index + 64 <= EndIndex)
+		{
+			const uint64 Word = FsLoadWord64(Bytes + Index / 8) ^ FlipMask;
+			if (Word != 0)
+			{
+				OutIndex = Index + FsCountTrailingZeros64(Word);
+				return true;
+			}
+			Index += 64;
+		}
+
+		while (Index < EndIndex)
+		{
+			if (((Bytes[Index / 8] >> (Index % 8)) & 1) == static_cast<uint8>(bValue))
+			{
+				OutIndex = Index;
+				return true;
+			}
+			Index++;
+		}
+
+		return false;
+	}
+
+	void SetBitRangeToValue(uint64 StartIndex, uint64 Amount, bool bValue)
+	{
+		fsCheckDebug(StartIndex + Amount <= BitCount, "Index out of bounds");
+		uint8* const Bytes = InternalArray.GetData();
+
+		const uint64 EndIndex = StartIndex + Amount;
+		uint64 Index = StartIndex;
+		while (Index < EndIndex && Index % 64 != 0)
+		{
+			SetBitUnchecked(Bytes, Index, bValue);
+			Index++;
+		}
+
+		const uint64 FillWord = bValue ? ~0ull : 0ull;
+		while (Index + 64 <= EndIndex)
+		{
+			FsStoreWord64(Bytes + Index / 8, FillWord);
+			Index += 64;
+		}
+
+		while (Index < EndIndex)
+		{
+			SetBitUnchecked(Bytes, Index, bValue);
+			Index++;
+		}
+	}
+
+	static void SetBitUnchecked(uint8* Bytes, uint64 Index, bool bValue)
+	{
+		if (bValue)
+		{
+			Bytes[Index / 8] |= 1 << (Index % 8);
+		}
+		else
+		{
+			Bytes[Index / 8] &= ~(1 << (Index % 8));
+		}
+	}
+
 	TInternalArray InternalArray;
 	uint64 BitCount = 0;
 };
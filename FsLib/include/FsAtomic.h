@@ -0,0 +1,97 @@
+#pragma once
+#include "FsTypes.h"
+
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#endif
+
+// The library doesn't pull in the standard library, so atomics go straight to the compiler intrinsics.
+
+// Atomically adds Amount to the value and returns the new value. Subtract by passing the negated amount.
+static inline uint64 FsAtomicAdd64(volatile uint64* Value, uint64 Amount)
+{
+#if defined(__GNUC__) || defined(__clang__)
+	return __atomic_add_fetch(Value, Amount, __ATOMIC_SEQ_CST);
+#else
+	return static_cast<uint64>(_InterlockedExchangeAdd64(reinterpret_cast<volatile long long*>(Value), static_cast<long long>(Amount))) + Amount;
+#endif
+}
+
+static inline uint64 FsAtomicLoad64(const volatile uint64* Value)
+{
+#if defined(__GNUC__) || defined(__clang__)
+	return __atomic_load_n(Value, __ATOMIC_SEQ_CST);
+#else
+	return static_cast<uint64>(_InterlockedCompareExchange64(reinterpret_cast<volatile long long*>(const_cast<volatile uint64*>(Value)), 0, 0));
+#endif
+}
+
+// A lock for very short critical sections, such as searching and updating one allocation group.
+class FsSpinLock
+{
+public:
+	void Lock()
+	{
+#if defined(__GNUC__) || defined(__clang__)
+		while (__atomic_exchange_n(&bLocked, 1, __ATOMIC_ACQUIRE) != 0)
+		{
+			// Spin on a plain load so waiting threads don't keep taking the cache line
+			while (__atomic_load_n(&bLocked, __ATOMIC_RELAXED) != 0)
+			{
+			}
+		}
+#else
+		while (_InterlockedExchange(&bLocked, 1) != 0)
+		{
+			while (bLocked != 0)
+			{
+				_mm_pause();
+			}
+		}
+#endif
+	}
+
+	// Takes the lock only if it is free, without waiting. Returns true if it was taken.
+	bool TryLock()
+	{
+#if defined(__GNUC__) || defined(__clang__)
+		return __atomic_exchange_n(&bLocked, 1, __ATOMIC_ACQUIRE) == 0;
+#else
+		return _InterlockedExchange(&bLocked, 1) == 0;
+#endif
+	}
+
+	void Unlock()
+	{
+#if defined(__GNUC__) || defined(__clang__)
+		__atomic_store_n(&bLocked, 0, __ATOMIC_RELEASE);
+#else
+		_InterlockedExchange(&bLocked, 0);
+#endif
+	}
+
+private:
+	volatile long bLocked = 0;
+};
+
+// Holds a spin lock until it goes out of scope
+class FsScopedSpinLock
+{
+public:
+	FsScopedSpinLock(FsSpinLock& InLock)
+		: Lock(InLock)
+	{
+		Lock.Lock();
+	}
+
+	~FsScopedSpinLock()
+	{
+		Lock.Unlock();
+	}
+
+	FsScopedSpinLock(const FsScopedSpinLock&) = delete;
+	FsScopedSpinLock& operator=(const FsScopedSpinLock&) = delete;
+
+private:
+	FsSpinLock& Lock;
+};
@@ -51,8 +51,21 @@ public:
 	virtual bool IsReading() const = 0;
 	virtual bool IsWriting() const = 0;
 
+	// The format version of the data being read, so serializers can still load data written in older layouts.
+	// A version of 0 means the current layout, which is what every stream writes.
+	void SetVersion(uint64 InVersion)
+	{
+		Version = InVersion;
+	}
+
+	bool IsVersionBefore(uint64 InVersion) const
+	{
+		return Version != 0 && Version < InVersion;
+	}
+
 protected:
 	FsInternalBitArray* Buffer;
+	uint64 Version = 0;
 };
 
 class FsBitReader : public FsBitStream
@@ -0,0 +1,92 @@
+#pragma once
+#include "FsTypes.h"
+#include "FsMemory.h"
+
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#endif
+
+// SSE2 is part of every x64 target, so it can be used without any runtime checks there.
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define FS_HAS_SSE2 1
+#else
+#define FS_HAS_SSE2 0
+#endif
+
+// Bit arrays are read and written a word at a time, with bit I of the array as bit I % 64 of its word.
+// That only holds when the lowest byte of a word is stored first.
+#if defined(__BYTE_ORDER__) && defined(__ORDER_LITTLE_ENDIAN__) && __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "FsLib reads bit arrays a word at a time and needs a little-endian host"
+#endif
+
+// Loads 8 bytes from any address. A copy has no alignment or aliasing requirements, unlike casting the pointer.
+static inline uint64 FsLoadWord64(const uint8* Bytes)
+{
+	uint64 Word = 0;
+#if defined(__GNUC__) || defined(__clang__)
+	// The builtin is inlined to a single load
+	__builtin_memcpy(&Word, Bytes, sizeof(Word));
+#else
+	FsMemory::Copy(&Word, Bytes, sizeof(Word));
+#endif
+	return Word;
+}
+
+// Stores 8 bytes to any address
+static inline void FsStoreWord64(uint8* Bytes, uint64 Word)
+{
+#if defined(__GNUC__) || defined(__clang__)
+	__builtin_memcpy(Bytes, &Word, sizeof(Word));
+#else
+	FsMemory::Copy(Bytes, &Word, sizeof(Word));
+#endif
+}
+
+// Counts the set bits in a word
+static inline uint64 FsCountSetBits64(uint64 Word)
+{
+#if defined(__GNUC__) || defined(__clang__)
+	return static_cast<uint64>(__builtin_popcountll(Word));
+#elif defined(_MSC_VER) && defined(_M_X64)
+	return static_cast<uint64>(__popcnt64(Word));
+#else
+	Word = Word - ((Word >> 1) & 0x5555555555555555ull);
+	Word = (Word & 0x3333333333333333ull) + ((Word >> 2) & 0x3333333333333333ull);
+	Word = (Word + (Word >> 4)) & 0x0F0F0F0F0F0F0F0Full;
+	return (Word * 0x0101010101010101ull) >> 56;
+#endif
+}
+
+// Returns the index of the lowest set bit. Word must not be zero.
+static inline uint64 FsCountTrailingZeros64(uint64 Word)
+{
+#if defined(__GNUC__) || defined(__clang__)
+	return static_cast<uint64>(__builtin_ctzll(Word));
+#elif defined(_MSC_VER) && defined(_M_X64)
+	unsigned long Index = 0;
+	_BitScanForward64(&Index, Word);
+	return static_cast<uint64>(Index);
+#else
+	uint64 Index = 0;
+	while ((Word & 1) == 0)
+	{
+		Word >>= 1;
+		Index++;
+	}
+	return Index;
+#endif
+}
+
+// Checks if the 16 bytes at the given address are all equal to the given byte value.
+static inline bool FsAre16BytesEqualTo(const uint8* Bytes, uint8 Value)
+{
+#if FS_HAS_SSE2
+	const __m128i Loaded = _mm_loadu_si128(reinterpret_cast<const __m128i*>(Bytes));
+	const __m128i Compare = _mm_cmpeq_epi8(Loaded, _mm_set1_epi8(static_cast<char>(Value)));
+	return _mm_movemask_epi8(Compare) == 0xFFFF;
+#else
+	const uint64 Pattern = 0x0101010101010101ull * Value;
+	return FsLoadWord64(Bytes) == Pattern && FsLoadWord64(Bytes + 8) == Pattern;
+#endif
+}
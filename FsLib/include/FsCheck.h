@@ -6,4 +6,30 @@ public:
 	static void Check(const char* Message);
 };
 
+// Which checks are compiled in, chosen with the FSLIB_CHECK_LEVEL CMake option.
+// Each level keeps the checks of the levels before it.
+#define FS_CHECK_LEVEL_ALWAYS 0
+#define FS_CHECK_LEVEL_DEBUG 1
+#define FS_CHECK_LEVEL_PARANOID 2
+
+#ifndef FS_CHECK_LEVEL
+#define FS_CHECK_LEVEL FS_CHECK_LEVEL_DEBUG
+#endif
+
+// Always compiled in. For states the filesystem can't carry on from without damaging the partition.
 #define fsCheck(Condition, Message) if (!(Condition)) { CheckImplementer::Check(Message); }
+
+// Cheap checks that run in the innermost loops, like container bounds and block alignment
+#if FS_CHECK_LEVEL >= FS_CHECK_LEVEL_DEBUG
+#define fsCheckDebug(Condition, Message) fsCheck(Condition, Message)
+#else
+#define fsCheckDebug(Condition, Message)
+#endif
+
+// Audits that walk or reload whole structures to check they agree with each other.
+// Audits longer than one condition go inside #if FS_CHECK_LEVEL >= FS_CHECK_LEVEL_PARANOID.
+#if FS_CHECK_LEVEL >= FS_CHECK_LEVEL_PARANOID
+#define fsCheckParanoid(Condition, Message) fsCheck(Condition, Message)
+#else
+#define fsCheckParanoid(Condition, Message)
+#endif
@@ -0,0 +1,52 @@
+#pragma once
+#include "FsArray.h"
+
+// A run of free blocks
+struct FsFreeExtent
+{
+	uint64 StartBlock = 0;
+	uint64 Blocks = 0;
+};
+
+// Every free run in a range of the block buffer, kept sorted by start and by length.
+// The length order answers best fit queries with a binary search, the start order finds the runs next to a change.
+// Updates shift both arrays, which costs time linear in the amount of runs. Each index only covers one allocation group of
+// FS_ALLOCATION_GROUP_BLOCKS (65536) blocks, so there are never more than 32768 runs and the worst shift moves 512KB.
+// A group fragmented that badly is rare, most hold a few hundred runs at most, and then a shift is cheaper than a tree.
+class FsFreeExtentIndex
+{
+public:
+	// @brief Rebuilds the index from the block buffer
+	// @param BlockBuffer One bit per block, set when the block is in use
+	// @param InFirstBlock The first block that can be allocated, blocks before it are treated as in use
+	// @param InEndBlock One past the last block that can be allocated, blocks after it are treated as in use
+	void Build(const FsBitArray& BlockBuffer, uint64 InFirstBlock, uint64 InEndBlock);
+
+	// @brief Refreshes the runs touching the blocks after their bits have changed in the block buffer
+	void Update(const FsBitArray& BlockBuffer, uint64 StartBlock, uint64 Blocks);
+
+	// @brief Finds the shortest free run of at least RunLength blocks, taking the lowest one if several are as short
+	// @return false if there is no such run
+	bool FindBestFit(uint64 RunLength, FsFreeExtent& OutExtent) const;
+
+	// @brief Returns the amount of separate free runs
+	uint64 GetExtentCount() const
+	{
+		return ExtentsByStart.Length();
+	}
+
+protected:
+	// The index of the first extent starting at or after StartBlock
+	uint64 LowerBoundByStart(uint64 StartBlock) const;
+
+	// The index of the first extent that is longer than Blocks, or as long and starting at or after StartBlock
+	uint64 LowerBoundBySize(uint64 Blocks, uint64 StartBlock) const;
+
+	// Adds the free runs between RangeStart and RangeEnd, which must not overlap any extent already in the index
+	void AddFreeRuns(const FsBitArray& BlockBuffer, uint64 RangeStart, uint64 RangeEnd);
+
+	FsArray<FsFreeExtent> ExtentsByStart;
+	FsArray<FsFreeExtent> ExtentsBySize;
+	uint64 FirstBlock = 0;
+	uint64 EndBlock = 0;
+};
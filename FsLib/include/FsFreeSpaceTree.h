@@ -0,0 +1,72 @@
+#pragma once
+#include "FsArray.h"
+
+// The amount of blocks summarised by each leaf of the free space tree.
+// 4096 blocks is 512 bytes of block buffer, so scanning a single group stays cheap.
+#define FS_BLOCK_GROUP_SIZE 4096
+
+// The free space summary of a range of blocks
+struct FsFreeSpaceNode
+{
+	// The amount of free blocks in the range
+	uint64 FreeBlocks = 0;
+
+	// The length of the free run at the start of the range
+	uint64 PrefixFreeBlocks = 0;
+
+	// The length of the free run at the end of the range
+	uint64 SuffixFreeBlocks = 0;
+
+	// The length of the longest free run anywhere in the range
+	uint64 LongestFreeBlocks = 0;
+};
+
+// A segment tree over groups of blocks in a range of the block buffer.
+// Each node knows the longest free run below it, so a free run of any length can be found
+// without scanning the block buffer from the start.
+class FsFreeSpaceTree
+{
+public:
+	// @brief Rebuilds the whole tree from the block buffer
+	// @param BlockBuffer One bit per block, set when the block is in use
+	// @param InFirstBlock The first block that can be allocated, blocks before it are treated as in use
+	// @param InEndBlock One past the last block that can be allocated, blocks after it are treated as in use
+	void Build(const FsBitArray& BlockBuffer, uint64 InFirstBlock, uint64 InEndBlock);
+
+	// @brief Refreshes the groups covering the blocks after their bits have changed in the block buffer
+	void Update(const FsBitArray& BlockBuffer, uint64 StartBlock, uint64 Blocks);
+
+	// @brief Finds the first run of at least RunLength free blocks that starts at or after MinStartBlock
+	// @return false if there is no such run
+	bool FindFreeRun(const FsBitArray& BlockBuffer, uint64 MinStartBlock, uint64 RunLength, uint64& OutStartBlock) const;
+
+	// @brief Returns the length of the longest free run on the partition
+	uint64 GetLongestFreeRun() const
+	{
+		return Nodes.IsEmpty() ? 0 : Nodes[1].LongestFreeBlocks;
+	}
+
+	// @brief Returns the amount of free blocks on the partition
+	uint64 GetFreeBlocks() const
+	{
+		return Nodes.IsEmpty() ? 0 : Nodes[1].FreeBlocks;
+	}
+
+protected:
+	// Computes the summary of a single group by walking its free runs in the block buffer
+	FsFreeSpaceNode ComputeGroup(const FsBitArray& BlockBuffer, uint64 GroupIndex) const;
+
+	// Combines two neighbouring ranges, each SideLength blocks long
+	static FsFreeSpaceNode CombineNodes(const FsFreeSpaceNode& Left, const FsFreeSpaceNode& Right, uint64 SideLength);
+
+	bool FindFreeRun_Internal(const FsBitArray& BlockBuffer, uint64 NodeIndex, uint64 NodeStart, uint64 NodeLength, uint64 MinStartBlock, uint64 RunLength, uint64& OutStartBlock) const;
+
+	// Nodes are stored as an implicit binary tree, the root is at index 1 and the leaves start at LeafCount
+	FsArray<FsFreeSpaceNode> Nodes;
+	uint64 LeafCount = 0;
+	uint64 FirstBlock = 0;
+	uint64 EndBlock = 0;
+
+	// The first block of the first group, FirstBlock rounded down to a group boundary
+	uint64 BaseBlock = 0;
+};
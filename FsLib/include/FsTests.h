@@ -23,6 +23,19 @@ protected:
 	static bool StartTest(const char* TestName, FsTestResult(*TestFunction)(FsFilesystem&), FsFilesystem& InFilesystem);
 
 	static FsTestResult BitStreamTest(FsFilesystem& InFilesystem);
+	static FsTestResult BitArrayRangeTest(FsFilesystem& InFilesystem);
+	static FsTestResult FreeSpaceTreeTest(FsFilesystem& InFilesystem);
+	static FsTestResult FreeExtentIndexTest(FsFilesystem& InFilesystem);
 	static FsTestResult LargeFileTest(FsFilesystem& InFilesystem);
 	static FsTestResult MidFileWriteTest(FsFilesystem& InFilesystem);
+	static FsTestResult PreallocateTest(FsFilesystem& InFilesystem);
+	static FsTestResult TruncateTest(FsFilesystem& InFilesystem);
+	static FsTestResult SparseFileTest(FsFilesystem& InFilesystem);
+	static FsTestResult InlineFileTest(FsFilesystem& InFilesystem);
+	static FsTestResult InlineDirectoryTest(FsFilesystem& InFilesystem);
+	static FsTestResult DefragmentTest(FsFilesystem& InFilesystem);
+	static FsTestResult BlockMapTest(FsFilesystem& InFilesystem);
+	static FsTestResult ReadAheadTest(FsFilesystem& InFilesystem);
+	static FsTestResult WriteBackTest(FsFilesystem& InFilesystem);
+	static FsTestResult DelayedAllocationTest(FsFilesystem& InFilesystem);
 };
\ No newline at end of file
@@ -39,6 +39,15 @@ enum class FilesystemWriteResult : uint8
 	Failed
 };
 
+enum class FilesystemDiscardResult : uint8
+{
+	Success,
+	Failed,
+
+	// The storage can't discard, so the filesystem stops asking
+	Unsupported
+};
+
 enum class FilesystemLogType : uint8
 {
 	Verbose,
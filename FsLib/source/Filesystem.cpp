@@ -97,8 +97,9 @@ FsPath FsPath::GetSubPath() const
 	return Substring(FirstSlashIndex + 1, Length() - FirstSlashIndex - 1);
 }
 
-void FsFilesystem::Initialize()
+void FsFilesystem::Initialize(const FsMountOptions& InMountOptions)
 {
+	MountOptions = InMountOptions;
 	LoadOrCreateFilesystemHeader();
 }
 
@@ -108,7 +109,7 @@ bool FsFilesystem::CreateFile(const FsPath& InFileName)
 	FsLogger::LogFormat(FilesystemLogType::Verbose, "Creating file for %s", NormalizedPath.GetData());
 
 	bool bNeedsResave = false;
-	if (!CreateFile_Internal(NormalizedPath, RootDirectory, bNeedsResave))
+	if (!CreateFile_Internal(NormalizedPath, FsPath(""), RootDirectory, bNeedsResave))
 	{
 		return false;
 	}
@@ -124,7 +125,7 @@ bool FsFilesystem::CreateFile(const FsPath& InFileName)
 	return true;
 }
 
-bool FsFilesystem::CreateFile_Internal(const FsPath& FileName, FsDirectoryDescriptor& CurrentDirectory, bool& bOutNeedsResave)
+bool FsFilesystem::CreateFile_Internal(const FsPath& FileName, const FsPath& CurrentDirectoryPath, FsDirectoryDescriptor& CurrentDirectory, bool& bOutNeedsResave)
 {
 	const FsPath TopLevelPath = FileName.GetFirstPath();
 	const FsPath SubPath = FileName.GetSubPath();
@@ -157,9 +158,15 @@ bool FsFilesystem::CreateFile_Internal(const FsPath& FileName, FsDirectoryDescri
 			}
 
 			FsDirectoryDescriptor NextDirectory = ReadFileAsDirectory(SubDirectoryFile);
+			FsPath NextDirectoryPath = CurrentDirectoryPath;
+			if (!NextDirectoryPath.IsEmpty())
+			{
+				NextDirectoryPath.Append("/");
+			}
+			NextDirectoryPath.Append(TopLevelPath);
 
 			bool bNeedsResave = false;
-			if (!CreateFile_Internal(SubPath, NextDirectory, bNeedsResave))
+			if (!CreateFile_Internal(SubPath, NextDirectoryPath, NextDirectory, bNeedsResave))
 			{
 				return false;
 			}
@@ -191,6 +198,12 @@ bool FsFilesystem::CreateFile_Internal(const FsPath& FileName, FsDirectoryDescri
 
 	// Add the new file to the current directory and request a resave
 	CurrentDirectory.Files.Add(NewFile);
+	if (!MakeRoomInDirectory(CurrentDirectoryPath, CurrentDirectory))
+	{
+		CurrentDirectory.Files.RemoveAt(CurrentDirectory.Files.Length() - 1);
+		return false;
+	}
+
 	bOutNeedsResave = true;
 	return true;
 }
@@ -225,6 +238,7 @@ bool FsFilesystem::GetFile(const FsPath& InFileName, FsFileDescriptor& OutFileDe
 			{
 				FsLogger::LogFormat(FilesystemLogType::Verbose, "File %s exists", NormalizedPath.GetData());
 				OutFileDescriptor = File;
+				ApplyBufferedWriteSize(NormalizedPath, OutFileDescriptor);
 				return true;
 			}
 		}
@@ -246,6 +260,7 @@ bool FsFilesystem::GetFile(const FsPath& InFileName, FsFileDescriptor& OutFileDe
 		{
 			FsLogger::LogFormat(FilesystemLogType::Verbose, "File %s exists", NormalizedPath.GetData());
 			OutFileDescriptor = File;
+			ApplyBufferedWriteSize(NormalizedPath, OutFileDescriptor);
 			return true;
 		}
 	}
@@ -253,7 +268,42 @@ bool FsFilesystem::GetFile(const FsPath& InFileName, FsFileDescriptor& OutFileDe
 	return false;
 }
 
-void FsFilesystem::ValidateFileWrite(const FsPath& InPath, const uint8* Source, uint64 InOffset, uint64 InLength)
+void FsFilesystem::ApplyBufferedWriteSize(const FsPath& NormalizedPath, FsFileDescriptor& InOutFileDescriptor) const
+{
+	// Staged and buffered bytes are part of the file even though the directory doesn't know about them yet
+	const FsDelayedWrite* DelayedWrite = GetDelayedWrite(NormalizedPath);
+	if (DelayedWrite && DelayedWrite->FileOffset + DelayedWrite->Data.Length() > InOutFileDescriptor.FileSize)
+	{
+		InOutFileDescriptor.FileSize = DelayedWrite->FileOffset + DelayedWrite->Data.Length();
+	}
+
+	const FsWriteBack* WriteBack = GetWriteBack(NormalizedPath);
+	if (WriteBack && WriteBack->FileOffset + WriteBack->Data.Length() > InOutFileDescriptor.FileSize)
+	{
+		InOutFileDescriptor.FileSize = WriteBack->FileOffset + WriteBack->Data.Length();
+	}
+}
+
+bool FsFilesystem::ShouldVerifyWrite()
+{
+	switch (MountOptions.WriteVerifyMode)
+	{
+	case FsWriteVerifyMode::Off:
+		return false;
+	case FsWriteVerifyMode::Sampled:
+		WritesSinceVerify++;
+		if (WritesSinceVerify < MountOptions.WriteVerifySampleInterval)
+		{
+			return false;
+		}
+		WritesSinceVerify = 0;
+		return true;
+	default:
+		return true;
+	}
+}
+
+bool FsFilesystem::ValidateFileWrite(const FsPath& InPath, const uint8* Source, uint64 InOffset, uint64 InLength)
 {
 	const FsPath NormalizedPath = InPath.NormalizePath();
 
@@ -261,7 +311,12 @@ void FsFilesystem::ValidateFileWrite(const FsPath& InPath, const uint8* Source,
 	{
 		FsLogger::LogFormat(FilesystemLogType::Error, "ValidateFileWrite: File %s does not exist", NormalizedPath.GetData());
 		fsCheck(false, "oh no");
-		return;
+		return false;
+	}
+
+	if (MountOptions.WriteVerifyMode == FsWriteVerifyMode::Checksum)
+	{
+		return ValidateFileWriteChecksum(NormalizedPath, Source, InOffset, InLength);
 	}
 
 	// Read from the file into a temporary buffer and make sure the data is correct
@@ -273,14 +328,14 @@ void FsFilesystem::ValidateFileWrite(const FsPath& InPath, const uint8* Source,
 	{
 		FsLogger::LogFormat(FilesystemLogType::Error, "ValidateFileWrite: Failed to read file %s", NormalizedPath.GetData());
 		fsCheck(false, "oh no");
-		return;
+		return false;
 	}
 
 	if (BytesRead != InLength)
 	{
 		FsLogger::LogFormat(FilesystemLogType::Error, "ValidateFileWrite: Failed to read the correct amount of bytes from file %s", NormalizedPath.GetData());
 		fsCheck(false, "oh no");
-		return;
+		return false;
 	}
 
 	for (uint64 i = 0; i < InLength; i++)
@@ -289,860 +344,2974 @@ void FsFilesystem::ValidateFileWrite(const FsPath& InPath, const uint8* Source,
 		{
 			FsLogger::LogFormat(FilesystemLogType::Error, "ValidateFileWrite: File %s has incorrect data at byte %u", NormalizedPath.GetData(), i);
 			fsCheck(false, "oh no");
-			return;
+			return false;
 		}
 	}
 
 	FsLogger::LogFormat(FilesystemLogType::Info, "Validated write on file %s", InPath.GetData());
+	return true;
 }
 
-bool FsFilesystem::WriteToFile(const FsPath& InPath, const uint8* Source, uint64 InOffset, uint64 InLength)
+bool FsFilesystem::ValidateFileWriteChecksum(const FsPath& NormalizedPath, const uint8* Source, uint64 InOffset, uint64 InLength)
 {
-	const FsPath NormalizedPath = InPath.NormalizePath();
+	const uint64 SourceHash = HashBytes(Source, InLength);
 
-	if (!FileExists(NormalizedPath))
+	// Read back a piece at a time, so a large write doesn't need a buffer as large as it
+	const uint64 MaxPieceLength = BlockSize * 16;
+	FsArray<uint8> ReadBuffer = FsArray<uint8>();
+	ReadBuffer.FillUninitialized(InLength < MaxPieceLength ? InLength : MaxPieceLength);
+
+	uint64 StoredHash = FS_HASH_SEED;
+	uint64 Checked = 0;
+	while (Checked < InLength)
 	{
-		FsLogger::LogFormat(FilesystemLogType::Error, "File %s does not exist", NormalizedPath.GetData());
-		return false;
+		const uint64 PieceLength = InLength - Checked < ReadBuffer.Length() ? InLength - Checked : ReadBuffer.Length();
+		uint64 BytesRead = 0;
+		if (!ReadFromFile(NormalizedPath, InOffset + Checked, ReadBuffer.GetData(), PieceLength, &BytesRead) || BytesRead != PieceLength)
+		{
+			FsLogger::LogFormat(FilesystemLogType::Error, "ValidateFileWrite: Failed to read %u bytes at %u from file %s", PieceLength, InOffset + Checked, NormalizedPath.GetData());
+			fsCheck(false, "Failed to read back a write to check its checksum");
+			return false;
+		}
+
+		StoredHash = HashBytes(ReadBuffer.GetData(), PieceLength, StoredHash);
+		Checked += PieceLength;
 	}
 
-	// Get the files directory
-	const FsPath DirectoryPath = NormalizedPath.GetPathWithoutFileName();
-	FsDirectoryDescriptor Directory{};
-	FsFileDescriptor DirectoryFile{};
-	if (!GetDirectory(DirectoryPath, Directory, &DirectoryFile))
+	if (StoredHash != SourceHash)
 	{
-		FsLogger::LogFormat(FilesystemLogType::Error, "Failed to get directory for file %s", NormalizedPath.GetData());
+		FsLogger::LogFormat(FilesystemLogType::Error, "ValidateFileWrite: File %s does not hash to what was written to it at %u", NormalizedPath.GetData(), InOffset);
+		fsCheck(false, "Checksum of the data read back does not match the write");
 		return false;
 	}
 
-	const FsPath FileName = NormalizedPath.GetLastPath();
-	for (FsFileDescriptor& File : Directory.Files)
-	{
-		if (File.FileName != FileName)
-		{
-			continue;
-		}
+	FsLogger::LogFormat(FilesystemLogType::Info, "Validated write on file %s by checksum", NormalizedPath.GetData());
+	return true;
+}
 
-		// Get all the chunks for the file
-		FsArray<FsFileChunkHeader> AllChunks = GetAllChunksForFile(NormalizedPath ,File);
-		ClearCachedChunks(InPath);
+bool FsFilesystem::WriteToFile(const FsPath& InPath, const uint8* Source, uint64 InOffset, uint64 InLength)
+{
+	const FsPath NormalizedPath = InPath.NormalizePath();
 
-		const uint64 MaxWriteLength = InOffset + InLength;
-		const uint64 AllocatedSpace = GetAllocatedSpaceInFileChunks(AllChunks);
+	if (MountOptions.bWriteBack)
+	{
+		// Nothing runs between calls, so buffers held too long are committed here. Failures are logged, they belong to earlier writes.
+		CommitExpiredWriteBacks();
 
-		if (MaxWriteLength > AllocatedSpace)
+		if (Source && InLength > 0)
 		{
-			const uint64 ExtraSpaceNeeded = MaxWriteLength - AllocatedSpace;
-			// We need to allocate more space for the file
-			uint64 AdditionalBlocks = ExtraSpaceNeeded % BlockSize == 0 ? ExtraSpaceNeeded / BlockSize : ExtraSpaceNeeded / BlockSize + 1;
+			return BufferWrite(NormalizedPath, Source, InOffset, InLength);
+		}
 
-			// Consider that each block will have a chunk header, so allocate extra blocks to account for that.
-			const uint64 ContentSize = BlockSize - sizeof(FsFileChunkHeader);
-			while (AdditionalBlocks * ContentSize < MaxWriteLength)
-			{
-				AdditionalBlocks++;
-			}
+		// Extending without data goes straight to the file, so anything buffered has to go first to keep the writes in order
+		if (!CommitWriteBack(NormalizedPath))
+		{
+			return false;
+		}
+	}
 
-			FsBlockArray NewBlocks = GetFreeBlocks(AdditionalBlocks);
-			if (NewBlocks.Length() != AdditionalBlocks)
-			{
-				FsLogger::LogFormat(FilesystemLogType::Error, "Failed to find %u free blocks for file %s", AdditionalBlocks, NormalizedPath.GetData());
-				return false;
-			}
+	return CommitWrite(NormalizedPath, Source, InOffset, InLength);
+}
 
-			SetBlocksInUse(NewBlocks, true);
+bool FsFilesystem::CommitWrite(const FsPath& NormalizedPath, const uint8* Source, uint64 InOffset, uint64 InLength)
+{
+	if (!MountOptions.bDelayedAllocation)
+	{
+		return WriteToFile_Internal(NormalizedPath, Source, InOffset, InLength);
+	}
 
-			FsLogger::LogFormat(FilesystemLogType::Warning, "Allocating %u blocks for file %s", AdditionalBlocks, NormalizedPath.GetData());
+	if (!Source)
+	{
+		// Extending without data goes straight to the file, so anything staged has to go to disk first to keep the file in order
+		return FlushFile(NormalizedPath) && WriteToFile_Internal(NormalizedPath, Source, InOffset, InLength);
+	}
 
-			if (AllChunks.IsEmpty())
-			{
-				// This file is empty and has no blocks allocated.
-				// We need to adjust the file offset to the new blocks
-				File.FileOffset = BlockIndexToAbsoluteOffset(NewBlocks[0]);
-			}
-			else
-			{
-				// Update the last chunk to point to the new blocks
-				FsFileChunkHeader& LastChunk = AllChunks[AllChunks.Length() - 1];
-				LastChunk.NextBlockIndex = NewBlocks[0];
-
-				// Save the last chunk
-				const uint64 LastChunkOffset = AllChunks.Length() > 1 ? BlockIndexToAbsoluteOffset(AllChunks[AllChunks.Length() - 2].NextBlockIndex) : File.FileOffset;
-				FsBitArray LastChunkBuffer = FsBitArray();
-				FsBitWriter LastChunkWriter = FsBitWriter(LastChunkBuffer);
-				const_cast<FsFileChunkHeader&>(LastChunk).Serialize(LastChunkWriter);
-
-				const FilesystemWriteResult WriteResult = Write(LastChunkOffset, sizeof(FsFileChunkHeader), LastChunkBuffer.GetInternalArray().GetData());
-				if (WriteResult != FilesystemWriteResult::Success)
-				{
-					FsLogger::LogFormat(FilesystemLogType::Error, "Failed to write chunk for file %s", NormalizedPath.GetData());
-					return false;
-				}
-			}
+	// Holes aren't staged. A write that starts at least a block past the staged data sends it to disk and is staged on its own.
+	const FsDelayedWrite* StagedWrite = GetDelayedWrite(NormalizedPath);
+	if (StagedWrite && InOffset / BlockSize * BlockSize > StagedWrite->FileOffset + StagedWrite->Data.Length() && !FlushFile(NormalizedPath))
+	{
+		return false;
+	}
 
-			const uint64 PreviousChunksLength = AllChunks.Length();
+	FsFileDescriptor File{};
+	if (!GetFile(NormalizedPath, File))
+	{
+		FsLogger::LogFormat(FilesystemLogType::Error, "File %s does not exist", NormalizedPath.GetData());
+		return false;
+	}
 
-			// Create the new chunk headers
-			for (uint64 i = 0; i < NewBlocks.Length(); i++)
-			{
-				FsFileChunkHeader NewChunk = FsFileChunkHeader();
-				NewChunk.NextBlockIndex = i + 1 < NewBlocks.Length() ? NewBlocks[i + 1] : 0;
-				NewChunk.Blocks = 1;
-				AllChunks.Add(NewChunk);
-			}
+	// Staging assumes nothing past the file's blocks holds data, which isn't true of a file stored in its directory entry
+	if (!File.InlineData.IsEmpty())
+	{
+		return WriteToFile_Internal(NormalizedPath, Source, InOffset, InLength);
+	}
 
-			// Refresh the cache
-			CacheChunks(NormalizedPath, AllChunks);
+	// Anything past the last extent of the file is staged, the rest is written in place
+	const FsDelayedWrite* DelayedWrite = GetDelayedWrite(NormalizedPath);
+	uint64 StagingStart = 0;
+	if (DelayedWrite)
+	{
+		StagingStart = DelayedWrite->FileOffset;
+	}
+	else
+	{
+		const FsBlockMap* BlockMap = GetBlockMap(NormalizedPath, File);
+		if (!BlockMap)
+		{
+			return false;
 		}
+		StagingStart = BlockMap->GetEndFileBlockIndex() * BlockSize;
 
-		// Update the file size if we expanded the file
-		if (MaxWriteLength > File.FileSize)
+		// Staging starts at the block the write lands in, leaving a hole before it
+		if (InOffset / BlockSize * BlockSize > StagingStart)
 		{
-			File.FileSize = MaxWriteLength;
+			StagingStart = InOffset / BlockSize * BlockSize;
 		}
+	}
+	const uint64 WriteEnd = InOffset + InLength;
 
-		// For each chunk, create a buffer the size of the chunk, read the chunk, update the buffer, write the chunk
-		uint64 BytesWritten = 0;
-		uint64 CurrentOffset = 0;
-		uint64 CurrentAbsoluteOffset = File.FileOffset;
-		for (const FsFileChunkHeader& Chunk : AllChunks)
+	if (InOffset < StagingStart)
+	{
+		const uint64 InPlaceLength = (WriteEnd < StagingStart ? WriteEnd : StagingStart) - InOffset;
+		if (!WriteToFile_Internal(NormalizedPath, Source, InOffset, InPlaceLength))
 		{
-			const uint64 ChunkSize = Chunk.Blocks * BlockSize;
-			const uint64 ChunkHeaderOffset = CurrentAbsoluteOffset;
-			const uint64 ChunkHeaderLength = sizeof(FsFileChunkHeader);
-			const uint64 ChunkContentLength = ChunkSize - ChunkHeaderLength;
-			const uint64 ChunkContentOffset = CurrentAbsoluteOffset + ChunkHeaderLength;
+			return false;
+		}
+	}
+
+	if (WriteEnd <= StagingStart)
+	{
+		return true;
+	}
+
+	const uint64 StagedOffset = InOffset > StagingStart ? InOffset : StagingStart;
+	return StageDelayedWrite(NormalizedPath, StagingStart, Source + (StagedOffset - InOffset), StagedOffset, WriteEnd - StagedOffset);
+}
+
+uint64 FsFilesystem::GetDelayedWriteReservedBlocks(uint64 StagedLength) const
+{
+	// Staging always starts on a block boundary, since it starts where the file's blocks end. One more block is for the map.
+	return (StagedLength % BlockSize == 0 ? StagedLength / BlockSize : StagedLength / BlockSize + 1) + 1;
+}
+
+bool FsFilesystem::StageDelayedWrite(const FsPath& NormalizedPath, uint64 StagingStart, const uint8* Source, uint64 InOffset, uint64 InLength)
+{
+	FsDelayedWrite* DelayedWrite = GetDelayedWrite(NormalizedPath);
+	if (!DelayedWrite)
+	{
+		FsDelayedWrite NewDelayedWrite = FsDelayedWrite();
+		NewDelayedWrite.FileName = NormalizedPath;
+		NewDelayedWrite.FileOffset = StagingStart;
+		DelayedWrites.Add(NewDelayedWrite);
+		DelayedWrite = &DelayedWrites[DelayedWrites.Length() - 1];
+	}
 
-			if (CurrentOffset + ChunkSize < InOffset)
+	const uint64 StagedEnd = InOffset + InLength - DelayedWrite->FileOffset;
+	if (StagedEnd > DelayedWrite->Data.Length())
+	{
+		// Hold back enough free blocks for the staged bytes and the file's map, so the flush can't run out of space later
+		const uint64 BlocksNeeded = GetDelayedWriteReservedBlocks(StagedEnd);
+		if (BlocksNeeded > DelayedWrite->ReservedBlocks)
+		{
+			const uint64 ExtraBlocks = BlocksNeeded - DelayedWrite->ReservedBlocks;
+			const uint64 ContentBlocks = GetBlockBufferSizeBits() - GetMinBlockIndex();
+			const uint64 UnavailableBlocks = FsAtomicLoad64(&UsedBlocks) + ReservedBlocks;
+			if (UnavailableBlocks + ExtraBlocks > ContentBlocks)
 			{
-				// Skip this chunk
-				CurrentOffset += ChunkContentLength;
-				CurrentAbsoluteOffset = BlockIndexToAbsoluteOffset(Chunk.NextBlockIndex);
-				continue;
+				FsLogger::LogFormat(FilesystemLogType::Error, "Not enough free space to stage %u bytes for file %s", InLength, NormalizedPath.GetData());
+				return false;
 			}
 
-			ClearCachedRead(AbsoluteOffsetToBlockIndex(CurrentAbsoluteOffset));
+			DelayedWrite->ReservedBlocks += ExtraBlocks;
+			ReservedBlocks += ExtraBlocks;
+		}
 
-			if (!Source)
-			{
-				// We have no source data, so we are just allocating space for the file. Write the chunk headers only.
+		DelayedWrite->Data.AddZeroed(StagedEnd - DelayedWrite->Data.Length());
+	}
 
-				FsBitArray ChunkHeaderBuffer = FsBitArray();
-				FsBitWriter ChunkHeaderWriter = FsBitWriter(ChunkHeaderBuffer);
-				const_cast<FsFileChunkHeader&>(Chunk).Serialize(ChunkHeaderWriter);
+	FsMemory::Copy(DelayedWrite->Data.GetData() + (InOffset - DelayedWrite->FileOffset), Source, InLength);
 
-				// Write the updated buffer back to the chunk
-				const FilesystemWriteResult WriteResult = Write(CurrentAbsoluteOffset, ChunkHeaderLength, ChunkHeaderBuffer.GetInternalArray().GetData());
-				if (WriteResult != FilesystemWriteResult::Success)
-				{
-					FsLogger::LogFormat(FilesystemLogType::Error, "Failed to write chunk for file %s", NormalizedPath.GetData());
-					return false;
-				}
+	FsLogger::LogFormat(FilesystemLogType::Verbose, "Staged %u bytes for file %s, %u bytes staged in total", InLength, NormalizedPath.GetData(), DelayedWrite->Data.Length());
 
-				CurrentOffset += ChunkContentLength;
-				BytesWritten += ChunkContentLength; 
-			}
-			else
-			{
-				FsArray<uint8> ChunkReadBuffer = FsArray<uint8>();
-				ChunkReadBuffer.FillUninitialized(ChunkSize);
+	// Don't let one file hold an unbounded amount of memory
+	if (DelayedWrite->Data.Length() >= MountOptions.MaxDelayedBytesPerFile)
+	{
+		return FlushFile(NormalizedPath);
+	}
 
-				// Read the whole content portion of the chunk
-				const FilesystemReadResult Result = Read(ChunkContentOffset, ChunkContentLength, ChunkReadBuffer.GetData() + ChunkHeaderLength);
-				if (Result != FilesystemReadResult::Success)
-				{
-					FsLogger::LogFormat(FilesystemLogType::Error, "Failed to read chunk for file %s", NormalizedPath.GetData());
-					return false;
-				}
+	return true;
+}
 
-				// Update the buffer with the new data
-				for (uint64 ChunkByteIndex = sizeof(FsFileChunkHeader); ChunkByteIndex < ChunkSize; ChunkByteIndex++)
-				{
-					if (CurrentOffset < InOffset)
-					{
-						CurrentOffset++;
-						continue;
-					}
-				
-					ChunkReadBuffer[ChunkByteIndex] = Source[BytesWritten];
-					BytesWritten++;
-					CurrentOffset++;
-
-					if (BytesWritten >= InLength)
-					{
-						break;
-					}
-				}
+bool FsFilesystem::FlushFile(const FsPath& InPath)
+{
+	const FsPath NormalizedPath = InPath.NormalizePath();
 
-				// Serialize the chunk header and copy it in
-				FsBitArray ChunkHeaderBuffer = FsBitArray();
-				FsBitWriter ChunkHeaderWriter = FsBitWriter(ChunkHeaderBuffer);
-				const_cast<FsFileChunkHeader&>(Chunk).Serialize(ChunkHeaderWriter);
+	// Buffered writes are committed first, which can stage more data with delayed allocation
+	if (!CommitWriteBack(NormalizedPath))
+	{
+		return false;
+	}
 
-				for (uint64 i = 0; i < sizeof(FsFileChunkHeader); i++)
-				{
-					ChunkReadBuffer[i] = ChunkHeaderBuffer.GetInternalArray()[i];
-				}
+	FsDelayedWrite* StagedWrite = GetDelayedWrite(NormalizedPath);
+	if (!StagedWrite)
+	{
+		return true;
+	}
 
-				// Write the updated buffer back to the chunk
-				const FilesystemWriteResult WriteResult = Write(CurrentAbsoluteOffset, ChunkSize, ChunkReadBuffer.GetData());
-				if (WriteResult != FilesystemWriteResult::Success)
-				{
-					FsLogger::LogFormat(FilesystemLogType::Error, "Failed to write chunk for file %s", NormalizedPath.GetData());
-					return false;
-				}
-			}
+	// Take the staged bytes out first, so the write below goes straight to disk.
+	// The final size is known now, so the whole lot is allocated in one go.
+	FsDelayedWrite DelayedWrite = FsMove(*StagedWrite);
+	DiscardDelayedWrite(NormalizedPath);
 
-			CurrentAbsoluteOffset = BlockIndexToAbsoluteOffset(Chunk.NextBlockIndex);
-			if (CurrentAbsoluteOffset == 0 || BytesWritten >= InLength || CurrentOffset >= MaxWriteLength)
-			{
-				// done
-				break;
-			}
-		}
+	FsLogger::LogFormat(FilesystemLogType::Verbose, "Flushing %u staged bytes for file %s", DelayedWrite.Data.Length(), NormalizedPath.GetData());
 
-		if (!SaveDirectory(Directory, DirectoryFile.FileOffset))
-		{
-			FsLogger::LogFormat(FilesystemLogType::Error, "Failed to save directory %s", DirectoryPath.GetData());
-			return false;
-		}
+	if (!WriteToFile_Internal(NormalizedPath, DelayedWrite.Data.GetData(), DelayedWrite.FileOffset, DelayedWrite.Data.Length()))
+	{
+		// Stage the bytes again along with their reservation, so nothing is lost and a later flush can retry them
+		FsLogger::LogFormat(FilesystemLogType::Error, "Failed to flush staged bytes for file %s, keeping them staged", NormalizedPath.GetData());
+		ReservedBlocks += DelayedWrite.ReservedBlocks;
+		DelayedWrites.Add(FsMove(DelayedWrite));
+		return false;
+	}
 
-		FsLogger::LogFormat(FilesystemLogType::Info, "Wrote to file %s with %u bytes. %u chunks total", NormalizedPath.GetData(), InLength, AllChunks.Length());
+	return true;
+}
 
-		// Clear the cache for this file
-		const uint64 LoadedChunks = GetAllChunksForFile(NormalizedPath, File).Length();
+bool FsFilesystem::FlushAllFiles()
+{
+	// Writes that fail are kept, so go through the files as they are now rather than until nothing is left
+	bool bSucceeded = true;
+	FsArray<FsPath> FileNames = FsArray<FsPath>();
+	for (const FsWriteBack& WriteBack : WriteBacks)
+	{
+		FileNames.Add(WriteBack.FileName);
+	}
 
-		if (LoadedChunks != AllChunks.Length())
+	for (const FsPath& FileName : FileNames)
+	{
+		if (!CommitWriteBack(FileName))
 		{
-			FsLogger::LogFormat(FilesystemLogType::Error, "Failed to write the correct amount of chunkies. %u have, %u expected", LoadedChunks, AllChunks.Length());
+			FsLogger::LogFormat(FilesystemLogType::Error, "Failed to commit buffered writes for file %s", FileName.GetData());
+			bSucceeded = false;
 		}
+	}
 
-		fsCheck(LoadedChunks == AllChunks.Length(), "Failed to write the correct amount of chunkies");
+	FileNames.Empty();
+	for (const FsDelayedWrite& DelayedWrite : DelayedWrites)
+	{
+		FileNames.Add(DelayedWrite.FileName);
+	}
 
-		if (Source)
+	for (const FsPath& FileName : FileNames)
+	{
+		if (!FlushFile(FileName))
 		{
-			ValidateFileWrite(NormalizedPath, Source, InOffset, InLength);
+			FsLogger::LogFormat(FilesystemLogType::Error, "Failed to flush file %s", FileName.GetData());
+			bSucceeded = false;
 		}
-		return true;
 	}
+	return bSucceeded;
+}
 
-	FsLogger::LogFormat(FilesystemLogType::Error, "Failed to write to file %s", NormalizedPath.GetData());
-	return false;
+FsDelayedWrite* FsFilesystem::GetDelayedWrite(const FsPath& NormalizedPath)
+{
+	for (FsDelayedWrite& DelayedWrite : DelayedWrites)
+	{
+		if (DelayedWrite.FileName == NormalizedPath)
+		{
+			return &DelayedWrite;
+		}
+	}
+	return nullptr;
 }
 
-bool FsFilesystem::ReadFromFile(const FsPath& InPath, uint64 Offset, uint8* Destination, uint64 Length, uint64* OutBytesRead)
+const FsDelayedWrite* FsFilesystem::GetDelayedWrite(const FsPath& NormalizedPath) const
 {
-	const FsPath NormalizedPath = InPath.NormalizePath();
+	return const_cast<FsFilesystem*>(this)->GetDelayedWrite(NormalizedPath);
+}
 
-	if (!FileExists(NormalizedPath))
+void FsFilesystem::DiscardDelayedWrite(const FsPath& NormalizedPath)
+{
+	for (uint64 i = 0; i < DelayedWrites.Length(); i++)
 	{
-		FsLogger::LogFormat(FilesystemLogType::Error, "File %s does not exist", NormalizedPath.GetData());
-		return false;
+		if (DelayedWrites[i].FileName != NormalizedPath)
+		{
+			continue;
+		}
+
+		ReservedBlocks -= DelayedWrites[i].ReservedBlocks;
+
+		// Move the last staged write into this slot rather than shifting, so no staged data gets copied
+		const uint64 LastIndex = DelayedWrites.Length() - 1;
+		if (i != LastIndex)
+		{
+			DelayedWrites[i] = FsMove(DelayedWrites[LastIndex]);
+		}
+		DelayedWrites[LastIndex].Data.Empty(true);
+		DelayedWrites.RemoveAt(LastIndex);
+		return;
 	}
+}
 
-	// Get the files directory
-	const FsPath DirectoryPath = NormalizedPath.GetPathWithoutFileName();
-	FsDirectoryDescriptor Directory{};
-	if (!GetDirectory(DirectoryPath, Directory))
+void FsFilesystem::TrimBufferedWrites(const FsPath& NormalizedPath, uint64 NewSize)
+{
+	FsDelayedWrite* DelayedWrite = GetDelayedWrite(NormalizedPath);
+	if (DelayedWrite && DelayedWrite->FileOffset + DelayedWrite->Data.Length() > NewSize)
 	{
-		FsLogger::LogFormat(FilesystemLogType::Error, "Failed to get directory for file %s", NormalizedPath.GetData());
-		return false;
-	}
+		if (DelayedWrite->FileOffset >= NewSize)
+		{
+			DiscardDelayedWrite(NormalizedPath);
+		}
+		else
+		{
+			DelayedWrite->Data.RemoveAt(NewSize - DelayedWrite->FileOffset, DelayedWrite->FileOffset + DelayedWrite->Data.Length() - NewSize);
 
-	const FsPath FileName = NormalizedPath.GetLastPath();
+			// Give back the blocks held for the part that was cut off
+			const uint64 BlocksNeeded = GetDelayedWriteReservedBlocks(DelayedWrite->Data.Length());
+			if (BlocksNeeded < DelayedWrite->ReservedBlocks)
+			{
+				ReservedBlocks -= DelayedWrite->ReservedBlocks - BlocksNeeded;
+				DelayedWrite->ReservedBlocks = BlocksNeeded;
+			}
+		}
+	}
 
-	for (const FsFileDescriptor& File : Directory.Files)
+	FsWriteBack* WriteBack = GetWriteBack(NormalizedPath);
+	if (WriteBack && WriteBack->FileOffset + WriteBack->Data.Length() > NewSize)
 	{
-		if (File.FileName != FileName)
+		if (WriteBack->FileOffset >= NewSize)
 		{
-			continue;
+			DiscardWriteBack(NormalizedPath);
 		}
-
-		// Check the read is within the file length
-		if (Offset + Length > File.FileSize)
+		else
 		{
-			Length = File.FileSize - Offset;
+			WriteBack->Data.RemoveAt(NewSize - WriteBack->FileOffset, WriteBack->FileOffset + WriteBack->Data.Length() - NewSize);
 		}
+	}
+}
+
+bool FsFilesystem::BufferWrite(const FsPath& NormalizedPath, const uint8* Source, uint64 InOffset, uint64 InLength)
+{
+	const uint64 WriteEnd = InOffset + InLength;
 
-		if (Offset + Length > File.FileSize)
+	// Only one range is buffered per file, so a write that neither overlaps it nor carries straight on from it sends it to the file first
+	FsWriteBack* WriteBack = GetWriteBack(NormalizedPath);
+	if (WriteBack && (InOffset > WriteBack->FileOffset + WriteBack->Data.Length() || WriteEnd < WriteBack->FileOffset))
+	{
+		if (!CommitWriteBack(NormalizedPath))
 		{
-			FsLogger::LogFormat(FilesystemLogType::Error, "Read is out of bounds for file %s", NormalizedPath.GetData());
 			return false;
 		}
+		WriteBack = nullptr;
+	}
 
-		// Get all the chunks for the file up to the read length
-		const uint64 MaxReadLength = Offset + Length;
-		const FsArray<FsFileChunkHeader> AllChunks = GetAllChunksForFile(NormalizedPath, File);
+	if (!WriteBack)
+	{
+		// Large writes gain nothing from being buffered
+		if (InLength >= MountOptions.WriteBackMaxBytes)
+		{
+			return CommitWrite(NormalizedPath, Source, InOffset, InLength);
+		}
 
-		if (AllChunks.IsEmpty())
+		if (!FileExists(NormalizedPath))
 		{
-			// This file is empty and has no blocks allocated for it.
-			FsLogger::LogFormat(FilesystemLogType::Error, "File %s has no chunks allocated to it", NormalizedPath.GetData());
+			FsLogger::LogFormat(FilesystemLogType::Error, "File %s does not exist", NormalizedPath.GetData());
 			return false;
 		}
 
-		//FsLogger::LogFormat(FilesystemLogType::Info, "Reading file %s with %u chunks", NormalizedPath.GetData(), AllChunks.Length());
+		FsWriteBack NewWriteBack = FsWriteBack();
+		NewWriteBack.FileName = NormalizedPath;
+		NewWriteBack.FileNameHash = HashFileName(NormalizedPath);
+		NewWriteBack.FileOffset = InOffset;
+		NewWriteBack.FirstWriteTime = GetTimeMilliseconds();
+		WriteBacks.Add(NewWriteBack);
+		WriteBack = &WriteBacks[WriteBacks.Length() - 1];
+	}
 
-		// Read the file data from the blocks
-		uint64 BytesRead = 0;
-		uint64 CurrentOffset = 0;
-		uint64 CurrentAbsoluteOffset = File.FileOffset;
-		uint64 CurrentChunkIndex = 0;
+	// Grow the buffer at either end so it covers the write
+	if (InOffset < WriteBack->FileOffset)
+	{
+		const uint64 Growth = WriteBack->FileOffset - InOffset;
+		const uint64 OldLength = WriteBack->Data.Length();
+		WriteBack->Data.AddUninitialized(Growth);
+		FsMemory::Move(WriteBack->Data.GetData() + Growth, WriteBack->Data.GetData(), OldLength);
+		WriteBack->FileOffset = InOffset;
+	}
 
-		while (BytesRead < Length && CurrentAbsoluteOffset != 0 && AllChunks.IsValidIndex(CurrentChunkIndex))
-		{
-			const FsFileChunkHeader& CurrentChunk = AllChunks[CurrentChunkIndex];
-			CurrentChunkIndex++;
+	const uint64 BufferEnd = WriteBack->FileOffset + WriteBack->Data.Length();
+	if (WriteEnd > BufferEnd)
+	{
+		WriteBack->Data.AddUninitialized(WriteEnd - BufferEnd);
+	}
 
-			const uint64 ChunkSize = CurrentChunk.Blocks * BlockSize;
-			
-			// See if we can skip this chunk
-			if (CurrentOffset + ChunkSize < Offset)
-			{
-				CurrentOffset += ChunkSize - sizeof(FsFileChunkHeader);
-				CurrentAbsoluteOffset = BlockIndexToAbsoluteOffset(CurrentChunk.NextBlockIndex);
-				continue;
-			}
+	FsMemory::Copy(WriteBack->Data.GetData() + (InOffset - WriteBack->FileOffset), Source, InLength);
 
-			FsArray<uint8> ChunkBuffer = FsArray<uint8>();
-			FsArray<uint8>* ChunkBufferPtr = GetCachedRead(AbsoluteOffsetToBlockIndex(CurrentAbsoluteOffset));
-			if (!ChunkBufferPtr)
-			{
-				//ChunkBufferPtr = CacheRead(AbsoluteOffsetToBlockIndex(CurrentAbsoluteOffset));
-				ChunkBufferPtr = &ChunkBuffer;
+	FsLogger::LogFormat(FilesystemLogType::Verbose, "Buffered %u bytes for file %s, %u bytes buffered in total", InLength, NormalizedPath.GetData(), WriteBack->Data.Length());
 
-				ChunkBufferPtr->Empty(false);
-				ChunkBufferPtr->FillUninitialized(ChunkSize);
+	if (WriteBack->Data.Length() >= MountOptions.WriteBackMaxBytes)
+	{
+		return CommitWriteBack(NormalizedPath);
+	}
 
-				// Read the whole chunk
-				const FilesystemReadResult Result = Read(CurrentAbsoluteOffset, ChunkSize, ChunkBufferPtr->GetData());
-				if (Result != FilesystemReadResult::Success)
-				{
-					FsLogger::LogFormat(FilesystemLogType::Error, "Failed to read chunk %u for file %s", CurrentChunkIndex - 1, NormalizedPath.GetData());
-					return false;
-				}
+	return true;
+}
 
-				FsLogger::LogFormat(FilesystemLogType::Info, "Read chunk %u (size %u) for file %s", CurrentChunkIndex - 1, ChunkSize, NormalizedPath.GetData());
-			}
-			else
+bool FsFilesystem::CommitWriteBack(const FsPath& NormalizedPath)
+{
+	FsWriteBack* BufferedWrite = GetWriteBack(NormalizedPath);
+	if (!BufferedWrite)
+	{
+		return true;
+	}
+
+	// Take the buffered bytes out first, so the write below goes to the file rather than back into the buffer
+	FsWriteBack WriteBack = FsMove(*BufferedWrite);
+	DiscardWriteBack(NormalizedPath);
+
+	FsLogger::LogFormat(FilesystemLogType::Verbose, "Committing %u buffered bytes at %u for file %s", WriteBack.Data.Length(), WriteBack.FileOffset, NormalizedPath.GetData());
+
+	if (!CommitWrite(NormalizedPath, WriteBack.Data.GetData(), WriteBack.FileOffset, WriteBack.Data.Length()))
+	{
+		// Buffer the bytes again so nothing is lost. Writing them again later is safe even if part of them got through.
+		FsLogger::LogFormat(FilesystemLogType::Error, "Failed to commit buffered writes for file %s, keeping them buffered", NormalizedPath.GetData());
+		WriteBacks.Add(FsMove(WriteBack));
+		return false;
+	}
+
+	return true;
+}
+
+bool FsFilesystem::FlushFilesUnderPath(const FsPath& NormalizedPath)
+{
+	// Files below a directory are kept by their full path, so their paths start with the directory's
+	FsPath DirectoryPrefix = NormalizedPath;
+	DirectoryPrefix.Append("/");
+
+	FsArray<FsPath> FileNames = FsArray<FsPath>();
+	FileNames.Add(NormalizedPath);
+	for (const FsWriteBack& WriteBack : WriteBacks)
+	{
+		if (WriteBack.FileName.StartsWith(DirectoryPrefix))
+		{
+			FileNames.Add(WriteBack.FileName);
+		}
+	}
+
+	for (const FsDelayedWrite& DelayedWrite : DelayedWrites)
+	{
+		if (DelayedWrite.FileName.StartsWith(DirectoryPrefix))
+		{
+			FileNames.Add(DelayedWrite.FileName);
+		}
+	}
+
+	// A file with both kinds of write is listed twice, flushing it again does nothing
+	bool bSucceeded = true;
+	for (const FsPath& FileName : FileNames)
+	{
+		if (!FlushFile(FileName))
+		{
+			FsLogger::LogFormat(FilesystemLogType::Error, "Failed to flush file %s", FileName.GetData());
+			bSucceeded = false;
+		}
+	}
+	return bSucceeded;
+}
+
+bool FsFilesystem::CommitExpiredWriteBacks()
+{
+	if (MountOptions.WriteBackMaxAgeMilliseconds == 0 || WriteBacks.IsEmpty())
+	{
+		return true;
+	}
+
+	// Committing moves entries around, and keeps any it fails to commit, so find the expired ones first
+	const uint64 Now = GetTimeMilliseconds();
+	FsArray<FsPath> ExpiredFileNames = FsArray<FsPath>();
+	for (const FsWriteBack& WriteBack : WriteBacks)
+	{
+		if (Now - WriteBack.FirstWriteTime >= MountOptions.WriteBackMaxAgeMilliseconds)
+		{
+			ExpiredFileNames.Add(WriteBack.FileName);
+		}
+	}
+
+	bool bSucceeded = true;
+	for (const FsPath& FileName : ExpiredFileNames)
+	{
+		if (!CommitWriteBack(FileName))
+		{
+			FsLogger::LogFormat(FilesystemLogType::Error, "Failed to commit buffered writes for file %s", FileName.GetData());
+			bSucceeded = false;
+		}
+	}
+	return bSucceeded;
+}
+
+FsWriteBack* FsFilesystem::GetWriteBack(const FsPath& NormalizedPath)
+{
+	if (WriteBacks.IsEmpty())
+	{
+		return nullptr;
+	}
+
+	const uint64 FileNameHash = HashFileName(NormalizedPath);
+	for (FsWriteBack& WriteBack : WriteBacks)
+	{
+		if (WriteBack.FileNameHash == FileNameHash && WriteBack.FileName == NormalizedPath)
+		{
+			return &WriteBack;
+		}
+	}
+	return nullptr;
+}
+
+const FsWriteBack* FsFilesystem::GetWriteBack(const FsPath& NormalizedPath) const
+{
+	return const_cast<FsFilesystem*>(this)->GetWriteBack(NormalizedPath);
+}
+
+void FsFilesystem::DiscardWriteBack(const FsPath& NormalizedPath)
+{
+	for (uint64 i = 0; i < WriteBacks.Length(); i++)
+	{
+		if (WriteBacks[i].FileName != NormalizedPath)
+		{
+			continue;
+		}
+
+		// Move the last buffer into this slot rather than shifting, so no buffered data gets copied
+		const uint64 LastIndex = WriteBacks.Length() - 1;
+		if (i != LastIndex)
+		{
+			WriteBacks[i] = FsMove(WriteBacks[LastIndex]);
+		}
+		WriteBacks[LastIndex].Data.Empty(true);
+		WriteBacks.RemoveAt(LastIndex);
+		return;
+	}
+}
+
+void FsFilesystem::CopyFromWriteBack(const FsPath& NormalizedPath, uint64 Offset, uint8* Destination, uint64 Length) const
+{
+	const FsWriteBack* WriteBack = GetWriteBack(NormalizedPath);
+	if (!WriteBack)
+	{
+		return;
+	}
+
+	const uint64 BufferEnd = WriteBack->FileOffset + WriteBack->Data.Length();
+	const uint64 CopyStart = Offset > WriteBack->FileOffset ? Offset : WriteBack->FileOffset;
+	const uint64 CopyEnd = Offset + Length < BufferEnd ? Offset + Length : BufferEnd;
+	if (CopyStart >= CopyEnd)
+	{
+		return;
+	}
+
+	FsMemory::Copy(Destination + (CopyStart - Offset), WriteBack->Data.GetData() + (CopyStart - WriteBack->FileOffset), CopyEnd - CopyStart);
+}
+
+bool FsFilesystem::WriteToFile_Internal(const FsPath& NormalizedPath, const uint8* Source, uint64 InOffset, uint64 InLength)
+{
+	// Whatever was read ahead for the file is about to be out of date
+	DropReadAhead(NormalizedPath);
+
+	if (!FileExists(NormalizedPath))
+	{
+		FsLogger::LogFormat(FilesystemLogType::Error, "File %s does not exist", NormalizedPath.GetData());
+		return false;
+	}
+
+	// Get the files directory
+	const FsPath DirectoryPath = NormalizedPath.GetPathWithoutFileName();
+	FsDirectoryDescriptor Directory{};
+	FsFileDescriptor DirectoryFile{};
+	if (!GetDirectory(DirectoryPath, Directory, &DirectoryFile))
+	{
+		FsLogger::LogFormat(FilesystemLogType::Error, "Failed to get directory for file %s", NormalizedPath.GetData());
+		return false;
+	}
+
+	const FsPath FileName = NormalizedPath.GetLastPath();
+	for (FsFileDescriptor& File : Directory.Files)
+	{
+		if (File.FileName != FileName)
+		{
+			continue;
+		}
+
+		// Small files are kept in their directory entry while the directory has room for them
+		const uint64 MaxWriteLength = InOffset + InLength;
+		const uint64 InlineLength = MaxWriteLength > File.WrittenSize ? MaxWriteLength : File.WrittenSize;
+		if (Source && File.FileOffset == 0 && InlineLength <= MountOptions.InlineFileMaxBytes)
+		{
+			const FsArray<uint8> OldInlineData = File.InlineData;
+
+			// Anything before the write that was never written reads as zeros, so it is stored as zeros
+			if (InlineLength > File.InlineData.Length())
 			{
-				FsLogger::LogFormat(FilesystemLogType::Info, "Using cached chunk %u (size %u) for file %s", CurrentChunkIndex - 1, ChunkBufferPtr->Length(), NormalizedPath.GetData());
+				File.InlineData.AddZeroed(InlineLength - File.InlineData.Length());
 			}
+			FsMemory::Copy(File.InlineData.GetData() + InOffset, Source, InLength);
 
-			for (uint64 ChunkByteIndex = sizeof(FsFileChunkHeader); ChunkByteIndex < ChunkSize; ChunkByteIndex++)
+			if (DirectoryFits(Directory))
 			{
-				if (CurrentOffset < Offset)
+				File.WrittenSize = InlineLength;
+				if (MaxWriteLength > File.FileSize)
 				{
-					CurrentOffset ++;
-					continue;
+					File.FileSize = MaxWriteLength;
 				}
 
-				if (CurrentOffset >= Offset)
+				if (!SaveDirectory(Directory, DirectoryFile.FileOffset))
 				{
-					Destination[BytesRead] = (*ChunkBufferPtr)[ChunkByteIndex];
-					BytesRead++;
+					FsLogger::LogFormat(FilesystemLogType::Error, "Failed to save directory %s", DirectoryPath.GetData());
+					return false;
 				}
 
-				CurrentOffset++;
-				if (BytesRead >= Length)
-				{
-					break;
-				}
+				FsLogger::LogFormat(FilesystemLogType::Info, "Wrote to file %s with %u bytes, stored in its directory entry", NormalizedPath.GetData(), InLength);
+				return true;
+			}
 
-				if (CurrentOffset >= MaxReadLength)
-				{
-					break;
-				}
+			File.InlineData = OldInlineData;
+		}
+
+		FsBlockMap BlockMap = FsBlockMap();
+		if (!LoadBlockMap(NormalizedPath, File, BlockMap))
+		{
+			return false;
+		}
+
+		// A file that has outgrown its directory entry moves into blocks before the write lands
+		if (Source && !File.InlineData.IsEmpty() && !MoveInlineDataToBlocks(NormalizedPath, File, BlockMap))
+		{
+			return false;
+		}
+
+		// Only the blocks the data lands in are allocated. Extending without data leaves a hole that takes no blocks.
+		if (Source && !AllocateFileSpace(NormalizedPath, File, BlockMap, InOffset, InLength, true))
+		{
+			return false;
+		}
+
+		// Anything between the written part of the file and this write still holds whatever the blocks held before, so clear it first
+		if (Source && InOffset > File.WrittenSize)
+		{
+			if (!ZeroFileRange(NormalizedPath, BlockMap, File.WrittenSize, InOffset))
+			{
+				return false;
 			}
-			CurrentAbsoluteOffset = BlockIndexToAbsoluteOffset(CurrentChunk.NextBlockIndex);
 		}
-		fsCheck(BytesRead == Length, "Failed to read the correct amount of bytes from file");
-		if (OutBytesRead)
+
+		if (Source && MaxWriteLength > File.WrittenSize)
 		{
-			*OutBytesRead = BytesRead;
+			File.WrittenSize = MaxWriteLength;
 		}
-		return true;
+
+		// Update the file size if we expanded the file
+		if (MaxWriteLength > File.FileSize)
+		{
+			File.FileSize = MaxWriteLength;
+		}
+
+		// Write the part of the data that lands in each extent, all in one go.
+		// Only the bytes being changed are written, straight from the caller's buffer, so nothing has to be read back first.
+		if (Source)
+		{
+			FsArray<FsContentRange> Ranges = FsArray<FsContentRange>();
+			GetContentRanges(BlockMap.Extents, InOffset, InLength, Ranges);
+
+			FsArray<FsWriteSegment> Segments = FsArray<FsWriteSegment>();
+			uint64 BytesWritten = 0;
+			for (const FsContentRange& Range : Ranges)
+			{
+				FsWriteSegment Segment = FsWriteSegment();
+				Segment.Offset = Range.AbsoluteOffset;
+				Segment.Length = Range.Length;
+				Segment.Source = Source + (Range.FileOffset - InOffset);
+				Segments.Add(Segment);
+				BytesWritten += Range.Length;
+			}
+
+			fsCheck(BytesWritten == InLength, "Failed to write the correct amount of bytes to file");
+
+			if (!Segments.IsEmpty() && WriteV(Segments) != FilesystemWriteResult::Success)
+			{
+				FsLogger::LogFormat(FilesystemLogType::Error, "Failed to write %u extents for file %s", Segments.Length(), NormalizedPath.GetData());
+				return false;
+			}
+		}
+
+		if (!SaveDirectory(Directory, DirectoryFile.FileOffset))
+		{
+			FsLogger::LogFormat(FilesystemLogType::Error, "Failed to save directory %s", DirectoryPath.GetData());
+			return false;
+		}
+
+		FsLogger::LogFormat(FilesystemLogType::Info, "Wrote to file %s with %u bytes. %u extents total", NormalizedPath.GetData(), InLength, BlockMap.Extents.Length());
+
+#if FS_CHECK_LEVEL >= FS_CHECK_LEVEL_PARANOID
+		// Read the block map back from the partition to make sure it was saved correctly
+		ClearCachedBlockMap(NormalizedPath);
+		FsBlockMap LoadedBlockMap = FsBlockMap();
+		LoadBlockMap(NormalizedPath, File, LoadedBlockMap);
+
+		if (LoadedBlockMap.Extents.Length() != BlockMap.Extents.Length())
+		{
+			FsLogger::LogFormat(FilesystemLogType::Error, "Failed to write the correct amount of extents. %u have, %u expected", LoadedBlockMap.Extents.Length(), BlockMap.Extents.Length());
+		}
+
+		fsCheck(LoadedBlockMap.Extents.Length() == BlockMap.Extents.Length(), "Failed to write the correct amount of extents");
+#endif
+
+		return !Source || !ShouldVerifyWrite() || ValidateFileWrite(NormalizedPath, Source, InOffset, InLength);
 	}
 
-	// Could not find the file
-	FsLogger::LogFormat(FilesystemLogType::Error, "Failed to read file %s", NormalizedPath.GetData());
+	FsLogger::LogFormat(FilesystemLogType::Error, "Failed to write to file %s", NormalizedPath.GetData());
 	return false;
 }
 
-bool FsFilesystem::WriteEntireFile_Internal(FsFileDescriptor& FileDescriptor, const uint8* Source, uint64 Length)
+bool FsFilesystem::AllocateFileSpace(const FsPath& NormalizedPath, FsFileDescriptor& File, FsBlockMap& InOutBlockMap, uint64 Offset, uint64 Length, bool bRangeIsWritten)
 {
-	// Allocate enough blocks for the file, don't over allocate it
-	const uint64 NumBlocks = Length % BlockSize == 0 ? (Length / BlockSize) : (Length / BlockSize) + 1;
-
-	const FsBlockArray FileBlocks = GetFreeBlocks(NumBlocks);
-	if (FileBlocks.Length() != NumBlocks)
+	if (Length == 0)
 	{
-		FsLogger::LogFormat(FilesystemLogType::Error, "Failed to find %u free blocks for file %s", NumBlocks, FileDescriptor.FileName.GetData());
-		return false;
+		return true;
 	}
 
-	FsLogger::LogFormat(FilesystemLogType::Verbose, "Allocating first block for new file at %u bytes", BlockIndexToAbsoluteOffset(FileBlocks[0]));
-
-	SetBlocksInUse(FileBlocks, true);
+	const uint64 End = Offset + Length;
+	const uint64 EndBlockIndex = End % BlockSize == 0 ? End / BlockSize : End / BlockSize + 1;
+	bool bAllocated = false;
 
-	// Write the file data to the blocks (Don't forget their chunk headers)
-	uint64 BytesWritten = 0;
-
-	for (uint64 i = 0; i < NumBlocks; i++)
+	// Walk the range skipping the extents already in it. A file written in order only ever has a hole at its end.
+	uint64 FileBlockIndex = Offset / BlockSize;
+	while (FileBlockIndex < EndBlockIndex)
 	{
-		const uint64 BlockOffset = BlockIndexToAbsoluteOffset(FileBlocks[i]);
-		
-		FsFileChunkHeader ChunkHeader = FsFileChunkHeader();
-		ChunkHeader.NextBlockIndex = i + 1 < NumBlocks ? FileBlocks[i + 1] : 0;
-		ChunkHeader.Blocks = 1;
+		const uint64 ExtentIndex = FindExtentIndex(InOutBlockMap.Extents, FileBlockIndex);
+		if (ExtentIndex < InOutBlockMap.Extents.Length() && InOutBlockMap.Extents[ExtentIndex].FileBlockIndex <= FileBlockIndex)
+		{
+			FileBlockIndex = InOutBlockMap.Extents[ExtentIndex].FileBlockIndex + InOutBlockMap.Extents[ExtentIndex].Blocks;
+			continue;
+		}
 
-		FsBitArray BlockBuffer = FsBitArray();
-		FsBitWriter BlockWriter = FsBitWriter(BlockBuffer);
+		const bool bHoleEndsAtExtent = ExtentIndex < InOutBlockMap.Extents.Length() && InOutBlockMap.Extents[ExtentIndex].FileBlockIndex < EndBlockIndex;
+		const uint64 HoleEndBlockIndex = bHoleEndsAtExtent ? InOutBlockMap.Extents[ExtentIndex].FileBlockIndex : EndBlockIndex;
+		if (!AllocateHole(NormalizedPath, InOutBlockMap, FileBlockIndex, HoleEndBlockIndex - FileBlockIndex))
+		{
+			return false;
+		}
+		bAllocated = true;
 
-		ChunkHeader.Serialize(BlockWriter);
+		// The new blocks hold whatever was there before, which would be read back for any part of them below the written size
+		const uint64 HoleStart = FileBlockIndex * BlockSize;
+		const uint64 HoleEnd = HoleEndBlockIndex * BlockSize < File.WrittenSize ? HoleEndBlockIndex * BlockSize : File.WrittenSize;
+		if (HoleStart < HoleEnd)
+		{
+			const uint64 WrittenStart = bRangeIsWritten ? Offset : HoleEnd;
+			const uint64 WrittenEnd = bRangeIsWritten ? End : HoleEnd;
+			if (HoleStart < WrittenStart && !ZeroFileRange(NormalizedPath, InOutBlockMap, HoleStart, WrittenStart < HoleEnd ? WrittenStart : HoleEnd))
+			{
+				return false;
+			}
+			if (WrittenEnd < HoleEnd && !ZeroFileRange(NormalizedPath, InOutBlockMap, WrittenEnd > HoleStart ? WrittenEnd : HoleStart, HoleEnd))
+			{
+				return false;
+			}
+		}
 
-		const uint64 WriteableSpace = BlockSize - BlockBuffer.ByteLength();
-		const uint64 BytesToWrite = Length - BytesWritten > WriteableSpace ? WriteableSpace : Length - BytesWritten;
+		FileBlockIndex = HoleEndBlockIndex;
+	}
 
-		BlockBuffer.AddZeroed(BytesToWrite);
+	return !bAllocated || SaveBlockMap(NormalizedPath, File, InOutBlockMap);
+}
 
-		for (uint64 j = 0; j < BytesToWrite; j++)
+bool FsFilesystem::AllocateHole(const FsPath& NormalizedPath, FsBlockMap& InOutBlockMap, uint64 FileBlockIndex, uint64 Blocks)
+{
+	const uint64 ExtentIndex = FindExtentIndex(InOutBlockMap.Extents, FileBlockIndex);
+	uint64 GoalBlockIndex = 0;
+	if (ExtentIndex == 0)
+	{
+		// New files go in this thread's allocation group, after the last allocation made there
+		GoalBlockIndex = InOutBlockMap.MapBlocks.IsEmpty() ? GetNewFileGoalBlockIndex() : InOutBlockMap.MapBlocks[InOutBlockMap.MapBlocks.Length() - 1] + 1;
+	}
+	else
+	{
+		// Appends grow the last extent in place if the blocks after it are free
+		const FsFileExtent& PreviousExtent = InOutBlockMap.Extents[ExtentIndex - 1];
+		if (ExtentIndex == InOutBlockMap.Extents.Length() && PreviousExtent.FileBlockIndex + PreviousExtent.Blocks == FileBlockIndex)
 		{
-			BlockBuffer.GetInternalArray().GetData()[j + sizeof(FsFileChunkHeader)] = Source[BytesWritten + j];
+			const uint64 ExtendedBlocks = ExtendLastExtent(InOutBlockMap, Blocks);
+			FileBlockIndex += ExtendedBlocks;
+			Blocks -= ExtendedBlocks;
 		}
 
-		const FilesystemWriteResult WriteResult = Write(BlockOffset, BlockBuffer.ByteLength(), BlockBuffer.GetInternalArray().GetData());
-		if (WriteResult != FilesystemWriteResult::Success)
-		{
-			FsLogger::LogFormat(FilesystemLogType::Error, "Failed to write block %u for file %s", FileBlocks[i], FileDescriptor.FileName.GetData());
-			return false;
-		}
+		// Anything else goes after the extent in front of it in the file
+		GoalBlockIndex = PreviousExtent.StartBlockIndex + PreviousExtent.Blocks;
+	}
+
+	if (Blocks == 0)
+	{
+		return true;
+	}
+
+	// A file without a map yet takes one more block for it, just in front of its content
+	const bool bNeedsMapBlock = InOutBlockMap.MapBlocks.IsEmpty();
+	FsBlockRunArray NewRuns = AllocateBlockRuns(bNeedsMapBlock ? Blocks + 1 : Blocks, GoalBlockIndex);
+	if (NewRuns.IsEmpty())
+	{
+		FsLogger::LogFormat(FilesystemLogType::Error, "Failed to find free blocks for %u bytes for file %s", Blocks * BlockSize, NormalizedPath.GetData());
+		return false;
+	}
+
+	FsLogger::LogFormat(FilesystemLogType::Verbose, "Allocating %u runs of blocks for file %s", NewRuns.Length(), NormalizedPath.GetData());
+
+	if (bNeedsMapBlock)
+	{
+		InOutBlockMap.MapBlocks.Add(NewRuns[0].StartBlockIndex);
+		NewRuns[0].StartBlockIndex++;
+		NewRuns[0].Blocks--;
+	}
+
+	for (const FsBlockRun& Run : NewRuns)
+	{
+		AddExtent(InOutBlockMap, FileBlockIndex, Run);
+		FileBlockIndex += Run.Blocks;
+	}
+
+	return true;
+}
 
-		BytesWritten += BytesToWrite;
+bool FsFilesystem::MoveInlineDataToBlocks(const FsPath& NormalizedPath, FsFileDescriptor& File, FsBlockMap& InOutBlockMap)
+{
+	const uint64 InlineLength = File.InlineData.Length();
+	if (!AllocateFileSpace(NormalizedPath, File, InOutBlockMap, 0, InlineLength, true))
+	{
+		return false;
 	}
 
-	FileDescriptor.FileOffset = BlockIndexToAbsoluteOffset(FileBlocks[0]);
-	FileDescriptor.FileSize = Length;
+	FsArray<FsContentRange> Ranges = FsArray<FsContentRange>();
+	GetContentRanges(InOutBlockMap.Extents, 0, InlineLength, Ranges);
 
-	FsLogger::LogFormat(FilesystemLogType::Verbose, "Wrote entire file %s with %u bytes", FileDescriptor.FileName.GetData(), Length);
+	FsArray<FsWriteSegment> Segments = FsArray<FsWriteSegment>();
+	for (const FsContentRange& Range : Ranges)
+	{
+		FsWriteSegment Segment = FsWriteSegment();
+		Segment.Offset = Range.AbsoluteOffset;
+		Segment.Length = Range.Length;
+		Segment.Source = File.InlineData.GetData() + Range.FileOffset;
+		Segments.Add(Segment);
+	}
+
+	if (WriteV(Segments) != FilesystemWriteResult::Success)
+	{
+		FsLogger::LogFormat(FilesystemLogType::Error, "Failed to move file %s out of its directory entry", NormalizedPath.GetData());
+		return false;
+	}
 
+	FsLogger::LogFormat(FilesystemLogType::Verbose, "Moved %u bytes of file %s from its directory entry to blocks", InlineLength, NormalizedPath.GetData());
+	File.InlineData.Empty(true);
 	return true;
 }
 
-void FsFilesystem::CacheChunks(const FsPath& FileName, const FsArray<FsFileChunkHeader>& Chunks)
+bool FsFilesystem::ZeroFileRange(const FsPath& NormalizedPath, const FsBlockMap& BlockMap, uint64 StartOffset, uint64 EndOffset)
 {
-	ClearCachedChunks(FileName);
+	// Zeros are written from one small buffer, so clearing a large preallocated range doesn't need a buffer as big as the range.
+	// Every piece points at the same buffer and they are all written together.
+	FsArray<uint8> ZeroBuffer = FsArray<uint8>();
+	const uint64 RangeLength = EndOffset - StartOffset;
+	ZeroBuffer.FillZeroed(RangeLength < BlockSize * 16 ? RangeLength : BlockSize * 16);
+
+	FsArray<FsContentRange> Ranges = FsArray<FsContentRange>();
+	GetContentRanges(BlockMap.Extents, StartOffset, RangeLength, Ranges);
 
-	FsCachedChunkList NewCachedChunks = FsCachedChunkList();
-	NewCachedChunks.FileName = FileName;
-	NewCachedChunks.Chunks = Chunks;
+	FsArray<FsWriteSegment> Segments = FsArray<FsWriteSegment>();
+	for (const FsContentRange& Range : Ranges)
+	{
+		for (uint64 PieceStart = 0; PieceStart < Range.Length; PieceStart += ZeroBuffer.Length())
+		{
+			FsWriteSegment Segment = FsWriteSegment();
+			Segment.Offset = Range.AbsoluteOffset + PieceStart;
+			Segment.Length = Range.Length - PieceStart < ZeroBuffer.Length() ? Range.Length - PieceStart : ZeroBuffer.Length();
+			Segment.Source = ZeroBuffer.GetData();
+			Segments.Add(Segment);
+		}
+	}
+
+	if (!Segments.IsEmpty() && WriteV(Segments) != FilesystemWriteResult::Success)
+	{
+		FsLogger::LogFormat(FilesystemLogType::Error, "Failed to clear unwritten space in file %s", NormalizedPath.GetData());
+		return false;
+	}
+
+	return true;
+}
+
+bool FsFilesystem::PreallocateFile(const FsPath& InPath, uint64 Length, FsPreallocateMode Mode)
+{
+	const FsPath NormalizedPath = InPath.NormalizePath();
+
+	// Staged data has to be placed first, or it would be allocated after the preallocated blocks
+	if (!FlushFile(NormalizedPath))
+	{
+		return false;
+	}
+
+	const FsPath DirectoryPath = NormalizedPath.GetPathWithoutFileName();
+	FsDirectoryDescriptor Directory{};
+	FsFileDescriptor DirectoryFile{};
+	if (!GetDirectory(DirectoryPath, Directory, &DirectoryFile))
+	{
+		FsLogger::LogFormat(FilesystemLogType::Error, "Failed to get directory for file %s", NormalizedPath.GetData());
+		return false;
+	}
+
+	const FsPath FileName = NormalizedPath.GetLastPath();
+	for (FsFileDescriptor& File : Directory.Files)
+	{
+		if (File.bIsDirectory || File.FileName != FileName)
+		{
+			continue;
+		}
+
+		FsBlockMap BlockMap = FsBlockMap();
+		if (!LoadBlockMap(NormalizedPath, File, BlockMap))
+		{
+			return false;
+		}
+
+		// Space small enough for the directory entry needs no blocks, larger space moves an inline file to blocks first
+		if (File.FileOffset != 0 || Length > MountOptions.InlineFileMaxBytes)
+		{
+			if (!File.InlineData.IsEmpty() && !MoveInlineDataToBlocks(NormalizedPath, File, BlockMap))
+			{
+				return false;
+			}
+
+			// Only the block map is written, the content stays unwritten so nothing else needs to touch the new blocks.
+			// Holes below the written size are the exception, their new blocks are cleared.
+			if (!AllocateFileSpace(NormalizedPath, File, BlockMap, 0, Length, false))
+			{
+				return false;
+			}
+		}
+
+		if (Mode == FsPreallocateMode::ExtendSize && Length > File.FileSize)
+		{
+			File.FileSize = Length;
+		}
+
+		if (!SaveDirectory(Directory, DirectoryFile.FileOffset))
+		{
+			FsLogger::LogFormat(FilesystemLogType::Error, "Failed to save directory %s", DirectoryPath.GetData());
+			return false;
+		}
+
+		FsLogger::LogFormat(FilesystemLogType::Verbose, "Preallocated %u bytes for file %s in %u extents", Length, NormalizedPath.GetData(), BlockMap.Extents.Length());
+		return true;
+	}
+
+	FsLogger::LogFormat(FilesystemLogType::Error, "File %s does not exist", NormalizedPath.GetData());
+	return false;
+}
+
+bool FsFilesystem::TruncateFile(const FsPath& InPath, uint64 NewSize)
+{
+	const FsPath NormalizedPath = InPath.NormalizePath();
+
+	TrimBufferedWrites(NormalizedPath, NewSize);
+	if (!FlushFile(NormalizedPath))
+	{
+		return false;
+	}
+
+	// Reads ahead still in flight have to finish before the blocks are freed
+	DropReadAhead(NormalizedPath);
+
+	const FsPath DirectoryPath = NormalizedPath.GetPathWithoutFileName();
+	FsDirectoryDescriptor Directory{};
+	FsFileDescriptor DirectoryFile{};
+	if (!GetDirectory(DirectoryPath, Directory, &DirectoryFile))
+	{
+		FsLogger::LogFormat(FilesystemLogType::Error, "Failed to get directory for file %s", NormalizedPath.GetData());
+		return false;
+	}
+
+	const FsPath FileName = NormalizedPath.GetLastPath();
+	for (FsFileDescriptor& File : Directory.Files)
+	{
+		if (File.bIsDirectory || File.FileName != FileName)
+		{
+			continue;
+		}
+
+		if (NewSize > File.FileSize)
+		{
+			// Growing only moves the end of the file, the new part is a hole until it is written
+			File.FileSize = NewSize;
+			if (!SaveDirectory(Directory, DirectoryFile.FileOffset))
+			{
+				FsLogger::LogFormat(FilesystemLogType::Error, "Failed to save directory %s", DirectoryPath.GetData());
+				return false;
+			}
+			return true;
+		}
+
+		FsBlockMap BlockMap = FsBlockMap();
+		if (!LoadBlockMap(NormalizedPath, File, BlockMap))
+		{
+			return false;
+		}
+
+		// Cut the extent holding the new end and drop every extent after it, gathering all the freed blocks up
+		const uint64 BlocksToKeep = NewSize % BlockSize == 0 ? NewSize / BlockSize : NewSize / BlockSize + 1;
+		const uint64 FirstCutExtent = FindExtentIndex(BlockMap.Extents, BlocksToKeep);
+		FsBlockRunArray TailRuns = FsBlockRunArray();
+		for (uint64 i = FirstCutExtent; i < BlockMap.Extents.Length(); i++)
+		{
+			const FsFileExtent& Extent = BlockMap.Extents[i];
+			const uint64 KeptBlocks = Extent.FileBlockIndex < BlocksToKeep ? BlocksToKeep - Extent.FileBlockIndex : 0;
+
+			FsBlockRun Run = FsBlockRun();
+			Run.StartBlockIndex = Extent.StartBlockIndex + KeptBlocks;
+			Run.Blocks = Extent.Blocks - KeptBlocks;
+			TailRuns.Add(Run);
+		}
+
+		if (!TailRuns.IsEmpty())
+		{
+			uint64 RemoveFrom = FirstCutExtent;
+			FsFileExtent& CutExtent = BlockMap.Extents[FirstCutExtent];
+			if (CutExtent.FileBlockIndex < BlocksToKeep)
+			{
+				CutExtent.Blocks = BlocksToKeep - CutExtent.FileBlockIndex;
+				RemoveFrom++;
+			}
+			if (RemoveFrom < BlockMap.Extents.Length())
+			{
+				BlockMap.Extents.RemoveAt(RemoveFrom, BlockMap.Extents.Length() - RemoveFrom);
+			}
+		}
+
+		if (File.InlineData.Length() > NewSize)
+		{
+			File.InlineData.RemoveAt(NewSize, File.InlineData.Length() - NewSize);
+		}
+
+		// The rest of the last kept block still holds the old bytes, but it is past the written size so it reads as zeros
+		File.FileSize = NewSize;
+		if (File.WrittenSize > NewSize)
+		{
+			File.WrittenSize = NewSize;
+		}
+
+		// The shorter map and the directory are saved before the blocks are freed, so the file never points at free blocks.
+		// That includes map blocks the shorter map doesn't need, which the directory points at until it is saved.
+		// Saving the map caches it too, so the chain doesn't have to be read again.
+		const uint64 OldFileOffset = File.FileOffset;
+		if ((!TailRuns.IsEmpty() && !SaveBlockMap(NormalizedPath, File, BlockMap, &TailRuns)) || !SaveDirectory(Directory, DirectoryFile.FileOffset))
+		{
+			FsLogger::LogFormat(FilesystemLogType::Error, "Failed to save directory %s", DirectoryPath.GetData());
+			File.FileOffset = OldFileOffset;
+			ClearCachedBlockMap(NormalizedPath);
+			return false;
+		}
+
+		if (!TailRuns.IsEmpty())
+		{
+			SetBlockRunsInUse(TailRuns, false);
+		}
+
+		FsLogger::LogFormat(FilesystemLogType::Verbose, "Truncated file %s to %u bytes, freed %u runs of blocks", NormalizedPath.GetData(), NewSize, TailRuns.Length());
+		return true;
+	}
+
+	FsLogger::LogFormat(FilesystemLogType::Error, "File %s does not exist", NormalizedPath.GetData());
+	return false;
+}
+
+uint64 FsFilesystem::CountFragments(const FsBlockRunArray& Runs)
+{
+	uint64 Fragments = 0;
+	for (uint64 i = 0; i < Runs.Length(); i++)
+	{
+		if (i == 0 || Runs[i - 1].StartBlockIndex + Runs[i - 1].Blocks != Runs[i].StartBlockIndex)
+		{
+			Fragments++;
+		}
+	}
+	return Fragments;
+}
+
+uint64 FsFilesystem::GetFileFragmentCount(const FsPath& InPath)
+{
+	const FsPath NormalizedPath = InPath.NormalizePath();
+
+	FsFileDescriptor File{};
+	if (!GetFile(NormalizedPath, File))
+	{
+		return 0;
+	}
+
+	const FsBlockMap* BlockMap = GetBlockMap(NormalizedPath, File);
+	return BlockMap ? CountFragments(GetBlockRunsForExtents(BlockMap->Extents)) : 0;
+}
+
+bool FsFilesystem::DefragmentFile(const FsPath& InPath, uint64* OutBytesMoved)
+{
+	const FsPath NormalizedPath = InPath.NormalizePath();
+	if (OutBytesMoved)
+	{
+		*OutBytesMoved = 0;
+	}
+
+	if (!FlushFile(NormalizedPath))
+	{
+		return false;
+	}
+
+	// The old blocks are freed once the content is copied, so nothing can still be reading ahead from them
+	DropReadAhead(NormalizedPath);
+
+	const FsPath DirectoryPath = NormalizedPath.GetPathWithoutFileName();
+	FsDirectoryDescriptor Directory{};
+	FsFileDescriptor DirectoryFile{};
+	if (!GetDirectory(DirectoryPath, Directory, &DirectoryFile))
+	{
+		FsLogger::LogFormat(FilesystemLogType::Error, "Failed to get directory for file %s", NormalizedPath.GetData());
+		return false;
+	}
+
+	const FsPath FileName = NormalizedPath.GetLastPath();
+	for (FsFileDescriptor& File : Directory.Files)
+	{
+		if (File.bIsDirectory || File.FileName != FileName)
+		{
+			continue;
+		}
+
+		FsBlockMap OldBlockMap = FsBlockMap();
+		if (!LoadBlockMap(NormalizedPath, File, OldBlockMap))
+		{
+			return false;
+		}
+
+		if (OldBlockMap.Extents.IsEmpty())
+		{
+			return true;
+		}
+
+		const FsBlockRunArray OldRuns = GetBlockRunsForExtents(OldBlockMap.Extents);
+		const uint64 OldFragments = CountFragments(OldRuns);
+		if (OldFragments <= 1)
+		{
+			return true;
+		}
+
+		// Keep all the space the file has, so preallocated space survives the move. The first block is for the new map.
+		FsBlockRunArray NewRuns = AllocateBlockRuns(OldBlockMap.GetBlockCount() + 1, OldRuns[0].StartBlockIndex);
+		if (NewRuns.IsEmpty())
+		{
+			FsLogger::LogFormat(FilesystemLogType::Warning, "Not enough free space to defragment file %s", NormalizedPath.GetData());
+			return false;
+		}
+
+		FsBlockMap NewBlockMap = FsBlockMap();
+		NewBlockMap.MapBlocks.Add(NewRuns[0].StartBlockIndex);
+		NewRuns[0].StartBlockIndex++;
+		NewRuns[0].Blocks--;
+
+		// Hand the new runs out to the old extents in file order, so holes stay where they are
+		uint64 OldExtentIndex = 0;
+		uint64 OldExtentBlocksMapped = 0;
+		for (const FsBlockRun& Run : NewRuns)
+		{
+			uint64 RunBlocksMapped = 0;
+			while (RunBlocksMapped < Run.Blocks)
+			{
+				const FsFileExtent& OldExtent = OldBlockMap.Extents[OldExtentIndex];
+				const uint64 RunBlocksLeft = Run.Blocks - RunBlocksMapped;
+				const uint64 ExtentBlocksLeft = OldExtent.Blocks - OldExtentBlocksMapped;
+
+				FsBlockRun Piece = FsBlockRun();
+				Piece.StartBlockIndex = Run.StartBlockIndex + RunBlocksMapped;
+				Piece.Blocks = RunBlocksLeft < ExtentBlocksLeft ? RunBlocksLeft : ExtentBlocksLeft;
+				AddExtent(NewBlockMap, OldExtent.FileBlockIndex + OldExtentBlocksMapped, Piece);
+
+				RunBlocksMapped += Piece.Blocks;
+				OldExtentBlocksMapped += Piece.Blocks;
+				if (OldExtentBlocksMapped == OldExtent.Blocks)
+				{
+					OldExtentIndex++;
+					OldExtentBlocksMapped = 0;
+				}
+			}
+		}
+
+		const FsBlockRunArray NewDataRuns = GetBlockRunsForExtents(NewBlockMap.Extents);
+		if (CountFragments(NewDataRuns) >= OldFragments)
+		{
+			// The free space is no less fragmented than the file, moving it would gain nothing
+			FsLogger::LogFormat(FilesystemLogType::Verbose, "File %s can't be stored in fewer than %u fragments", NormalizedPath.GetData(), OldFragments);
+			SetBlockRunsInUse(GetBlockRunsForMap(NewBlockMap), false);
+			return true;
+		}
+
+		// Copy the written content across a piece at a time. Unwritten space reads as zeros so it doesn't need copying.
+		FsArray<uint8> CopyBuffer = FsArray<uint8>();
+		CopyBuffer.FillUninitialized(BlockSize * 16);
+
+		uint64 Copied = 0;
+		while (Copied < File.WrittenSize)
+		{
+			const uint64 PieceLength = File.WrittenSize - Copied < CopyBuffer.Length() ? File.WrittenSize - Copied : CopyBuffer.Length();
+
+			FsArray<FsContentRange> OldRanges = FsArray<FsContentRange>();
+			GetContentRanges(OldBlockMap.Extents, Copied, PieceLength, OldRanges);
+			FsArray<FsReadSegment> ReadSegments = FsArray<FsReadSegment>();
+			for (const FsContentRange& Range : OldRanges)
+			{
+				FsReadSegment Segment = FsReadSegment();
+				Segment.Offset = Range.AbsoluteOffset;
+				Segment.Length = Range.Length;
+				Segment.Destination = CopyBuffer.GetData() + (Range.FileOffset - Copied);
+				ReadSegments.Add(Segment);
+			}
+
+			FsArray<FsContentRange> NewRanges = FsArray<FsContentRange>();
+			GetContentRanges(NewBlockMap.Extents, Copied, PieceLength, NewRanges);
+			FsArray<FsWriteSegment> WriteSegments = FsArray<FsWriteSegment>();
+			for (const FsContentRange& Range : NewRanges)
+			{
+				FsWriteSegment Segment = FsWriteSegment();
+				Segment.Offset = Range.AbsoluteOffset;
+				Segment.Length = Range.Length;
+				Segment.Source = CopyBuffer.GetData() + (Range.FileOffset - Copied);
+				WriteSegments.Add(Segment);
+			}
+
+			if (ReadV(ReadSegments) != FilesystemReadResult::Success || WriteV(WriteSegments) != FilesystemWriteResult::Success)
+			{
+				FsLogger::LogFormat(FilesystemLogType::Error, "Failed to copy file %s while defragmenting it", NormalizedPath.GetData());
+				SetBlockRunsInUse(GetBlockRunsForMap(NewBlockMap), false);
+				return false;
+			}
+
+			Copied += PieceLength;
+		}
+
+		// The new map is written to its own blocks, and saving the directory switches the file over to it in one write.
+		// Until then the old map and extents are still the file.
+		const uint64 OldFileOffset = File.FileOffset;
+		if (!SaveBlockMap(NormalizedPath, File, NewBlockMap) || !SaveDirectory(Directory, DirectoryFile.FileOffset))
+		{
+			FsLogger::LogFormat(FilesystemLogType::Error, "Failed to save directory %s", DirectoryPath.GetData());
+			File.FileOffset = OldFileOffset;
+			ClearCachedBlockMap(NormalizedPath);
+			SetBlockRunsInUse(GetBlockRunsForMap(NewBlockMap), false);
+			return false;
+		}
+
+		SetBlockRunsInUse(GetBlockRunsForMap(OldBlockMap), false);
+
+		FsLogger::LogFormat(FilesystemLogType::Info, "Defragmented file %s from %u fragments to %u, moved %u bytes", NormalizedPath.GetData(), OldFragments, CountFragments(NewDataRuns), Copied);
+
+		if (OutBytesMoved)
+		{
+			*OutBytesMoved = Copied;
+		}
+		return true;
+	}
+
+	FsLogger::LogFormat(FilesystemLogType::Error, "File %s does not exist", NormalizedPath.GetData());
+	return false;
+}
+
+bool FsFilesystem::DefragmentVolumeStep(FsDefragmentPass& Pass, uint64 MaxBytesToMove)
+{
+	if (!Pass.bStarted)
+	{
+		Pass.Files.Empty();
+		GatherFilePaths(FsPath(""), RootDirectory, Pass.Files);
+		Pass.NextFileIndex = 0;
+		Pass.bStarted = true;
+	}
+
+	uint64 BytesMovedThisStep = 0;
+	while (!Pass.IsComplete() && BytesMovedThisStep < MaxBytesToMove)
+	{
+		const FsPath& FilePath = Pass.Files[Pass.NextFileIndex];
+		Pass.NextFileIndex++;
+
+		// Files can be deleted between steps, so missing files are skipped
+		uint64 BytesMoved = 0;
+		if (!FileExists(FilePath) || !DefragmentFile(FilePath, &BytesMoved))
+		{
+			continue;
+		}
+
+		if (BytesMoved > 0)
+		{
+			Pass.FilesDefragmented++;
+			Pass.BytesMoved += BytesMoved;
+			BytesMovedThisStep += BytesMoved;
+		}
+	}
+
+	return Pass.IsComplete();
+}
+
+void FsFilesystem::GatherFilePaths(const FsPath& DirectoryPath, const FsDirectoryDescriptor& Directory, FsArray<FsPath>& OutFiles)
+{
+	for (const FsFileDescriptor& File : Directory.Files)
+	{
+		FsPath FilePath = DirectoryPath;
+		if (!FilePath.IsEmpty())
+		{
+			FilePath.Append("/");
+		}
+		FilePath.Append(File.FileName.GetData());
+
+		if (File.bIsDirectory)
+		{
+			GatherFilePaths(FilePath, ReadFileAsDirectory(File), OutFiles);
+		}
+		else
+		{
+			OutFiles.Add(FilePath);
+		}
+	}
+}
+
+bool FsFilesystem::ReadFromFile(const FsPath& InPath, uint64 Offset, uint8* Destination, uint64 Length, uint64* OutBytesRead)
+{
+	const FsPath NormalizedPath = InPath.NormalizePath();
+
+	// Reading staged bytes needs them on disk first
+	const FsDelayedWrite* DelayedWrite = GetDelayedWrite(NormalizedPath);
+	if (DelayedWrite && Offset + Length > DelayedWrite->FileOffset && !FlushFile(NormalizedPath))
+	{
+		return false;
+	}
+
+	if (!FileExists(NormalizedPath))
+	{
+		FsLogger::LogFormat(FilesystemLogType::Error, "File %s does not exist", NormalizedPath.GetData());
+		return false;
+	}
+
+	// Get the files directory
+	const FsPath DirectoryPath = NormalizedPath.GetPathWithoutFileName();
+	FsDirectoryDescriptor Directory{};
+	if (!GetDirectory(DirectoryPath, Directory))
+	{
+		FsLogger::LogFormat(FilesystemLogType::Error, "Failed to get directory for file %s", NormalizedPath.GetData());
+		return false;
+	}
+
+	const FsPath FileName = NormalizedPath.GetLastPath();
+
+	for (const FsFileDescriptor& File : Directory.Files)
+	{
+		if (File.FileName != FileName)
+		{
+			continue;
+		}
+
+		// Buffered and staged writes can take the file past the size in its directory. A read that ends before
+		// the staged data doesn't flush it, but the file is still as long as the staged data makes it.
+		const FsWriteBack* WriteBack = GetWriteBack(NormalizedPath);
+		const FsDelayedWrite* RemainingDelayedWrite = GetDelayedWrite(NormalizedPath);
+		const uint64 BufferedEnd = WriteBack ? WriteBack->FileOffset + WriteBack->Data.Length() : 0;
+		const uint64 StagedEnd = RemainingDelayedWrite ? RemainingDelayedWrite->FileOffset + RemainingDelayedWrite->Data.Length() : 0;
+		uint64 FileSize = BufferedEnd > File.FileSize ? BufferedEnd : File.FileSize;
+		FileSize = StagedEnd > FileSize ? StagedEnd : FileSize;
+
+		if (Offset > FileSize)
+		{
+			FsLogger::LogFormat(FilesystemLogType::Error, "Read is out of bounds for file %s", NormalizedPath.GetData());
+			return false;
+		}
+
+		// Reads past the end of the file stop at the end
+		if (Offset + Length > FileSize)
+		{
+			Length = FileSize - Offset;
+		}
+
+		// A file stored in its directory entry is already in memory
+		if (!File.InlineData.IsEmpty())
+		{
+			const uint64 InlineLength = Offset >= File.InlineData.Length() ? 0 : (Offset + Length < File.InlineData.Length() ? Length : File.InlineData.Length() - Offset);
+			FsMemory::Copy(Destination, File.InlineData.GetData() + Offset, InlineLength);
+			FsMemory::Zero(Destination + InlineLength, Length - InlineLength);
+			CopyFromWriteBack(NormalizedPath, Offset, Destination, Length);
+			if (OutBytesRead)
+			{
+				*OutBytesRead = Length;
+			}
+			return true;
+		}
+
+		// A file being read in order is usually already in memory
+		if (ReadFromReadAhead(NormalizedPath, Offset, Destination, Length))
+		{
+			CopyFromWriteBack(NormalizedPath, Offset, Destination, Length);
+			UpdateReadAhead(NormalizedPath, File, Offset, Length, true);
+			if (OutBytesRead)
+			{
+				*OutBytesRead = Length;
+			}
+			return true;
+		}
+
+		// Only the written part of the file is read from its blocks, the rest is zeros
+		const uint64 DiskReadLength = Offset >= File.WrittenSize ? 0 : (Offset + Length < File.WrittenSize ? Length : File.WrittenSize - Offset);
+
+		// The cached map is used in place, so a read never copies the extent list
+		const FsBlockMap* BlockMap = GetBlockMap(NormalizedPath, File);
+		if (!BlockMap)
+		{
+			return false;
+		}
+
+		// Read the file data from the blocks, only reading the part of each extent that overlaps the read.
+		// The reads for every extent are gathered up and sent to the storage together, straight into the caller's buffer.
+		FsArray<FsContentRange> Ranges = FsArray<FsContentRange>();
+		GetContentRanges(BlockMap->Extents, Offset, DiskReadLength, Ranges);
+
+		// Holes and the unwritten part of the file read as zeros, filled in memory without touching the storage
+		FsArray<FsReadSegment> Segments = FsArray<FsReadSegment>();
+		uint64 ZeroStart = Offset;
+		for (const FsContentRange& Range : Ranges)
+		{
+			FsMemory::Zero(Destination + (ZeroStart - Offset), Range.FileOffset - ZeroStart);
+			ZeroStart = Range.FileOffset + Range.Length;
+
+			FsReadSegment Segment = FsReadSegment();
+			Segment.Offset = Range.AbsoluteOffset;
+			Segment.Length = Range.Length;
+			Segment.Destination = Destination + (Range.FileOffset - Offset);
+			Segments.Add(Segment);
+		}
+		FsMemory::Zero(Destination + (ZeroStart - Offset), Offset + Length - ZeroStart);
+
+		if (!Segments.IsEmpty() && ReadV(Segments) != FilesystemReadResult::Success)
+		{
+			FsLogger::LogFormat(FilesystemLogType::Error, "Failed to read %u extents for file %s", Segments.Length(), NormalizedPath.GetData());
+			return false;
+		}
+
+		const uint64 BytesRead = Length;
+
+		// Buffered writes are newer than anything on disk
+		CopyFromWriteBack(NormalizedPath, Offset, Destination, Length);
+
+		UpdateReadAhead(NormalizedPath, File, Offset, Length, false);
+
+		if (OutBytesRead)
+		{
+			*OutBytesRead = BytesRead;
+		}
+		return true;
+	}
+
+	// Could not find the file
+	FsLogger::LogFormat(FilesystemLogType::Error, "Failed to read file %s", NormalizedPath.GetData());
+	return false;
+}
+
+uint64 FsFilesystem::HashFileName(const FsPath& FileName)
+{
+	return HashBytes(reinterpret_cast<const uint8*>(FileName.GetData()), FileName.Length());
+}
+
+uint64 FsFilesystem::HashBytes(const uint8* Data, uint64 Length, uint64 Hash)
+{
+	for (uint64 i = 0; i < Length; i++)
+	{
+		Hash ^= Data[i];
+		Hash *= 1099511628211ull;
+	}
+	return Hash;
+}
+
+void FsFilesystem::CacheBlockMap(const FsPath& FileName, const FsBlockMap& BlockMap)
+{
+	ClearCachedBlockMap(FileName);
+
+	FsCachedBlockMap NewCachedBlockMap = FsCachedBlockMap();
+	NewCachedBlockMap.FileName = FileName;
+	NewCachedBlockMap.FileNameHash = HashFileName(FileName);
+	NewCachedBlockMap.BlockMap = BlockMap;
+
+	CachedBlockMaps.Add(FsMove(NewCachedBlockMap));
+}
+
+void FsFilesystem::ClearCachedBlockMap(const FsPath& FileName)
+{
+	const uint64 FileNameHash = HashFileName(FileName);
+	for (uint64 i = 0; i < CachedBlockMaps.Length(); i++)
+	{
+		if (CachedBlockMaps[i].FileNameHash != FileNameHash || CachedBlockMaps[i].FileName != FileName)
+		{
+			continue;
+		}
+
+		// Move the last map into this slot rather than shifting, so no other map's extents get copied
+		const uint64 LastIndex = CachedBlockMaps.Length() - 1;
+		if (i != LastIndex)
+		{
+			CachedBlockMaps[i] = FsMove(CachedBlockMaps[LastIndex]);
+		}
+		CachedBlockMaps[LastIndex].BlockMap.Extents.Empty(true);
+		CachedBlockMaps[LastIndex].BlockMap.MapBlocks.Empty(true);
+		CachedBlockMaps.RemoveAt(LastIndex);
+		return;
+	}
+}
+
+FsBlockMap* FsFilesystem::GetCachedBlockMap(const FsPath& FileName)
+{
+	// Paths are only compared when their hashes match, so looking through many open files stays cheap
+	const uint64 FileNameHash = HashFileName(FileName);
+	for (FsCachedBlockMap& CachedBlockMap : CachedBlockMaps)
+	{
+		if (CachedBlockMap.FileNameHash == FileNameHash && CachedBlockMap.FileName == FileName)
+		{
+			return &CachedBlockMap.BlockMap;
+		}
+	}
+
+	return nullptr;
+}
+
+const FsBlockMap* FsFilesystem::GetBlockMap(const FsPath& InPath, const FsFileDescriptor& FileDescriptor)
+{
+	const FsBlockMap* CachedBlockMap = GetCachedBlockMap(InPath);
+	if (CachedBlockMap)
+	{
+		return CachedBlockMap;
+	}
+
+	// Loading the map caches it
+	FsBlockMap BlockMap = FsBlockMap();
+	if (!LoadBlockMap(InPath, FileDescriptor, BlockMap))
+	{
+		return nullptr;
+	}
+	return GetCachedBlockMap(InPath);
+}
+
+bool FsFilesystem::LoadBlockMap(const FsPath& InPath, const FsFileDescriptor& FileDescriptor, FsBlockMap& OutBlockMap)
+{
+	const FsBlockMap* CachedBlockMap = GetCachedBlockMap(InPath);
+	if (CachedBlockMap)
+	{
+		OutBlockMap = *CachedBlockMap;
+		return true;
+	}
+
+	OutBlockMap = FsBlockMap();
+
+	if (FileDescriptor.FileOffset == 0)
+	{
+		// This file is empty and has no blocks allocated for it.
+		CacheBlockMap(InPath, OutBlockMap);
+		return true;
+	}
+
+	// Follow the chain of map blocks, reading only the part of each one that holds extents
+	uint64 MapBlockIndex = AbsoluteOffsetToBlockIndex(FileDescriptor.FileOffset);
+	while (true)
+	{
+		const uint64 MapBlockOffset = BlockIndexToAbsoluteOffset(MapBlockIndex);
+
+		FsBitArray HeaderBuffer = FsBitArray();
+		HeaderBuffer.FillZeroed(sizeof(FsBlockMapHeader));
+		if (Read(MapBlockOffset, sizeof(FsBlockMapHeader), HeaderBuffer.GetInternalArray().GetData()) != FilesystemReadResult::Success)
+		{
+			FsLogger::LogFormat(FilesystemLogType::Error, "Failed to read the block map of file %s", FileDescriptor.FileName.GetData());
+			return false;
+		}
+
+		FsBitReader HeaderReader = FsBitReader(HeaderBuffer);
+		FsBlockMapHeader MapHeader = FsBlockMapHeader();
+		MapHeader.Serialize(HeaderReader);
+
+		if (MapHeader.ExtentCount > GetExtentsPerMapBlock())
+		{
+			FsLogger::LogFormat(FilesystemLogType::Error, "Block map of file %s claims %u extents in one block", FileDescriptor.FileName.GetData(), MapHeader.ExtentCount);
+			return false;
+		}
+
+		OutBlockMap.MapBlocks.Add(MapBlockIndex);
+
+		if (MapHeader.ExtentCount > 0)
+		{
+			FsBitArray ExtentBuffer = FsBitArray();
+			ExtentBuffer.FillZeroed(MapHeader.ExtentCount * sizeof(FsFileExtent));
+			if (Read(MapBlockOffset + sizeof(FsBlockMapHeader), MapHeader.ExtentCount * sizeof(FsFileExtent), ExtentBuffer.GetInternalArray().GetData()) != FilesystemReadResult::Success)
+			{
+				FsLogger::LogFormat(FilesystemLogType::Error, "Failed to read the block map of file %s", FileDescriptor.FileName.GetData());
+				return false;
+			}
+
+			FsBitReader ExtentReader = FsBitReader(ExtentBuffer);
+			for (uint64 i = 0; i < MapHeader.ExtentCount; i++)
+			{
+				FsFileExtent Extent = FsFileExtent();
+				Extent.Serialize(ExtentReader);
+				OutBlockMap.Extents.Add(Extent);
+			}
+		}
+
+		if (MapHeader.NextMapBlockIndex == 0)
+		{
+			break;
+		}
+		MapBlockIndex = MapHeader.NextMapBlockIndex;
+	}
+
+	CacheBlockMap(InPath, OutBlockMap);
+	return true;
+}
+
+bool FsFilesystem::SaveBlockMap(const FsPath& InPath, FsFileDescriptor& FileDescriptor, FsBlockMap& InOutBlockMap, FsBlockRunArray* OutFreedMapRuns)
+{
+#if FS_CHECK_LEVEL >= FS_CHECK_LEVEL_PARANOID
+	// Lookups binary search the extents, so they have to be in file order without overlapping
+	for (uint64 i = 0; i < InOutBlockMap.Extents.Length(); i++)
+	{
+		const FsFileExtent& Extent = InOutBlockMap.Extents[i];
+		fsCheck(Extent.Blocks > 0, "Block map has an empty extent");
+		fsCheck(i == 0 || InOutBlockMap.Extents[i - 1].FileBlockIndex + InOutBlockMap.Extents[i - 1].Blocks <= Extent.FileBlockIndex, "Block map extents are out of file order");
+	}
+#endif
+
+	ClearCachedBlockMap(InPath);
+
+	if (InOutBlockMap.Extents.IsEmpty())
+	{
+		// A file without content doesn't keep a map
+		FsBlockRunArray MapRuns = FsBlockRunArray();
+		for (uint64 MapBlockIndex : InOutBlockMap.MapBlocks)
+		{
+			FsBlockRun Run = FsBlockRun();
+			Run.StartBlockIndex = MapBlockIndex;
+			Run.Blocks = 1;
+			MapRuns.Add(Run);
+		}
+
+		if (OutFreedMapRuns)
+		{
+			OutFreedMapRuns->Append(MapRuns);
+		}
+		else if (!MapRuns.IsEmpty())
+		{
+			SetBlockRunsInUse(MapRuns, false);
+		}
+
+		InOutBlockMap.MapBlocks.Empty();
+		FileDescriptor.FileOffset = 0;
+		CacheBlockMap(InPath, InOutBlockMap);
+		return true;
+	}
+
+	// Grow or shrink the chain of map blocks to fit the extents
+	const uint64 ExtentsPerMapBlock = GetExtentsPerMapBlock();
+	const uint64 ExtentCount = InOutBlockMap.Extents.Length();
+	const uint64 MapBlocksNeeded = ExtentCount % ExtentsPerMapBlock == 0 ? ExtentCount / ExtentsPerMapBlock : ExtentCount / ExtentsPerMapBlock + 1;
+	if (InOutBlockMap.MapBlocks.Length() < MapBlocksNeeded)
+	{
+		const uint64 GoalBlockIndex = InOutBlockMap.MapBlocks.IsEmpty() ? InOutBlockMap.Extents[0].StartBlockIndex : InOutBlockMap.MapBlocks[InOutBlockMap.MapBlocks.Length() - 1] + 1;
+		const FsBlockRunArray MapRuns = AllocateBlockRuns(MapBlocksNeeded - InOutBlockMap.MapBlocks.Length(), GoalBlockIndex);
+		if (MapRuns.IsEmpty())
+		{
+			FsLogger::LogFormat(FilesystemLogType::Error, "Failed to find free blocks for the block map of file %s", InPath.GetData());
+			return false;
+		}
+
+		for (const FsBlockRun& Run : MapRuns)
+		{
+			for (uint64 i = 0; i < Run.Blocks; i++)
+			{
+				InOutBlockMap.MapBlocks.Add(Run.StartBlockIndex + i);
+			}
+		}
+	}
+	else if (InOutBlockMap.MapBlocks.Length() > MapBlocksNeeded)
+	{
+		FsBlockRunArray SpareRuns = FsBlockRunArray();
+		while (InOutBlockMap.MapBlocks.Length() > MapBlocksNeeded)
+		{
+			FsBlockRun Run = FsBlockRun();
+			Run.StartBlockIndex = InOutBlockMap.MapBlocks[InOutBlockMap.MapBlocks.Length() - 1];
+			Run.Blocks = 1;
+			SpareRuns.Add(Run);
+			InOutBlockMap.MapBlocks.RemoveAt(InOutBlockMap.MapBlocks.Length() - 1);
+		}
+
+		if (OutFreedMapRuns)
+		{
+			OutFreedMapRuns->Append(SpareRuns);
+		}
+		else
+		{
+			SetBlockRunsInUse(SpareRuns, false);
+		}
+	}
+
+	// Serialize every map block one after another, then write each one's used part to its block
+	FsBitArray MapBuffer = FsBitArray();
+	FsBitWriter MapWriter = FsBitWriter(MapBuffer);
+	for (uint64 MapIndex = 0; MapIndex < MapBlocksNeeded; MapIndex++)
+	{
+		const uint64 FirstExtent = MapIndex * ExtentsPerMapBlock;
+		FsBlockMapHeader MapHeader = FsBlockMapHeader();
+		MapHeader.ExtentCount = ExtentCount - FirstExtent < ExtentsPerMapBlock ? ExtentCount - FirstExtent : ExtentsPerMapBlock;
+		MapHeader.NextMapBlockIndex = MapIndex + 1 < MapBlocksNeeded ? InOutBlockMap.MapBlocks[MapIndex + 1] : 0;
+		MapHeader.Serialize(MapWriter);
+
+		for (uint64 i = 0; i < MapHeader.ExtentCount; i++)
+		{
+			InOutBlockMap.Extents[FirstExtent + i].Serialize(MapWriter);
+		}
+	}
+
+	fsCheck(MapBuffer.ByteLength() == MapBlocksNeeded * sizeof(FsBlockMapHeader) + ExtentCount * sizeof(FsFileExtent), "Block map serialized to an unexpected size");
+
+	FsArray<FsWriteSegment> Segments = FsArray<FsWriteSegment>();
+	uint64 BufferOffset = 0;
+	for (uint64 MapIndex = 0; MapIndex < MapBlocksNeeded; MapIndex++)
+	{
+		const uint64 FirstExtent = MapIndex * ExtentsPerMapBlock;
+		const uint64 MapExtents = ExtentCount - FirstExtent < ExtentsPerMapBlock ? ExtentCount - FirstExtent : ExtentsPerMapBlock;
+
+		FsWriteSegment Segment = FsWriteSegment();
+		Segment.Offset = BlockIndexToAbsoluteOffset(InOutBlockMap.MapBlocks[MapIndex]);
+		Segment.Length = sizeof(FsBlockMapHeader) + MapExtents * sizeof(FsFileExtent);
+		Segment.Source = MapBuffer.GetInternalArray().GetData() + BufferOffset;
+		Segments.Add(Segment);
+		BufferOffset += Segment.Length;
+	}
+
+	if (WriteV(Segments) != FilesystemWriteResult::Success)
+	{
+		FsLogger::LogFormat(FilesystemLogType::Error, "Failed to write the block map of file %s", InPath.GetData());
+		return false;
+	}
+
+	FileDescriptor.FileOffset = BlockIndexToAbsoluteOffset(InOutBlockMap.MapBlocks[0]);
+	CacheBlockMap(InPath, InOutBlockMap);
+	return true;
+}
+
+void FsFilesystem::AddExtent(FsBlockMap& InOutBlockMap, uint64 FileBlockIndex, const FsBlockRun& Run)
+{
+	if (Run.Blocks == 0)
+	{
+		return;
+	}
+
+	// The run goes in front of the first extent after it, which is the end for appends
+	FsFileExtentArray& Extents = InOutBlockMap.Extents;
+	const uint64 ExtentIndex = FindExtentIndex(Extents, FileBlockIndex);
+	fsCheckDebug(ExtentIndex == Extents.Length() || Extents[ExtentIndex].FileBlockIndex >= FileBlockIndex + Run.Blocks, "Run overlaps an extent of the file");
+
+	// Blocks that carry straight on from the extent before just make it longer, and may close the gap to the one after
+	if (ExtentIndex > 0)
+	{
+		FsFileExtent& Previous = Extents[ExtentIndex - 1];
+		if (Previous.FileBlockIndex + Previous.Blocks == FileBlockIndex && Previous.StartBlockIndex + Previous.Blocks == Run.StartBlockIndex)
+		{
+			Previous.Blocks += Run.Blocks;
+			if (ExtentIndex < Extents.Length())
+			{
+				const FsFileExtent& Next = Extents[ExtentIndex];
+				if (Previous.FileBlockIndex + Previous.Blocks == Next.FileBlockIndex && Previous.StartBlockIndex + Previous.Blocks == Next.StartBlockIndex)
+				{
+					Previous.Blocks += Next.Blocks;
+					Extents.RemoveAt(ExtentIndex);
+				}
+			}
+			return;
+		}
+	}
+
+	if (ExtentIndex < Extents.Length())
+	{
+		FsFileExtent& Next = Extents[ExtentIndex];
+		if (FileBlockIndex + Run.Blocks == Next.FileBlockIndex && Run.StartBlockIndex + Run.Blocks == Next.StartBlockIndex)
+		{
+			Next.FileBlockIndex = FileBlockIndex;
+			Next.StartBlockIndex = Run.StartBlockIndex;
+			Next.Blocks += Run.Blocks;
+			return;
+		}
+	}
+
+	FsFileExtent Extent = FsFileExtent();
+	Extent.FileBlockIndex = FileBlockIndex;
+	Extent.StartBlockIndex = Run.StartBlockIndex;
+	Extent.Blocks = Run.Blocks;
+	Extents.InsertAt(ExtentIndex, Extent);
+}
+
+uint64 FsFilesystem::FindExtentIndex(const FsFileExtentArray& Extents, uint64 FileBlockIndex)
+{
+	// Extents are in file order, so the first one that ends after the block is found by halving the range
+	uint64 Low = 0;
+	uint64 High = Extents.Length();
+	while (Low < High)
+	{
+		const uint64 Middle = Low + (High - Low) / 2;
+		if (Extents[Middle].FileBlockIndex + Extents[Middle].Blocks <= FileBlockIndex)
+		{
+			Low = Middle + 1;
+		}
+		else
+		{
+			High = Middle;
+		}
+	}
+	return Low;
+}
+
+void FsFilesystem::GetContentRanges(const FsFileExtentArray& Extents, uint64 Offset, uint64 Length, FsArray<FsContentRange>& OutRanges) const
+{
+	if (Length == 0)
+	{
+		return;
+	}
+
+	// Only the extents the range covers are visited, starting from the one holding Offset
+	const uint64 End = Offset + Length;
+	for (uint64 ExtentIndex = FindExtentIndex(Extents, Offset / BlockSize); ExtentIndex < Extents.Length(); ExtentIndex++)
+	{
+		const FsFileExtent& Extent = Extents[ExtentIndex];
+		const uint64 ExtentStart = Extent.FileBlockIndex * BlockSize;
+		const uint64 ExtentEnd = ExtentStart + Extent.Blocks * BlockSize;
+		if (ExtentStart >= End)
+		{
+			break;
+		}
+
+		const uint64 RangeStart = Offset > ExtentStart ? Offset : ExtentStart;
+		const uint64 RangeEnd = End < ExtentEnd ? End : ExtentEnd;
+
+		FsContentRange Range = FsContentRange();
+		Range.FileOffset = RangeStart;
+		Range.AbsoluteOffset = BlockIndexToAbsoluteOffset(Extent.StartBlockIndex) + (RangeStart - ExtentStart);
+		Range.Length = RangeEnd - RangeStart;
+		OutRanges.Add(Range);
+	}
+}
+
+FsBlockRunArray FsFilesystem::GetBlockRunsForExtents(const FsFileExtentArray& Extents)
+{
+	FsBlockRunArray Runs = FsBlockRunArray();
+	for (const FsFileExtent& Extent : Extents)
+	{
+		FsBlockRun Run = FsBlockRun();
+		Run.StartBlockIndex = Extent.StartBlockIndex;
+		Run.Blocks = Extent.Blocks;
+		Runs.Add(Run);
+	}
+	return Runs;
+}
+
+FsBlockRunArray FsFilesystem::GetBlockRunsForMap(const FsBlockMap& BlockMap)
+{
+	FsBlockRunArray Runs = GetBlockRunsForExtents(BlockMap.Extents);
+	for (uint64 MapBlockIndex : BlockMap.MapBlocks)
+	{
+		FsBlockRun Run = FsBlockRun();
+		Run.StartBlockIndex = MapBlockIndex;
+		Run.Blocks = 1;
+		Runs.Add(Run);
+	}
+	return Runs;
+}
+
+uint64 FsBlockMap::GetBlockCount() const
+{
+	uint64 Blocks = 0;
+	for (const FsFileExtent& Extent : Extents)
+	{
+		Blocks += Extent.Blocks;
+	}
+	return Blocks;
+}
+
+uint64 FsBlockMap::GetEndFileBlockIndex() const
+{
+	if (Extents.IsEmpty())
+	{
+		return 0;
+	}
+	const FsFileExtent& LastExtent = Extents[Extents.Length() - 1];
+	return LastExtent.FileBlockIndex + LastExtent.Blocks;
+}
+
+void FsFileChunkHeader::Serialize(FsBitStream& BitStream)
+{
+	BitStream << NextBlockIndex;
+	BitStream << Blocks;
+}
+
+void FsFileExtent::Serialize(FsBitStream& BitStream)
+{
+	BitStream << FileBlockIndex;
+	BitStream << StartBlockIndex;
+	BitStream << Blocks;
+}
+
+void FsBlockMapHeader::Serialize(FsBitStream& BitStream)
+{
+	BitStream << ExtentCount;
+	BitStream << NextMapBlockIndex;
+}
+
+void FsFileDescriptor::Serialize(FsBitStream& BitStream)
+{
+	BitStream << FileName;
+	BitStream << FileSize;
+	BitStream << FileOffset;
+
+	// Files from older versions were always written up to their size
+	if (BitStream.IsVersionBefore(3))
+	{
+		WrittenSize = FileSize;
+	}
+	else
+	{
+		BitStream << WrittenSize;
+	}
+
+	BitStream << bIsDirectory;
+
+	if (BitStream.IsVersionBefore(5))
+	{
+		return;
+	}
+
+	uint64 InlineLength = InlineData.Length();
+	BitStream << InlineLength;
+	if (BitStream.IsReading())
+	{
+		InlineData.FillZeroed(InlineLength);
+	}
+	for (uint64 i = 0; i < InlineLength; i++)
+	{
+		BitStream << InlineData[i];
+	}
+}
+
+void FsDirectoryDescriptor::Serialize(FsBitStream& BitStream)
+{
+	uint64 NumFiles = Files.Length();
+	BitStream << NumFiles;
+	if (BitStream.IsReading())
+	{
+		Files.FillDefault(NumFiles);
+	}
+
+	for (uint64 i = 0; i < NumFiles; i++)
+	{
+		Files[i].Serialize(BitStream);
+	}
+}
+
+void FsFilesystemHeader::Serialize(FsBitStream& BitStream)
+{
+	BitStream << MagicNumber;
+	if (BitStream.IsReading())
+	{
+		// Check the magic number
+		if (MagicNumber != FS_MAGIC)
+		{
+			FsLogger::LogFormat(FilesystemLogType::Warning, "Invalid magic number in filesystem header. Expected %u, got %u. Perhaps the filesystem is not set up.", FS_MAGIC, MagicNumber);
+			return;
+		}
+	}
+
+	BitStream << FilesystemVersion;
+	FsLogger::LogFormat(FilesystemLogType::Verbose, "Serialized Filesystem version: %s", FilesystemVersion.GetData());
+
+	if (BitStream.IsReading())
+	{
+		BitStream.SetVersion(GetVersionNumber());
+	}
+
+	// Older versions did not store the used block count, it has to be recounted after loading
+	if (!BitStream.IsReading() || FilesystemVersion != FsString(FS_VERSION_1))
+	{
+		BitStream << UsedBlocks;
+	}
+
+	RootDirectory.Serialize(BitStream);
+	RootDirectory.bDirectoryIsRoot = true;
+}
+
+uint64 FsFilesystemHeader::GetUsedBlocksOffset() const
+{
+	// Everything before the count is whole bytes, so it starts on a byte boundary
+	FsBitArray PrefixBuffer = FsBitArray();
+	FsBitWriter PrefixWriter = FsBitWriter(PrefixBuffer);
+
+	uint64 PrefixMagicNumber = MagicNumber;
+	FsFixedLengthString<32> PrefixVersion = FilesystemVersion;
+	PrefixWriter << PrefixMagicNumber;
+	PrefixWriter << PrefixVersion;
+	return PrefixBuffer.ByteLength();
+}
+
+uint64 FsFilesystemHeader::GetVersionNumber() const
+{
+	if (FilesystemVersion == FsString(FS_VERSION_1))
+	{
+		return 1;
+	}
+	if (FilesystemVersion == FsString(FS_VERSION_2))
+	{
+		return 2;
+	}
+	if (FilesystemVersion == FsString(FS_VERSION_3))
+	{
+		return 3;
+	}
+	if (FilesystemVersion == FsString(FS_VERSION_4))
+	{
+		return 4;
+	}
+	return FS_VERSION_NUMBER;
+}
+
+void FsFilesystem::LoadOrCreateFilesystemHeader()
+{
+	FsLogger::LogFormat(FilesystemLogType::Verbose, "Loading or creating filesystem header");
+	
+	// The header can take up everything before the block buffer, since the root directory grows with it
+	FsBitArray HeaderBuffer;
+	HeaderBuffer.FillZeroed(GetBlockBufferOffset());
+
+	// read the first bytes of the filesystem to find the file system header
+	const FilesystemReadResult ReadResult = Read(0, GetBlockBufferOffset(), HeaderBuffer.GetInternalArray().GetData());
+	if (ReadResult != FilesystemReadResult::Success)
+	{
+		FsLogger::LogFormat(FilesystemLogType::Error, "Failed to read filesystem header. Ensure `Read` is implemented correctly.");
+		return;
+	}
+
+	FsBitReader HeaderReader = FsBitReader(HeaderBuffer);
+
+	FsFilesystemHeader FilesystemHeader;
+	FilesystemHeader.Serialize(HeaderReader);
+
+	if (FilesystemHeader.MagicNumber != FS_MAGIC)
+	{
+		FsLogger::LogFormat(FilesystemLogType::Warning, "Filesystem header not found. Creating a new one.");
+
+		FilesystemHeader.MagicNumber = FS_MAGIC;
+		FilesystemHeader.FilesystemVersion = FS_VERSION;
+		FilesystemHeader.RootDirectory = FsDirectoryDescriptor();
+		FilesystemHeader.RootDirectory.bDirectoryIsRoot = true;
+		RootDirectory.bDirectoryIsRoot = true;
+
+		ClearBlockBuffer();
+
+		FsFileDescriptor RootDirectoryFile;
+		RootDirectoryFile.FileName = "Root";
+		RootDirectoryFile.bIsDirectory = true;
+
+		// find a block for the root directory
+		const FsBlockArray RootDirectoryBlocks = GetFreeBlocks(1);
+		if (RootDirectoryBlocks.Length() == 0)
+		{
+			FsLogger::LogFormat(FilesystemLogType::Error, "Failed to find a block for the root directory");
+			return;
+		}
+
+		SetBlocksInUse(RootDirectoryBlocks, true);
+
+		const uint64 AbsoluteOffset = BlockIndexToAbsoluteOffset(RootDirectoryBlocks[0]);
+
+		RootDirectoryFile.FileOffset = AbsoluteOffset;
+		RootDirectoryFile.FileSize = 0;
+
+		SaveFilesystemHeader(FilesystemHeader);
+
+		FsLogger::LogFormat(FilesystemLogType::Verbose, "Filesystem header created successfully. Root directory located at %u bytes.", RootDirectoryFile.FileOffset);
+		return;
+	}
+
+	RootDirectory = FilesystemHeader.RootDirectory;
+	RootDirectory.bDirectoryIsRoot = true;
+	UsedBlocks = FilesystemHeader.UsedBlocks;
+
+	LoadBlockBuffer();
+
+	if (FilesystemHeader.FilesystemVersion == FsString(FS_VERSION_1))
+	{
+		// Upgrade the header so the used block count is stored from now on
+		FsLogger::LogFormat(FilesystemLogType::Warning, "Upgrading filesystem header from %s to %s", FS_VERSION_1, FS_VERSION);
+		RecountUsedBlocks();
+	}
+
+	if (FilesystemHeader.GetVersionNumber() < FS_VERSION_NUMBER)
+	{
+		// Directories are read in their old layout until every one of them has been rewritten.
+		// Files from before block maps are copied to new blocks on the way, which needs as much free space as the largest file.
+		FsLogger::LogFormat(FilesystemLogType::Warning, "Upgrading directories from %s to %s", FilesystemHeader.FilesystemVersion.GetData(), FS_VERSION);
+		DirectoryVersion = FilesystemHeader.GetVersionNumber();
+		if (!UpgradeDirectories(FsPath(""), RootDirectory, FilesystemHeader.GetVersionNumber()))
+		{
+			FsLogger::LogFormat(FilesystemLogType::Error, "Failed to upgrade directories");
+		}
+		DirectoryVersion = FS_VERSION_NUMBER;
+
+		// The root directory lives in the header, saving it stores the new version too
+		FsFilesystemHeader UpgradedHeader = FsFilesystemHeader();
+		UpgradedHeader.RootDirectory = RootDirectory;
+		SaveFilesystemHeader(UpgradedHeader);
+	}
+
+	FsLogger::LogFormat(FilesystemLogType::Verbose, "Filesystem header loaded successfully");
+}
+
+bool FsFilesystem::GetUsedBlocksCount(uint64& OutUsedBlocks)
+{
+	OutUsedBlocks = UsedBlocks;
+	return true;
+}
+
+uint64 FsFilesystem::CountUsedBlocks() const
+{
+	return BlockBuffer.CountSetBits(0, BlockBuffer.BitLength());
+}
+
+bool FsFilesystem::RecountUsedBlocks()
+{
+	const uint64 CountedBlocks = CountUsedBlocks();
+	const bool bCountWasCorrect = CountedBlocks == UsedBlocks;
+	if (!bCountWasCorrect)
+	{
+		FsLogger::LogFormat(FilesystemLogType::Warning, "Stored used block count %u does not match the block buffer (%u used). Correcting it.", FsAtomicLoad64(&UsedBlocks), CountedBlocks);
+	}
+
+	UsedBlocks = CountedBlocks;
+
+	FsFilesystemHeader Header = FsFilesystemHeader();
+	Header.RootDirectory = RootDirectory;
+	SaveFilesystemHeader(Header);
+
+	return bCountWasCorrect;
+}
+
+void FsFilesystem::SetBlocksInUse(const FsBlockArray& BlockIndices, bool bInUse)
+{
+	fsCheck(BlockIndices.Length() > 0, "BlockIndices must have at least one element");
+
+	// Merge consecutive block indices into runs
+	FsBlockRunArray Runs = FsBlockRunArray();
+	for (uint64 BlockIndex : BlockIndices)
+	{
+		if (!Runs.IsEmpty())
+		{
+			FsBlockRun& LastRun = Runs[Runs.Length() - 1];
+			if (LastRun.StartBlockIndex + LastRun.Blocks == BlockIndex)
+			{
+				LastRun.Blocks++;
+				continue;
+			}
+		}
+
+		FsBlockRun Run = FsBlockRun();
+		Run.StartBlockIndex = BlockIndex;
+		Run.Blocks = 1;
+		Runs.Add(Run);
+	}
+
+	SetBlockRunsInUse(Runs, bInUse);
+}
+
+void FsFilesystem::SetBlockRunsInUse(const FsBlockRunArray& Runs, bool bInUse)
+{
+	fsCheck(Runs.Length() > 0, "Runs must have at least one element");
+
+	bool bDiscardsDue = false;
+	for (const FsBlockRun& Run : Runs)
+	{
+		// Runs that were not made by the allocator can cross allocation groups, so update one group at a time
+		uint64 SegmentStart = Run.StartBlockIndex;
+		const uint64 RunEnd = Run.StartBlockIndex + Run.Blocks;
+		while (SegmentStart < RunEnd)
+		{
+			FsAllocationGroup& Group = AllocationGroups[GetAllocationGroupIndex(SegmentStart)];
+			const uint64 SegmentEnd = Group.EndBlockIndex < RunEnd ? Group.EndBlockIndex : RunEnd;
+
+			FsBlockRun Segment = FsBlockRun();
+			Segment.StartBlockIndex = SegmentStart;
+			Segment.Blocks = SegmentEnd - SegmentStart;
+
+			FsScopedSpinLock GroupLock = FsScopedSpinLock(Group.Lock);
+			SetBlockRunInUse_Internal(Segment, bInUse);
+
+			SegmentStart = SegmentEnd;
+		}
+
+		if (!bInUse && QueueDiscard(Run))
+		{
+			bDiscardsDue = true;
+		}
+	}
+
+	SaveBlockBufferChanges();
+
+	if (bDiscardsDue)
+	{
+		FlushDiscards();
+	}
+}
+
+FilesystemReadResult FsFilesystem::ReadV(const FsArray<FsReadSegment>& Segments)
+{
+	FsArray<FsIoRequest> Requests = FsArray<FsIoRequest>();
+	for (uint64 i = 0; i < Segments.Length(); i++)
+	{
+		FsIoRequest Request = FsIoRequest();
+		Request.Tag = i;
+		Request.Operation = FsIoOperation::Read;
+		Request.Offset = Segments[i].Offset;
+		Request.Length = Segments[i].Length;
+		Request.Destination = Segments[i].Destination;
+		Requests.Add(Request);
+	}
+
+	return RunIoRequests(Requests) ? FilesystemReadResult::Success : FilesystemReadResult::Failed;
+}
+
+FilesystemWriteResult FsFilesystem::WriteV(const FsArray<FsWriteSegment>& Segments)
+{
+	FsArray<FsIoRequest> Requests = FsArray<FsIoRequest>();
+	for (uint64 i = 0; i < Segments.Length(); i++)
+	{
+		FsIoRequest Request = FsIoRequest();
+		Request.Tag = i;
+		Request.Operation = FsIoOperation::Write;
+		Request.Offset = Segments[i].Offset;
+		Request.Length = Segments[i].Length;
+		Request.Source = Segments[i].Source;
+		Requests.Add(Request);
+	}
+
+	return RunIoRequests(Requests) ? FilesystemWriteResult::Success : FilesystemWriteResult::Failed;
+}
+
+bool FsFilesystem::SubmitIo(const FsIoRequest& Request)
+{
+	FsIoCompletion Completion = FsIoCompletion();
+	Completion.Tag = Request.Tag;
+	if (Request.Operation == FsIoOperation::Read)
+	{
+		Completion.bSucceeded = Read(Request.Offset, Request.Length, Request.Destination) == FilesystemReadResult::Success;
+	}
+	else
+	{
+		Completion.bSucceeded = Write(Request.Offset, Request.Length, Request.Source) == FilesystemWriteResult::Success;
+	}
+
+	CompletedIo.Add(Completion);
+	return true;
+}
+
+bool FsFilesystem::WaitForIoCompletion(FsIoCompletion& OutCompletion)
+{
+	if (CompletedIo.IsEmpty())
+	{
+		return false;
+	}
+
+	// Order doesn't matter to the caller, so take the last one
+	OutCompletion = CompletedIo[CompletedIo.Length() - 1];
+	CompletedIo.RemoveAt(CompletedIo.Length() - 1);
+	return true;
+}
+
+bool FsFilesystem::RunIoRequests(const FsArray<FsIoRequest>& Requests)
+{
+	const uint64 QueueDepth = MountOptions.IoQueueDepth > 0 ? MountOptions.IoQueueDepth : 1;
+
+	bool bSucceeded = true;
+	uint64 NextRequest = 0;
+	uint64 InFlight = 0;
+	while (NextRequest < Requests.Length() || InFlight > 0)
+	{
+		// Top the queue back up, unless something already failed
+		while (bSucceeded && InFlight < QueueDepth && NextRequest < Requests.Length())
+		{
+			if (!SubmitIo(Requests[NextRequest]))
+			{
+				FsLogger::LogFormat(FilesystemLogType::Error, "Failed to submit %u bytes of IO at offset %u", Requests[NextRequest].Length, Requests[NextRequest].Offset);
+				bSucceeded = false;
+				break;
+			}
+			NextRequest++;
+			InFlight++;
+		}
+
+		if (InFlight == 0)
+		{
+			break;
+		}
+
+		// The buffers belong to the caller, so every request in flight has to finish before returning, even after a failure
+		FsIoCompletion Completion = FsIoCompletion();
+		if (!WaitForIoCompletion(Completion))
+		{
+			fsCheck(false, "Submitted IO never completed");
+			return false;
+		}
+
+		// Read ahead shares the queue, so its requests can finish while waiting for these
+		if (Completion.Tag & FS_READ_AHEAD_TAG)
+		{
+			OnReadAheadCompleted(Completion);
+			continue;
+		}
+		InFlight--;
+
+		if (!Completion.bSucceeded)
+		{
+			fsCheck(Completion.Tag < Requests.Length(), "IO completed with an unknown tag");
+			FsLogger::LogFormat(FilesystemLogType::Error, "Failed to %s %u bytes at offset %u", Requests[Completion.Tag].Operation == FsIoOperation::Read ? "read" : "write", Requests[Completion.Tag].Length, Requests[Completion.Tag].Offset);
+			bSucceeded = false;
+		}
+	}
+
+	return bSucceeded;
+}
+
+bool FsFilesystem::QueueDiscard(const FsBlockRun& Run)
+{
+	FsScopedSpinLock Lock = FsScopedSpinLock(PendingDiscardsLock);
+	if (MountOptions.DiscardMode == FsDiscardMode::Off || bDiscardUnsupported)
+	{
+		return false;
+	}
+
+	FsBlockRun MergedRun = Run;
+	PendingDiscardBlocks += Run.Blocks;
+
+	// Absorb any pending runs touching this one, a run can touch at most one on each side
+	for (uint64 i = 0; i < PendingDiscards.Length();)
+	{
+		const FsBlockRun& PendingRun = PendingDiscards[i];
+		const uint64 PendingEnd = PendingRun.StartBlockIndex + PendingRun.Blocks;
+		const uint64 MergedEnd = MergedRun.StartBlockIndex + MergedRun.Blocks;
+		if (PendingEnd < MergedRun.StartBlockIndex || PendingRun.StartBlockIndex > MergedEnd)
+		{
+			i++;
+			continue;
+		}
+
+		const uint64 NewStart = PendingRun.StartBlockIndex < MergedRun.StartBlockIndex ? PendingRun.StartBlockIndex : MergedRun.StartBlockIndex;
+		const uint64 NewEnd = PendingEnd > MergedEnd ? PendingEnd : MergedEnd;
+
+		// Overlapping blocks were counted twice
+		PendingDiscardBlocks -= PendingRun.Blocks + MergedRun.Blocks - (NewEnd - NewStart);
+		MergedRun.StartBlockIndex = NewStart;
+		MergedRun.Blocks = NewEnd - NewStart;
+
+		PendingDiscards[i] = PendingDiscards[PendingDiscards.Length() - 1];
+		PendingDiscards.RemoveAt(PendingDiscards.Length() - 1);
+	}
+
+	PendingDiscards.Add(MergedRun);
+	return MountOptions.DiscardMode == FsDiscardMode::Immediate || PendingDiscardBlocks >= MountOptions.DeferredDiscardBlocks;
+}
+
+bool FsFilesystem::FlushDiscards()
+{
+	// Take the pending runs, so other threads can queue more while these are sent
+	FsBlockRunArray Runs = FsBlockRunArray();
+	{
+		FsScopedSpinLock Lock = FsScopedSpinLock(PendingDiscardsLock);
+		Runs = FsMove(PendingDiscards);
+		PendingDiscards.Empty();
+		PendingDiscardBlocks = 0;
+	}
+
+	bool bSucceeded = true;
+	for (const FsBlockRun& Run : Runs)
+	{
+		const uint64 RunEnd = Run.StartBlockIndex + Run.Blocks;
+		uint64 SegmentStart = Run.StartBlockIndex;
+		while (SegmentStart < RunEnd && !bDiscardUnsupported)
+		{
+			FsAllocationGroup& Group = AllocationGroups[GetAllocationGroupIndex(SegmentStart)];
+			const uint64 SegmentEnd = Group.EndBlockIndex < RunEnd ? Group.EndBlockIndex : RunEnd;
+
+			// Blocks can be allocated again before a deferred discard goes out, so only discard what is still free.
+			// Those blocks are claimed under the group's lock so they can't be allocated while the storage discards them,
+			// without holding the lock for the discard itself.
+			FsBlockRunArray FreeRuns = FsBlockRunArray();
+			{
+				FsScopedSpinLock GroupLock = FsScopedSpinLock(Group.Lock);
+				uint64 FreeStart = SegmentStart;
+				while (FreeStart < SegmentEnd && BlockBuffer.FindFirstClearBit(FreeStart, SegmentEnd, FreeStart))
+				{
+					uint64 FreeEnd = SegmentEnd;
+					BlockBuffer.FindFirstSetBit(FreeStart, SegmentEnd, FreeEnd);
+
+					FsBlockRun FreeRun = FsBlockRun();
+					FreeRun.StartBlockIndex = FreeStart;
+					FreeRun.Blocks = FreeEnd - FreeStart;
+					ClaimRunForDiscard(FreeRun, true);
+					FreeRuns.Add(FreeRun);
+
+					FreeStart = FreeEnd;
+				}
+			}
+
+			for (const FsBlockRun& FreeRun : FreeRuns)
+			{
+				const FilesystemDiscardResult Result = bDiscardUnsupported ? FilesystemDiscardResult::Unsupported : Discard(BlockIndexToAbsoluteOffset(FreeRun.StartBlockIndex), FreeRun.Blocks * BlockSize);
+				if (Result == FilesystemDiscardResult::Unsupported && !bDiscardUnsupported)
+				{
+					FsLogger::LogFormat(FilesystemLogType::Info, "Storage does not support discard, freed blocks will no longer be discarded");
+					FsScopedSpinLock Lock = FsScopedSpinLock(PendingDiscardsLock);
+					bDiscardUnsupported = true;
+				}
+				if (Result == FilesystemDiscardResult::Failed)
+				{
+					// Discards are only a hint, the blocks are free either way
+					FsLogger::LogFormat(FilesystemLogType::Warning, "Failed to discard %u blocks at block %u", FreeRun.Blocks, FreeRun.StartBlockIndex);
+					bSucceeded = false;
+				}
+			}
+
+			{
+				FsScopedSpinLock GroupLock = FsScopedSpinLock(Group.Lock);
+				for (const FsBlockRun& FreeRun : FreeRuns)
+				{
+					ClaimRunForDiscard(FreeRun, false);
+				}
+			}
+
+			SegmentStart = SegmentEnd;
+		}
+	}
+
+	return bSucceeded;
+}
+
+void FsFilesystem::ClaimRunForDiscard(const FsBlockRun& Run, bool bClaim)
+{
+	// The bits hide the run from the allocator, but the used block count and the dirty pages are left alone,
+	// and FlushBlockBuffer writes the run out as free while it is claimed.
+	if (bClaim)
+	{
+		BlockBuffer.SetBitRange(Run.StartBlockIndex, Run.Blocks);
+	}
+	else
+	{
+		BlockBuffer.ClearBitRange(Run.StartBlockIndex, Run.Blocks);
+	}
 
-	CachedChunks.Add(NewCachedChunks);
-}
+	FsAllocationGroup& Group = AllocationGroups[GetAllocationGroupIndex(Run.StartBlockIndex)];
+	Group.FreeSpaceTree.Update(BlockBuffer, Run.StartBlockIndex, Run.Blocks);
+	Group.FreeExtentIndex.Update(BlockBuffer, Run.StartBlockIndex, Run.Blocks);
 
-void FsFilesystem::ClearCachedChunks(const FsPath& FileName)
-{
-	for (uint64 i = 0; i < CachedChunks.Length(); i++)
+	FsScopedSpinLock Lock = FsScopedSpinLock(BlockBufferLock);
+	if (bClaim)
 	{
-		if (CachedChunks[i].FileName == FileName)
-		{
-			CachedChunks.RemoveAt(i);
-			return;
-		}
+		DiscardingRuns.Add(Run);
+		return;
 	}
-}
 
-bool FsFilesystem::GetCachedChunks(const FsPath& FileName, FsArray<FsFileChunkHeader>& OutChunks)
-{
-	for (const FsCachedChunkList& CachedChunks : CachedChunks)
+	uint64 RunIndex = 0;
+	while (RunIndex < DiscardingRuns.Length() && DiscardingRuns[RunIndex].StartBlockIndex != Run.StartBlockIndex)
 	{
-		if (CachedChunks.FileName == FileName)
-		{
-			OutChunks = CachedChunks.Chunks;
-			return true;
-		}
+		RunIndex++;
 	}
+	fsCheck(RunIndex < DiscardingRuns.Length(), "Released a run that was not claimed for a discard");
 
-	return false;
+	DiscardingRuns[RunIndex] = DiscardingRuns[DiscardingRuns.Length() - 1];
+	DiscardingRuns.RemoveAt(DiscardingRuns.Length() - 1);
 }
 
-FsArray<FsFileChunkHeader> FsFilesystem::GetAllChunksForFile(const FsPath& InPath, const FsFileDescriptor& FileDescriptor, const uint64* OptionalFileLength)
+void FsFilesystem::SetBlockRunInUse_Internal(const FsBlockRun& Run, bool bInUse)
 {
-	FsArray<FsFileChunkHeader> AllBlocks{};
-	if (!OptionalFileLength && GetCachedChunks(InPath, AllBlocks))
+	const uint64 EndBlockIndex = Run.StartBlockIndex + Run.Blocks;
+	fsCheck(Run.Blocks > 0 && EndBlockIndex <= GetBlockBufferSizeBits(), "Block run is outside of the partition");
+
+	// Check how many blocks are already what we are setting them to
+	const uint64 SetBlocks = BlockBuffer.CountSetBits(Run.StartBlockIndex, EndBlockIndex);
+	const uint64 UnchangedBlocks = bInUse ? SetBlocks : Run.Blocks - SetBlocks;
+	if (UnchangedBlocks > 0)
 	{
-		//FsLogger::LogFormat(FilesystemLogType::Info, "Found cached chunks for file %s", InPath.GetData());
-		return AllBlocks;
+		FsLogger::LogFormat(FilesystemLogType::Warning, "%u blocks in the run of %u blocks at %u are already %s", UnchangedBlocks, Run.Blocks, Run.StartBlockIndex, bInUse ? "in use" : "free");
 	}
 
-	if (FileDescriptor.FileOffset == 0)
+	if (bInUse)
 	{
-		// This file is empty and has no blocks allocated for it.
-		return AllBlocks;
+		BlockBuffer.SetBitRange(Run.StartBlockIndex, Run.Blocks);
+		FsAtomicAdd64(&UsedBlocks, Run.Blocks - SetBlocks);
+	}
+	else
+	{
+		BlockBuffer.ClearBitRange(Run.StartBlockIndex, Run.Blocks);
+		const uint64 PreviousUsedBlocks = FsAtomicAdd64(&UsedBlocks, 0 - SetBlocks) + SetBlocks;
+		fsCheck(PreviousUsedBlocks >= SetBlocks, "Used block count underflow");
 	}
 
-	// Read the first block of the file
-	const uint64 ReadOffset = FileDescriptor.FileOffset;
-	const uint64 ReadLength = sizeof(FsFileChunkHeader);
+	MarkBlockBufferDirty(Run.StartBlockIndex, Run.Blocks);
+	FsAllocationGroup& Group = AllocationGroups[GetAllocationGroupIndex(Run.StartBlockIndex)];
+	Group.FreeSpaceTree.Update(BlockBuffer, Run.StartBlockIndex, Run.Blocks);
+	Group.FreeExtentIndex.Update(BlockBuffer, Run.StartBlockIndex, Run.Blocks);
 
-	FsBitArray FileBuffer = FsBitArray();
-	FileBuffer.FillZeroed(ReadLength);
+	// The caller holds the group's lock, so its bits can't change while they are counted
+	fsCheckParanoid(Group.FreeSpaceTree.GetFreeBlocks() == Group.EndBlockIndex - Group.StartBlockIndex - BlockBuffer.CountSetBits(Group.StartBlockIndex, Group.EndBlockIndex), "Free space tree disagrees with the block buffer");
+}
 
-	const FilesystemReadResult ReadResult = Read(ReadOffset, ReadLength, FileBuffer.GetInternalArray().GetData());
-	if (ReadResult != FilesystemReadResult::Success)
+void FsFilesystem::SaveBlockBufferChanges()
+{
+	// Only one thread writes back at a time, and no thread waits for another's writes.
+	// If one is already writing back, it goes round again for the changes made meanwhile, so these are left to it.
+	FsAtomicAdd64(&BlockBufferChanges, 1);
+	while (BlockBufferFlushLock.TryLock())
 	{
-		FsLogger::LogFormat(FilesystemLogType::Error, "Failed to read file %s", FileDescriptor.FileName.GetData());
-		CacheChunks(InPath, AllBlocks);
-		return AllBlocks;
-	}
+		const uint64 SavedChanges = FsAtomicLoad64(&BlockBufferChanges);
 
-	FsBitReader FileReader = FsBitReader(FileBuffer);
+		// Write back only the pages that changed
+		if (!FlushBlockBuffer())
+		{
+			FsLogger::LogFormat(FilesystemLogType::Error, "Failed to write block buffer. Ensure `Write` is implemented correctly.");
+		}
 
-	FsFileChunkHeader ChunkHeader = FsFileChunkHeader();
-	ChunkHeader.Serialize(FileReader);
+		// Persist the new used block count
+		SaveUsedBlocksCount();
+
+		BlockBufferFlushLock.Unlock();
+		if (FsAtomicLoad64(&BlockBufferChanges) == SavedChanges)
+		{
+			break;
+		}
+	}
+}
 
-	// log chunk header
-	//FsLogger::LogFormat(FilesystemLogType::Info, "[%u] Read chunk at %u with %u blocks pointing to next chunk at %u [%u]", 0, ReadOffset, ChunkHeader.Blocks, ChunkHeader.NextBlockIndex, BlockIndexToAbsoluteOffset(ChunkHeader.NextBlockIndex));
+void FsFilesystem::MarkBlockBufferDirty(uint64 StartBlockIndex, uint64 Blocks)
+{
+	const uint64 FirstPage = (StartBlockIndex / 8) / BlockSize;
+	const uint64 LastPage = ((StartBlockIndex + Blocks - 1) / 8) / BlockSize;
+
+	FsScopedSpinLock Lock = FsScopedSpinLock(BlockBufferLock);
+	DirtyBlockBufferPages.SetBitRange(FirstPage, LastPage - FirstPage + 1);
+}
 
-	// Read the blocks from the chunk header
-	AllBlocks.Add(ChunkHeader);
+bool FsFilesystem::FlushBlockBuffer()
+{
+	const uint64 PageCount = GetBlockBufferPageCount();
+	const uint64 BufferBytes = GetBlockBufferSizeBytes();
 
-	if (OptionalFileLength && *OptionalFileLength < BlockSize)
+	// Take every dirty page at once. Pages dirtied again while these are written go out with the next flush.
+	FsBitArray PagesToWrite = FsBitArray();
 	{
-		// We only need the first block
-		return AllBlocks;
+		FsScopedSpinLock Lock = FsScopedSpinLock(BlockBufferLock);
+		PagesToWrite = DirtyBlockBufferPages;
+		DirtyBlockBufferPages.ClearBitRange(0, PageCount);
 	}
 
-	uint64 NextBlockIndex = ChunkHeader.NextBlockIndex;
-	uint64 CurrentBlockLength = BlockSize;
-	while (NextBlockIndex != 0 && (!OptionalFileLength || CurrentBlockLength < *OptionalFileLength))
+	FsBitArray PageBuffer = FsBitArray();
+	uint64 FirstPage = 0;
+	while (PagesToWrite.FindFirstSetBit(FirstPage, PageCount, FirstPage))
 	{
-		const uint64 NextBlockOffset = BlockIndexToAbsoluteOffset(NextBlockIndex);
+		// Extend the run over any adjacent dirty pages so they go out in one write
+		uint64 EndPage = PageCount;
+		PagesToWrite.FindFirstClearBit(FirstPage, PageCount, EndPage);
 
-		FsBitArray NextBlockBuffer = FsBitArray();
-		NextBlockBuffer.FillZeroed(ReadLength);
+		const uint64 StartByte = FirstPage * BlockSize;
+		const uint64 EndByte = EndPage * BlockSize < BufferBytes ? EndPage * BlockSize : BufferBytes;
 
-		const FilesystemReadResult NextBlockReadResult = Read(NextBlockOffset, ReadLength, NextBlockBuffer.GetInternalArray().GetData());
-		if (NextBlockReadResult != FilesystemReadResult::Success)
+		// Groups change their bits under their own locks, so the pages are copied out under the lock of every group they cover
+		const uint64 FirstGroupIndex = GetAllocationGroupIndex(StartByte * 8);
+		const uint64 LastGroupIndex = GetAllocationGroupIndex(EndByte * 8 - 1);
+		for (uint64 GroupIndex = FirstGroupIndex; GroupIndex <= LastGroupIndex; GroupIndex++)
 		{
-			FsLogger::LogFormat(FilesystemLogType::Error, "Failed to read file %s", FileDescriptor.FileName.GetData());
-			return AllBlocks;
+			AllocationGroups[GroupIndex].Lock.Lock();
 		}
 
-		FsBitReader NextBlockReader = FsBitReader(NextBlockBuffer);
+		PageBuffer.FillZeroed(EndByte - StartByte);
+		FsMemory::Copy(PageBuffer.GetInternalArray().GetData(), BlockBuffer.GetInternalArray().GetData() + StartByte, EndByte - StartByte);
 
-		FsFileChunkHeader NextChunkHeader = FsFileChunkHeader();
-		NextChunkHeader.Serialize(NextBlockReader);
+		// Runs claimed by FlushDiscards are free, their bits are only set to keep them from being allocated
+		{
+			FsScopedSpinLock Lock = FsScopedSpinLock(BlockBufferLock);
+			for (const FsBlockRun& Run : DiscardingRuns)
+			{
+				const uint64 ClaimStart = Run.StartBlockIndex > StartByte * 8 ? Run.StartBlockIndex : StartByte * 8;
+				const uint64 ClaimEnd = Run.StartBlockIndex + Run.Blocks < EndByte * 8 ? Run.StartBlockIndex + Run.Blocks : EndByte * 8;
+				if (ClaimStart < ClaimEnd)
+				{
+					PageBuffer.ClearBitRange(ClaimStart - StartByte * 8, ClaimEnd - ClaimStart);
+				}
+			}
+		}
+
+		for (uint64 GroupIndex = FirstGroupIndex; GroupIndex <= LastGroupIndex; GroupIndex++)
+		{
+			AllocationGroups[GroupIndex].Lock.Unlock();
+		}
 
-		// Log chunk header
-		//FsLogger::LogFormat(FilesystemLogType::Info, "[%u] Read chunk at %u with %u blocks pointing to next chunk at %u [%u]", AllBlocks.Length(), NextBlockOffset, NextChunkHeader.Blocks, NextChunkHeader.NextBlockIndex, BlockIndexToAbsoluteOffset(NextChunkHeader.NextBlockIndex));
+		const FilesystemWriteResult WriteResult = Write(GetBlockBufferOffset() + StartByte, EndByte - StartByte, PageBuffer.GetInternalArray().GetData());
+		if (WriteResult != FilesystemWriteResult::Success)
+		{
+			FsLogger::LogFormat(FilesystemLogType::Error, "Failed to write block buffer pages %u to %u", FirstPage, EndPage - 1);
 
-		AllBlocks.Add(NextChunkHeader);
-		NextBlockIndex = NextChunkHeader.NextBlockIndex;
+			// The pages still differ from the partition, so the next flush tries them again
+			FsScopedSpinLock Lock = FsScopedSpinLock(BlockBufferLock);
+			DirtyBlockBufferPages.SetBitRange(FirstPage, EndPage - FirstPage);
+			return false;
+		}
 
-		const uint64 ContentSize = BlockSize - sizeof(FsFileChunkHeader);
-		CurrentBlockLength += ContentSize;
+		FirstPage = EndPage;
 	}
 
-	CacheChunks(InPath, AllBlocks);
-	return AllBlocks;
-
+	return true;
 }
 
-uint64 FsFilesystem::GetFreeAllocatedSpaceInFileChunks(const FsPath& InPath, const FsFileDescriptor& FileDescriptor, const FsArray<FsFileChunkHeader>* ChunksToUse)
+void FsFilesystem::ClearBlockBuffer()
 {
-	FsArray<FsFileChunkHeader> AllChunks{};
-	if (!ChunksToUse)
-	{
-		AllChunks = GetAllChunksForFile(InPath, FileDescriptor);
-		ChunksToUse = &AllChunks;
-	}
+	BlockBuffer.FillZeroed(GetBlockBufferSizeBytes());
+	UsedBlocks = 0;
+	DirtyBlockBufferPages.FillZeroed(GetBlockBufferPageCount() % 8 == 0 ? GetBlockBufferPageCount() / 8 : GetBlockBufferPageCount() / 8 + 1);
 
-	if (ChunksToUse->IsEmpty())
+	const FilesystemWriteResult WriteResult = Write(GetBlockBufferOffset(), GetBlockBufferSizeBytes(), BlockBuffer.GetInternalArray().GetData());
+	if (WriteResult != FilesystemWriteResult::Success)
 	{
-		fsCheck(FileDescriptor.FileSize == 0 && FileDescriptor.FileOffset == 0, "File has no chunks allocated to it but has either a file size or file offset.");
-		// This file is empty and has no blocks allocated for it.
-		return 0;
+		FsLogger::LogFormat(FilesystemLogType::Error, "Failed to clear block buffer. Ensure `Write` is implemented correctly.");
 	}
 
-	uint64 AllocatedSpace = 0;
-	for (const FsFileChunkHeader& Chunk : *ChunksToUse)
-	{
-		AllocatedSpace += Chunk.Blocks * BlockSize;
-	}
+	BuildAllocationGroups();
 
-	return AllocatedSpace - FileDescriptor.FileSize;
+	FsLogger::LogFormat(FilesystemLogType::Verbose, "Block buffer cleared");
 }
 
-uint64 FsFilesystem::GetAllocatedSpaceInFileChunks(const FsArray<FsFileChunkHeader>& InChunks)
+void FsFilesystem::LoadBlockBuffer()
 {
-	uint64 AllocatedSpace = 0;
-	for (const FsFileChunkHeader& Chunk : InChunks)
+	BlockBuffer.FillZeroed(GetBlockBufferSizeBytes());
+	DirtyBlockBufferPages.FillZeroed(GetBlockBufferPageCount() % 8 == 0 ? GetBlockBufferPageCount() / 8 : GetBlockBufferPageCount() / 8 + 1);
+
+	const FilesystemReadResult ReadResult = Read(GetBlockBufferOffset(), GetBlockBufferSizeBytes(), BlockBuffer.GetInternalArray().GetData());
+	if (ReadResult != FilesystemReadResult::Success)
 	{
-		AllocatedSpace += Chunk.Blocks * BlockSize;
+		FsLogger::LogFormat(FilesystemLogType::Error, "Failed to read block buffer. Ensure `Read` is implemented correctly.");
 	}
-	return AllocatedSpace;
-}
 
-void FsFileChunkHeader::Serialize(FsBitStream& BitStream)
-{
-	BitStream << NextBlockIndex;
-	BitStream << Blocks;
-}
+	// The free space trees are only kept in memory, so they are rebuilt from the block buffer on every mount
+	BuildAllocationGroups();
 
-void FsFileDescriptor::Serialize(FsBitStream& BitStream)
-{
-	BitStream << FileName;
-	BitStream << FileSize;
-	BitStream << FileOffset;
-	BitStream << bIsDirectory;
+	FsLogger::LogFormat(FilesystemLogType::Verbose, "Block buffer loaded (%s)", GetCompressedBytesString(GetBlockBufferSizeBytes()));
 }
 
-void FsDirectoryDescriptor::Serialize(FsBitStream& BitStream)
+FsBlockArray FsFilesystem::GetFreeBlocks(uint64 NumBlocks)
 {
-	uint64 NumFiles = Files.Length();
-	BitStream << NumFiles;
-	if (BitStream.IsReading())
+	FsBlockArray FreeBlocks = FsBlockArray();
+	FreeBlocks.Reserve(NumBlocks);
+
+	// The free space trees skip straight past full groups of blocks
+	for (FsAllocationGroup& Group : AllocationGroups)
 	{
-		Files.FillDefault(NumFiles);
+		FsScopedSpinLock GroupLock = FsScopedSpinLock(Group.Lock);
+
+		uint64 BlockIndex = Group.StartBlockIndex;
+		while (FreeBlocks.Length() < NumBlocks && Group.FreeSpaceTree.FindFreeRun(BlockBuffer, BlockIndex, 1, BlockIndex))
+		{
+			FreeBlocks.Add(BlockIndex);
+			BlockIndex++;
+		}
 	}
 
-	for (uint64 i = 0; i < NumFiles; i++)
+	if (FreeBlocks.Length() < NumBlocks)
 	{
-		Files[i].Serialize(BitStream);
+		FsLogger::LogFormat(FilesystemLogType::Error, "Failed to find %u free blocks. Only %u available.", NumBlocks, FreeBlocks.Length());
+		return FsBlockArray();
 	}
+
+	return FreeBlocks;
 }
 
-void FsFilesystemHeader::Serialize(FsBitStream& BitStream)
+FsBlockRunArray FsFilesystem::AllocateBlockRuns(uint64 Blocks, uint64 GoalBlockIndex)
 {
-	BitStream << MagicNumber;
-	if (BitStream.IsReading())
+	const uint64 GroupCount = AllocationGroups.Length();
+
+	FsBlockRunArray Runs = FsBlockRunArray();
+	uint64 RemainingBlocks = Blocks;
+	uint64 SearchBlockIndex = GoalBlockIndex > GetMinBlockIndex() ? GoalBlockIndex : GetMinBlockIndex();
+	while (RemainingBlocks > 0)
 	{
-		// Check the magic number
-		if (MagicNumber != FS_MAGIC)
+		// Large runs take the smallest hole that fits. Otherwise prefer the first run that fits everything,
+		// searching from the goal in its own group first, then the other groups in order, and only then the start of the goal group.
+		FsBlockRun Run = FsBlockRun();
+		const uint64 GoalGroupIndex = GetAllocationGroupIndex(SearchBlockIndex);
+		bool bFoundRun = RemainingBlocks >= FS_BEST_FIT_MIN_BLOCKS && AllocateBestFitRun(GoalGroupIndex, RemainingBlocks, Run);
+		if (!bFoundRun)
 		{
-			FsLogger::LogFormat(FilesystemLogType::Warning, "Invalid magic number in filesystem header. Expected %u, got %u. Perhaps the filesystem is not set up.", FS_MAGIC, MagicNumber);
-			return;
+			bFoundRun = AllocateRunInGroup(GoalGroupIndex, SearchBlockIndex, RemainingBlocks, false, Run);
+		}
+		for (uint64 i = 1; i <= GroupCount && !bFoundRun; i++)
+		{
+			const uint64 GroupIndex = (GoalGroupIndex + i) % GroupCount;
+			bFoundRun = AllocateRunInGroup(GroupIndex, AllocationGroups[GroupIndex].StartBlockIndex, RemainingBlocks, false, Run);
+		}
+
+		if (!bFoundRun)
+		{
+			// Nothing fits everything, take the longest run from the group that has it and keep going
+			uint64 LongestGroupIndex = GoalGroupIndex;
+			uint64 LongestFreeRun = 0;
+			{
+				FsScopedSpinLock GroupLock = FsScopedSpinLock(AllocationGroups[GoalGroupIndex].Lock);
+				LongestFreeRun = AllocationGroups[GoalGroupIndex].FreeSpaceTree.GetLongestFreeRun();
+			}
+			for (uint64 GroupIndex = 0; GroupIndex < GroupCount; GroupIndex++)
+			{
+				FsScopedSpinLock GroupLock = FsScopedSpinLock(AllocationGroups[GroupIndex].Lock);
+				if (AllocationGroups[GroupIndex].FreeSpaceTree.GetLongestFreeRun() > LongestFreeRun)
+				{
+					LongestGroupIndex = GroupIndex;
+					LongestFreeRun = AllocationGroups[GroupIndex].FreeSpaceTree.GetLongestFreeRun();
+				}
+			}
+			bFoundRun = AllocateRunInGroup(LongestGroupIndex, AllocationGroups[LongestGroupIndex].StartBlockIndex, RemainingBlocks, true, Run);
+		}
+
+		if (!bFoundRun)
+		{
+			FsLogger::LogFormat(FilesystemLogType::Error, "Failed to find %u free blocks. %u blocks could not be placed.", Blocks, RemainingBlocks);
+
+			// Give back what was taken so far
+			for (const FsBlockRun& TakenRun : Runs)
+			{
+				FsScopedSpinLock GroupLock = FsScopedSpinLock(AllocationGroups[GetAllocationGroupIndex(TakenRun.StartBlockIndex)].Lock);
+				SetBlockRunInUse_Internal(TakenRun, false);
+			}
+			return FsBlockRunArray();
+		}
+
+		// Runs that carry straight on from the last one, such as across a group boundary, become part of the same run
+		FsBlockRun* LastRun = Runs.IsEmpty() ? nullptr : &Runs[Runs.Length() - 1];
+		const bool bContinuesLastRun = LastRun && LastRun->StartBlockIndex + LastRun->Blocks == Run.StartBlockIndex;
+		if (bContinuesLastRun)
+		{
+			LastRun->Blocks += Run.Blocks;
 		}
+		else
+		{
+			Runs.Add(Run);
+		}
+
+		RemainingBlocks -= Run.Blocks;
+		SearchBlockIndex = Run.StartBlockIndex + Run.Blocks < GetBlockBufferSizeBits() ? Run.StartBlockIndex + Run.Blocks : GetMinBlockIndex();
 	}
 
-	BitStream << FilesystemVersion;
-	FsLogger::LogFormat(FilesystemLogType::Verbose, "Serialized Filesystem version: %s", FilesystemVersion.GetData());
+	SaveBlockBufferChanges();
 
-	RootDirectory.Serialize(BitStream);
-	RootDirectory.bDirectoryIsRoot = true;
+	return Runs;
 }
 
-void FsFilesystem::LoadOrCreateFilesystemHeader()
+bool FsFilesystem::AllocateRunInGroup(uint64 GroupIndex, uint64 MinStartBlockIndex, uint64 Blocks, bool bAllowShorterRun, FsBlockRun& OutRun)
 {
-	FsLogger::LogFormat(FilesystemLogType::Verbose, "Loading or creating filesystem header");
-	
-	FsBitArray HeaderBuffer;
-	HeaderBuffer.FillZeroed(FS_HEADER_MAXSIZE);
+	FsAllocationGroup& Group = AllocationGroups[GroupIndex];
+	FsScopedSpinLock GroupLock = FsScopedSpinLock(Group.Lock);
 
-	// read the first bytes of the filesystem to find the file system header
-	const FilesystemReadResult ReadResult = Read(0, FS_HEADER_MAXSIZE, HeaderBuffer.GetInternalArray().GetData());
-	if (ReadResult != FilesystemReadResult::Success)
+	// The search and the update happen under the same lock so two writers can never take the same run
+	const uint64 LongestFreeRun = Group.FreeSpaceTree.GetLongestFreeRun();
+	const uint64 RunBlocks = bAllowShorterRun && LongestFreeRun < Blocks ? LongestFreeRun : Blocks;
+	if (RunBlocks == 0 || !Group.FreeSpaceTree.FindFreeRun(BlockBuffer, MinStartBlockIndex, RunBlocks, OutRun.StartBlockIndex))
 	{
-		FsLogger::LogFormat(FilesystemLogType::Error, "Failed to read filesystem header. Ensure `Read` is implemented correctly.");
-		return;
+		return false;
 	}
 
-	FsBitReader HeaderReader = FsBitReader(HeaderBuffer);
-
-	FsFilesystemHeader FilesystemHeader;
-	FilesystemHeader.Serialize(HeaderReader);
+	OutRun.Blocks = RunBlocks;
+	SetBlockRunInUse_Internal(OutRun, true);
 
-	if (FilesystemHeader.MagicNumber != FS_MAGIC)
-	{
-		FsLogger::LogFormat(FilesystemLogType::Warning, "Filesystem header not found. Creating a new one.");
+	// The next allocation without a better goal carries on from here
+	Group.NextFitBlockIndex = OutRun.StartBlockIndex + OutRun.Blocks;
 
-		FilesystemHeader.MagicNumber = FS_MAGIC;
-		FilesystemHeader.FilesystemVersion = FS_VERSION;
-		FilesystemHeader.RootDirectory = FsDirectoryDescriptor();
-		FilesystemHeader.RootDirectory.bDirectoryIsRoot = true;
-		RootDirectory.bDirectoryIsRoot = true;
+	return true;
+}
 
-		ClearBlockBuffer();
+bool FsFilesystem::AllocateBestFitRun(uint64 GoalGroupIndex, uint64 Blocks, FsBlockRun& OutRun)
+{
+	const uint64 GroupCount = AllocationGroups.Length();
 
-		FsFileDescriptor RootDirectoryFile;
-		RootDirectoryFile.FileName = "Root";
-		RootDirectoryFile.bIsDirectory = true;
+	// Find the group with the shortest run that fits, an exact fit can't be beaten so stop there
+	uint64 BestGroupIndex = GroupCount;
+	uint64 BestBlocks = 0;
+	for (uint64 i = 0; i < GroupCount; i++)
+	{
+		const uint64 GroupIndex = (GoalGroupIndex + i) % GroupCount;
+		FsAllocationGroup& Group = AllocationGroups[GroupIndex];
+		FsScopedSpinLock GroupLock = FsScopedSpinLock(Group.Lock);
 
-		// find a block for the root directory
-		const FsBlockArray RootDirectoryBlocks = GetFreeBlocks(1);
-		if (RootDirectoryBlocks.Length() == 0)
+		FsFreeExtent Extent = FsFreeExtent();
+		if (Group.FreeExtentIndex.FindBestFit(Blocks, Extent) && (BestGroupIndex == GroupCount || Extent.Blocks < BestBlocks))
 		{
-			FsLogger::LogFormat(FilesystemLogType::Error, "Failed to find a block for the root directory");
-			return;
+			BestGroupIndex = GroupIndex;
+			BestBlocks = Extent.Blocks;
+			if (BestBlocks == Blocks)
+			{
+				break;
+			}
 		}
+	}
 
-		SetBlocksInUse(RootDirectoryBlocks, true);
-
-		const uint64 AbsoluteOffset = BlockIndexToAbsoluteOffset(RootDirectoryBlocks[0]);
-
-		RootDirectoryFile.FileOffset = AbsoluteOffset;
-		RootDirectoryFile.FileSize = 0;
-
-		SaveFilesystemHeader(FilesystemHeader);
-
-		FsLogger::LogFormat(FilesystemLogType::Verbose, "Filesystem header created successfully. Root directory located at %u bytes.", RootDirectoryFile.FileOffset);
-		return;
+	if (BestGroupIndex == GroupCount)
+	{
+		return false;
 	}
 
-	RootDirectory = FilesystemHeader.RootDirectory;
-	RootDirectory.bDirectoryIsRoot = true;
-	FsLogger::LogFormat(FilesystemLogType::Verbose, "Filesystem header loaded successfully");
-}
+	// Search again under the lock that marks the run, another writer may have taken it since
+	FsAllocationGroup& Group = AllocationGroups[BestGroupIndex];
+	FsScopedSpinLock GroupLock = FsScopedSpinLock(Group.Lock);
 
-bool FsFilesystem::GetUsedBlocksCount(uint64& OutUsedBlocks)
-{
-	const FsBitArray BlockBuffer = ReadBlockBuffer();
-	OutUsedBlocks = 0;
-	for (uint64 i = 0; i < BlockBuffer.BitLength(); i++)
+	FsFreeExtent Extent = FsFreeExtent();
+	if (!Group.FreeExtentIndex.FindBestFit(Blocks, Extent))
 	{
-		if (BlockBuffer.GetBit(i))
-		{
-			OutUsedBlocks++;
-		}
+		return false;
 	}
 
+	OutRun.StartBlockIndex = Extent.StartBlock;
+	OutRun.Blocks = Blocks;
+	SetBlockRunInUse_Internal(OutRun, true);
+	Group.NextFitBlockIndex = OutRun.StartBlockIndex + OutRun.Blocks;
+
 	return true;
 }
 
-void FsFilesystem::SetBlocksInUse(const FsBlockArray& BlockIndices, bool bInUse)
+uint64 FsFilesystem::ExtendLastExtent(FsBlockMap& InOutBlockMap, uint64 Blocks)
 {
-	fsCheck(BlockIndices.Length() > 0, "BlockIndices must have at least one element");
+	fsCheck(!InOutBlockMap.Extents.IsEmpty(), "The file must have an extent to extend");
+
+	FsFileExtent& LastExtent = InOutBlockMap.Extents[InOutBlockMap.Extents.Length() - 1];
 
-	uint64 UsedBlocks = 0;
-	if (!GetUsedBlocksCount(UsedBlocks))
+	const uint64 ExtensionStart = LastExtent.StartBlockIndex + LastExtent.Blocks;
+	if (ExtensionStart >= GetBlockBufferSizeBits())
 	{
-		FsLogger::LogFormat(FilesystemLogType::Error, "Failed to get UsedBlocks");
-		return;
+		return 0;
 	}
 
-	const uint64 ExpectedUsedBlocks = bInUse ? UsedBlocks + BlockIndices.Length() : UsedBlocks - BlockIndices.Length();
-
-	/*for (uint64 BlockIndex : BlockIndices)
+	// Take as many of the free blocks directly after the last extent as the content needs, without leaving the group
+	FsAllocationGroup& Group = AllocationGroups[GetAllocationGroupIndex(ExtensionStart)];
+	FsBlockRun Extension = FsBlockRun();
 	{
-		FsLogger::LogFormat(FilesystemLogType::Verbose, "Setting block %u at %u in use: %s", BlockIndex, BlockIndexToAbsoluteOffset(BlockIndex), bInUse ? "true" : "false");
-	}*/
-
-	// Load the existing block buffer
-	FsBitArray BlockBuffer = ReadBlockBuffer();
+		FsScopedSpinLock GroupLock = FsScopedSpinLock(Group.Lock);
 
-	for (uint64 BlockIndex : BlockIndices)
-	{
-		// Check the block is not what we are setting it to
-		if (BlockBuffer.GetBit(BlockIndex) == bInUse)
+		if (BlockBuffer.GetBit(ExtensionStart))
 		{
-			FsLogger::LogFormat(FilesystemLogType::Warning, "Block %u is already %s", BlockIndex, bInUse ? "in use" : "free");
-			continue;
+			return 0;
 		}
 
-		// Set the block in use
-		BlockBuffer.SetBit(BlockIndex, bInUse);
-		fsCheck(BlockBuffer.GetBit(BlockIndex) == bInUse, "Failed to set block in use");
+		uint64 ExtensionEnd = Blocks < Group.EndBlockIndex - ExtensionStart ? ExtensionStart + Blocks : Group.EndBlockIndex;
+		BlockBuffer.FindFirstSetBit(ExtensionStart, ExtensionEnd, ExtensionEnd);
 
-		ClearCachedRead(BlockIndex);
+		Extension.StartBlockIndex = ExtensionStart;
+		Extension.Blocks = ExtensionEnd - ExtensionStart;
+		SetBlockRunInUse_Internal(Extension, true);
+		Group.NextFitBlockIndex = ExtensionEnd;
 	}
 
-	// Write the block back
-	const FilesystemWriteResult WriteResult = Write(GetBlockBufferOffset(), GetBlockBufferSizeBytes(), BlockBuffer.GetInternalArray().GetData());
-	if (WriteResult != FilesystemWriteResult::Success)
-	{
-		FsLogger::LogFormat(FilesystemLogType::Error, "Failed to write block buffer. Ensure `Write` is implemented correctly.");
-	}
+	SaveBlockBufferChanges();
 
-	if (!GetUsedBlocksCount(UsedBlocks))
-	{
-		FsLogger::LogFormat(FilesystemLogType::Error, "Failed to get UsedBlocks");
-		return;
-	}
+	LastExtent.Blocks += Extension.Blocks;
 
-	if (UsedBlocks != ExpectedUsedBlocks)
-	{
-		FsLogger::LogFormat(FilesystemLogType::Error, "Failed to correctly set blocks in use. Expected %u used blocks, got %u used blocks", ExpectedUsedBlocks, UsedBlocks);
-	}
+	return Extension.Blocks;
 }
 
-void FsFilesystem::ClearBlockBuffer()
+void FsFilesystem::BuildAllocationGroups()
 {
-	FsArray<uint8> ZeroBuffer = FsArray<uint8>();
-	ZeroBuffer.FillZeroed(GetBlockBufferSizeBytes());
+	const uint64 FirstBlockIndex = GetMinBlockIndex();
+	const uint64 EndBlockIndex = GetBlockBufferSizeBits();
 
-	const FilesystemWriteResult WriteResult = Write(GetBlockBufferOffset(), GetBlockBufferSizeBytes(), ZeroBuffer.GetData());
-	if (WriteResult != FilesystemWriteResult::Success)
+	// Group boundaries are aligned to FS_ALLOCATION_GROUP_BLOCKS so no two groups share a word of the block buffer
+	const uint64 FirstGroup = FirstBlockIndex / FS_ALLOCATION_GROUP_BLOCKS;
+	const uint64 EndGroup = EndBlockIndex % FS_ALLOCATION_GROUP_BLOCKS == 0 ? EndBlockIndex / FS_ALLOCATION_GROUP_BLOCKS : EndBlockIndex / FS_ALLOCATION_GROUP_BLOCKS + 1;
+	const uint64 GroupCount = EndGroup > FirstGroup ? EndGroup - FirstGroup : 1;
+
+	AllocationGroups.Empty();
+	AllocationGroups.FillDefault(GroupCount);
+
+	for (uint64 i = 0; i < GroupCount; i++)
 	{
-		FsLogger::LogFormat(FilesystemLogType::Error, "Failed to clear block buffer. Ensure `Write` is implemented correctly.");
+		FsAllocationGroup& Group = AllocationGroups[i];
+		const uint64 GroupStart = (FirstGroup + i) * FS_ALLOCATION_GROUP_BLOCKS;
+		const uint64 GroupEnd = GroupStart + FS_ALLOCATION_GROUP_BLOCKS;
+		Group.StartBlockIndex = GroupStart > FirstBlockIndex ? GroupStart : FirstBlockIndex;
+		Group.EndBlockIndex = GroupEnd < EndBlockIndex ? GroupEnd : EndBlockIndex;
+		Group.NextFitBlockIndex = Group.StartBlockIndex;
+		Group.FreeSpaceTree.Build(BlockBuffer, Group.StartBlockIndex, Group.EndBlockIndex);
+		Group.FreeExtentIndex.Build(BlockBuffer, Group.StartBlockIndex, Group.EndBlockIndex);
 	}
 
-	FsLogger::LogFormat(FilesystemLogType::Verbose, "Block buffer cleared");
+	FsLogger::LogFormat(FilesystemLogType::Verbose, "Built %u allocation groups", GroupCount);
 }
 
-FsBitArray FsFilesystem::ReadBlockBuffer()
+uint64 FsFilesystem::GetAllocationGroupIndex(uint64 BlockIndex) const
 {
-	FsBitArray BlockBuffer;
-	BlockBuffer.FillZeroed(GetBlockBufferSizeBytes());
-
-	const FilesystemReadResult ReadResult = Read(GetBlockBufferOffset(), GetBlockBufferSizeBytes(), BlockBuffer.GetInternalArray().GetData());
-	if (ReadResult != FilesystemReadResult::Success)
-	{
-		FsLogger::LogFormat(FilesystemLogType::Error, "Failed to read block buffer. Ensure `Read` is implemented correctly.");
-	}
+	const uint64 FirstGroup = GetMinBlockIndex() / FS_ALLOCATION_GROUP_BLOCKS;
+	const uint64 Group = BlockIndex / FS_ALLOCATION_GROUP_BLOCKS;
+	const uint64 GroupIndex = Group > FirstGroup ? Group - FirstGroup : 0;
+	return GroupIndex < AllocationGroups.Length() ? GroupIndex : AllocationGroups.Length() - 1;
+}
 
-	return BlockBuffer;
+uint64 FsFilesystem::GetNewFileGoalBlockIndex()
+{
+	// Each thread is handed a group the first time it allocates, so threads creating files at the same time
+	// search and lock different groups. Within the group, new files carry on from the last allocation.
+	// The ticket counter is only ever touched through FsAtomicAdd64.
+	static volatile uint64 NextThreadTicket = 0;
+	thread_local const uint64 ThreadTicket = FsAtomicAdd64(&NextThreadTicket, 1);
+
+	// The cursor moves under the group's lock whenever the group allocates
+	FsAllocationGroup& Group = AllocationGroups[ThreadTicket % AllocationGroups.Length()];
+	FsScopedSpinLock GroupLock = FsScopedSpinLock(Group.Lock);
+	return Group.NextFitBlockIndex < Group.EndBlockIndex ? Group.NextFitBlockIndex : Group.StartBlockIndex;
 }
 
-FsBlockArray FsFilesystem::GetFreeBlocks(uint64 NumBlocks)
+void FsFilesystem::SaveFilesystemHeader(FsFilesystemHeader& InOutHeader)
 {
-	FsBitArray BlockBuffer = ReadBlockBuffer();
-	
-	// Calculate the minimum block index that we should skip to avoid the block buffer.
-	const uint64 MinBlockIndex = GetContentStartOffset() / BlockSize;
+	FsLogger::LogFormat(FilesystemLogType::Verbose, "Writing filesystem header");
 
-	FsBlockArray FreeBlocks = FsBlockArray();
-	uint64 NumFreeBlocks = 0;
-	for (uint64 i = MinBlockIndex; i < BlockBuffer.BitLength(); i++)
-	{
-		if (!BlockBuffer.GetBit(i))
-		{
-			FreeBlocks.Add(i);
-			NumFreeBlocks++;
-		}
+	FsBitArray HeaderBuffer = FsBitArray();
+	FsBitWriter HeaderWriter = FsBitWriter(HeaderBuffer);
 
-		if (NumFreeBlocks >= NumBlocks)
-		{
-			break;
-		}
-	}
+	// The used block count is owned by the filesystem, so always save the current value
+	InOutHeader.UsedBlocks = FsAtomicLoad64(&UsedBlocks);
+	InOutHeader.Serialize(HeaderWriter);
 
-	if (NumFreeBlocks < NumBlocks)
+	const FilesystemWriteResult WriteResult = Write(0, HeaderBuffer.ByteLength(), HeaderBuffer.GetInternalArray().GetData());
+	if (WriteResult != FilesystemWriteResult::Success)
 	{
-		FsLogger::LogFormat(FilesystemLogType::Error, "Failed to find %u free blocks. Only %u available.", NumBlocks, NumFreeBlocks);
-		return FsBlockArray();
+		FsLogger::LogFormat(FilesystemLogType::Error, "Failed to write filesystem header. Ensure `Write` is implemented correctly.");
 	}
 
-	return FreeBlocks;
+	FsLogger::LogFormat(FilesystemLogType::Verbose, "Filesystem header written successfully");
 }
 
-void FsFilesystem::SaveFilesystemHeader(const FsFilesystemHeader& InHeader)
+void FsFilesystem::SaveUsedBlocksCount()
 {
-	FsLogger::LogFormat(FilesystemLogType::Verbose, "Writing filesystem header");
+	FsBitArray CountBuffer = FsBitArray();
+	FsBitWriter CountWriter = FsBitWriter(CountBuffer);
 
-	FsBitArray HeaderBuffer = FsBitArray();
-	FsBitWriter HeaderWriter = FsBitWriter(HeaderBuffer);
+	uint64 CurrentUsedBlocks = FsAtomicLoad64(&UsedBlocks);
+	CountWriter << CurrentUsedBlocks;
 
-	const_cast<FsFilesystemHeader&>(InHeader).Serialize(HeaderWriter);
-
-	const FilesystemWriteResult WriteResult = Write(0, HeaderBuffer.ByteLength(), HeaderBuffer.GetInternalArray().GetData());
+	// Every version that stores the count has a version string of the same length, so it is always in the same place
+	const FilesystemWriteResult WriteResult = Write(FsFilesystemHeader().GetUsedBlocksOffset(), CountBuffer.ByteLength(), CountBuffer.GetInternalArray().GetData());
 	if (WriteResult != FilesystemWriteResult::Success)
 	{
-		FsLogger::LogFormat(FilesystemLogType::Error, "Failed to write filesystem header. Ensure `Write` is implemented correctly.");
+		FsLogger::LogFormat(FilesystemLogType::Error, "Failed to write used block count. Ensure `Write` is implemented correctly.");
 	}
-
-	FsLogger::LogFormat(FilesystemLogType::Verbose, "Filesystem header written successfully");
 }
 
 bool FsFilesystem::DirectoryExists(const FsPath& InDirectoryName)
@@ -1226,7 +3395,7 @@ bool FsFilesystem::CreateDirectory(const FsPath& InDirectoryName)
 	FsLogger::LogFormat(FilesystemLogType::Verbose, "Creating directory for %s", NormalizedPath.GetData());
 
 	bool bNeedsResave = false;
-	if (!CreateDirectory_Internal(NormalizedPath, RootDirectory, bNeedsResave))
+	if (!CreateDirectory_Internal(NormalizedPath, FsPath(""), RootDirectory, bNeedsResave))
 	{
 		FsLogger::LogFormat(FilesystemLogType::Verbose, "Failed to create directory %s", NormalizedPath.GetData());
 		return false;
@@ -1243,11 +3412,18 @@ bool FsFilesystem::CreateDirectory(const FsPath& InDirectoryName)
 	return true;
 }
 
-bool FsFilesystem::CreateDirectory_Internal(const FsPath& DirectoryName, FsDirectoryDescriptor& CurrentDirectory, bool& bOutNeedsResave)
+bool FsFilesystem::CreateDirectory_Internal(const FsPath& DirectoryName, const FsPath& CurrentDirectoryPath, FsDirectoryDescriptor& CurrentDirectory, bool& bOutNeedsResave)
 {
 	const FsPath TopLevelDirectory = DirectoryName.GetFirstPath();
 	const FsPath SubDirectory = DirectoryName.GetSubPath();
 
+	FsPath TopLevelDirectoryPath = CurrentDirectoryPath;
+	if (!TopLevelDirectoryPath.IsEmpty())
+	{
+		TopLevelDirectoryPath.Append("/");
+	}
+	TopLevelDirectoryPath.Append(TopLevelDirectory);
+
 	// Check if the directory already exists
 	for (const FsFileDescriptor& SubDirectoryFile : CurrentDirectory.Files)
 	{
@@ -1267,7 +3443,7 @@ bool FsFilesystem::CreateDirectory_Internal(const FsPath& DirectoryName, FsDirec
 
 		// Recurse into the next directory
 		bool bNeedsResave = false;
-		if (!CreateDirectory_Internal(SubDirectory, NextDirectory, bNeedsResave))
+		if (!CreateDirectory_Internal(SubDirectory, TopLevelDirectoryPath, NextDirectory, bNeedsResave))
 		{
 			return false;
 		}
@@ -1297,7 +3473,7 @@ bool FsFilesystem::CreateDirectory_Internal(const FsPath& DirectoryName, FsDirec
 		FsLogger::LogFormat(FilesystemLogType::Verbose, "Creating subdirectory %s", SubDirectory.GetData());
 
 		bool bNeedsResave = false;
-		if (!CreateDirectory_Internal(SubDirectory, NewDirectory, bNeedsResave))
+		if (!CreateDirectory_Internal(SubDirectory, TopLevelDirectoryPath, NewDirectory, bNeedsResave))
 		{
 			FsLogger::LogFormat(FilesystemLogType::Error, "Failed to create subdirectory %s", SubDirectory.GetData());
 			return false;
@@ -1331,6 +3507,13 @@ bool FsFilesystem::CreateDirectory_Internal(const FsPath& DirectoryName, FsDirec
 
 	// Add the new file to the current directory and request a resave
 	CurrentDirectory.Files.Add(NewDirectoryFile);
+	if (!MakeRoomInDirectory(CurrentDirectoryPath, CurrentDirectory))
+	{
+		CurrentDirectory.Files.RemoveAt(CurrentDirectory.Files.Length() - 1);
+		SetBlocksInUse(NewDirectoryBlocks, false);
+		return false;
+	}
+
 	bOutNeedsResave = true;
 	return true;
 }
@@ -1381,6 +3564,60 @@ bool FsFilesystem::SaveDirectory(const FsDirectoryDescriptor& Directory, uint64
 	return true;
 }
 
+bool FsFilesystem::DirectoryFits(const FsDirectoryDescriptor& Directory) const
+{
+	FsBitArray DirectoryBuffer = FsBitArray();
+	FsBitWriter DirectoryWriter = FsBitWriter(DirectoryBuffer);
+
+	// The root directory is saved as part of the header, which has to end before the block buffer
+	if (Directory.bDirectoryIsRoot)
+	{
+		FsFilesystemHeader Header = FsFilesystemHeader();
+		Header.RootDirectory = Directory;
+		Header.Serialize(DirectoryWriter);
+		return DirectoryBuffer.ByteLength() <= GetBlockBufferOffset();
+	}
+
+	const_cast<FsDirectoryDescriptor&>(Directory).Serialize(DirectoryWriter);
+	return sizeof(FsFileChunkHeader) + sizeof(uint64) + DirectoryBuffer.ByteLength() <= BlockSize;
+}
+
+bool FsFilesystem::MakeRoomInDirectory(const FsPath& DirectoryPath, FsDirectoryDescriptor& Directory)
+{
+	while (!DirectoryFits(Directory))
+	{
+		FsFileDescriptor* LargestInlineFile = nullptr;
+		for (FsFileDescriptor& File : Directory.Files)
+		{
+			if (!File.InlineData.IsEmpty() && (!LargestInlineFile || File.InlineData.Length() > LargestInlineFile->InlineData.Length()))
+			{
+				LargestInlineFile = &File;
+			}
+		}
+
+		if (!LargestInlineFile)
+		{
+			FsLogger::LogFormat(FilesystemLogType::Error, "Directory %s has no room for more entries", DirectoryPath.GetData());
+			return false;
+		}
+
+		FsPath FilePath = DirectoryPath;
+		if (!FilePath.IsEmpty())
+		{
+			FilePath.Append("/");
+		}
+		FilePath.Append(LargestInlineFile->FileName);
+
+		FsBlockMap BlockMap = FsBlockMap();
+		if (!MoveInlineDataToBlocks(FilePath, *LargestInlineFile, BlockMap))
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
 FsDirectoryDescriptor FsFilesystem::ReadFileAsDirectory(const FsFileDescriptor& FileDescriptor)
 {
 	FsDirectoryDescriptor DirectoryDescriptor;
@@ -1404,6 +3641,7 @@ FsDirectoryDescriptor FsFilesystem::ReadFileAsDirectory(const FsFileDescriptor&
 	}
 
 	FsBitReader FileReader = FsBitReader(FileBuffer);
+	FileReader.SetVersion(DirectoryVersion);
 
 	// Read the file chunk header
 	FsFileChunkHeader FileChunkHeader;
@@ -1440,6 +3678,145 @@ FsDirectoryDescriptor FsFilesystem::ReadFileAsDirectory(const FsFileDescriptor&
 	return DirectoryDescriptor;
 }
 
+bool FsFilesystem::UpgradeDirectories(const FsPath& DirectoryPath, FsDirectoryDescriptor& Directory, uint64 FromVersion)
+{
+	bool bSucceeded = true;
+	for (FsFileDescriptor& File : Directory.Files)
+	{
+		FsPath FilePath = DirectoryPath;
+		if (!FilePath.IsEmpty())
+		{
+			FilePath.Append("/");
+		}
+		FilePath.Append(File.FileName);
+
+		if (!File.bIsDirectory)
+		{
+			// Files keep going even if one can't be moved, so as many as possible end up readable
+			if (FromVersion < 4 && !UpgradeFileToBlockMap(FilePath, File))
+			{
+				FsLogger::LogFormat(FilesystemLogType::Error, "Failed to upgrade file %s", FilePath.GetData());
+				bSucceeded = false;
+			}
+			continue;
+		}
+
+		// Children are rewritten first, since reading a directory back in would use the old layout
+		FsDirectoryDescriptor SubDirectory = ReadFileAsDirectory(File);
+		if (!UpgradeDirectories(FilePath, SubDirectory, FromVersion))
+		{
+			bSucceeded = false;
+		}
+
+		// Newer layouts store more per entry, a directory that was close to full may no longer fit its block
+		if (!DirectoryFits(SubDirectory))
+		{
+			FsLogger::LogFormat(FilesystemLogType::Error, "Directory %s has too many entries to upgrade", FilePath.GetData());
+			return false;
+		}
+
+		if (!SaveDirectory(SubDirectory, File.FileOffset))
+		{
+			FsLogger::LogFormat(FilesystemLogType::Error, "Failed to upgrade directory %s", FilePath.GetData());
+			return false;
+		}
+	}
+	return bSucceeded;
+}
+
+bool FsFilesystem::UpgradeFileToBlockMap(const FsPath& FilePath, FsFileDescriptor& File)
+{
+	if (File.FileOffset == 0)
+	{
+		return true;
+	}
+
+	// Follow the old chain of chunks, each one starts with a header pointing at the next
+	FsBlockRunArray OldRuns = FsBlockRunArray();
+	uint64 ChunkBlockIndex = AbsoluteOffsetToBlockIndex(File.FileOffset);
+	uint64 OldContentLength = 0;
+	while (true)
+	{
+		FsBitArray ChunkHeaderBuffer = FsBitArray();
+		ChunkHeaderBuffer.FillZeroed(sizeof(FsFileChunkHeader));
+		if (Read(BlockIndexToAbsoluteOffset(ChunkBlockIndex), sizeof(FsFileChunkHeader), ChunkHeaderBuffer.GetInternalArray().GetData()) != FilesystemReadResult::Success)
+		{
+			FsLogger::LogFormat(FilesystemLogType::Error, "Failed to read chunk of file %s", FilePath.GetData());
+			return false;
+		}
+
+		FsBitReader ChunkHeaderReader = FsBitReader(ChunkHeaderBuffer);
+		FsFileChunkHeader ChunkHeader = FsFileChunkHeader();
+		ChunkHeader.Serialize(ChunkHeaderReader);
+
+		FsBlockRun Run = FsBlockRun();
+		Run.StartBlockIndex = ChunkBlockIndex;
+		Run.Blocks = ChunkHeader.Blocks;
+		OldRuns.Add(Run);
+		OldContentLength += ChunkHeader.Blocks * BlockSize - sizeof(FsFileChunkHeader);
+
+		if (ChunkHeader.NextBlockIndex == 0)
+		{
+			break;
+		}
+		ChunkBlockIndex = ChunkHeader.NextBlockIndex;
+	}
+
+	// Give the file new blocks for everything its chunks could hold, so preallocated space is kept
+	const uint64 OldFileOffset = File.FileOffset;
+	File.FileOffset = 0;
+	FsBlockMap BlockMap = FsBlockMap();
+	if (!AllocateFileSpace(FilePath, File, BlockMap, 0, OldContentLength, true))
+	{
+		File.FileOffset = OldFileOffset;
+		return false;
+	}
+
+	// Copy the written content out of the chunks a piece at a time, skipping each chunk's header
+	FsArray<uint8> CopyBuffer = FsArray<uint8>();
+	CopyBuffer.FillUninitialized(BlockSize * 16);
+
+	uint64 ChunkFileOffset = 0;
+	for (const FsBlockRun& Run : OldRuns)
+	{
+		const uint64 ChunkFileEnd = ChunkFileOffset + Run.Blocks * BlockSize - sizeof(FsFileChunkHeader);
+		const uint64 CopyEnd = ChunkFileEnd < File.WrittenSize ? ChunkFileEnd : File.WrittenSize;
+		for (uint64 Copied = ChunkFileOffset; Copied < CopyEnd; Copied += CopyBuffer.Length())
+		{
+			const uint64 PieceLength = CopyEnd - Copied < CopyBuffer.Length() ? CopyEnd - Copied : CopyBuffer.Length();
+			const uint64 ReadOffset = BlockIndexToAbsoluteOffset(Run.StartBlockIndex) + sizeof(FsFileChunkHeader) + (Copied - ChunkFileOffset);
+
+			FsArray<FsContentRange> Ranges = FsArray<FsContentRange>();
+			GetContentRanges(BlockMap.Extents, Copied, PieceLength, Ranges);
+			FsArray<FsWriteSegment> Segments = FsArray<FsWriteSegment>();
+			for (const FsContentRange& Range : Ranges)
+			{
+				FsWriteSegment Segment = FsWriteSegment();
+				Segment.Offset = Range.AbsoluteOffset;
+				Segment.Length = Range.Length;
+				Segment.Source = CopyBuffer.GetData() + (Range.FileOffset - Copied);
+				Segments.Add(Segment);
+			}
+
+			if (Read(ReadOffset, PieceLength, CopyBuffer.GetData()) != FilesystemReadResult::Success || WriteV(Segments) != FilesystemWriteResult::Success)
+			{
+				FsLogger::LogFormat(FilesystemLogType::Error, "Failed to copy file %s to its new blocks", FilePath.GetData());
+				SetBlockRunsInUse(GetBlockRunsForMap(BlockMap), false);
+				ClearCachedBlockMap(FilePath);
+				File.FileOffset = OldFileOffset;
+				return false;
+			}
+		}
+
+		ChunkFileOffset = ChunkFileEnd;
+	}
+
+	SetBlockRunsInUse(OldRuns, false);
+
+	FsLogger::LogFormat(FilesystemLogType::Verbose, "Upgraded file %s from %u chunks to %u extents", FilePath.GetData(), OldRuns.Length(), BlockMap.Extents.Length());
+	return true;
+}
+
 bool FsFilesystem::WriteSingleChunk(const FsBitArray& ChunkData, uint64 AbsoluteOffset)
 {
 	fsCheck(ChunkData.ByteLength() <= BlockSize, "Tried to write too much data to a single chunk!");
@@ -1553,30 +3930,14 @@ bool FsFilesystem::FsDeleteDirectory(const FsPath& DirectoryName)
 		return false;
 	}
 
-	// Get all chunks for the directory
-	const FsArray<FsFileChunkHeader> AllChunks = GetAllChunksForFile(NormalizedPath, DirectoryFileDescriptor);
-
-	if (!AllChunks.IsEmpty())
-	{
-		// Combine all blocks into an array for freeing
-		FsBlockArray DirectoryBlocks = FsBlockArray();
-		DirectoryBlocks.Add(AbsoluteOffsetToBlockIndex(DirectoryFileDescriptor.FileOffset));
-		for (const FsFileChunkHeader& Chunk : AllChunks)
-		{
-			for (uint64 i = 0; i < Chunk.Blocks; i++)
-			{
-				if (Chunk.NextBlockIndex == 0)
-				{
-					// Last block
-					break;
-				}
-				DirectoryBlocks.Add(Chunk.NextBlockIndex);
-			}
-		}
-
-		// Free the blocks
-		SetBlocksInUse(DirectoryBlocks, false);
-	}
+	// Directories are a single block
+	FsBlockRun DirectoryRun = FsBlockRun();
+	DirectoryRun.StartBlockIndex = AbsoluteOffsetToBlockIndex(DirectoryFileDescriptor.FileOffset);
+	DirectoryRun.Blocks = 1;
+	FsBlockRunArray DirectoryRuns = FsBlockRunArray();
+	DirectoryRuns.Add(DirectoryRun);
+	SetBlockRunsInUse(DirectoryRuns, false);
+	ClearCachedDirectory(DirectoryFileDescriptor.FileOffset);
 
 	// Remove the directory from the parent directory
 	ParentDirectory.Files.RemoveAt(DirectoryIndex);
@@ -1588,9 +3949,6 @@ bool FsFilesystem::FsDeleteDirectory(const FsPath& DirectoryName)
 		return false;
 	}
 
-	// Clear the cached chunks
-	ClearCachedChunks(NormalizedPath);
-
 	return true;
 }
 
@@ -1611,6 +3969,13 @@ bool FsFilesystem::FsIsDirectoryEmpty(const FsPath& DirectoryName)
 bool FsFilesystem::FsDeleteFile(const FsPath& FileName)
 {
 	const FsPath NormalizedPath = FileName.NormalizePath();
+
+	// Staged and buffered bytes never got blocks, so they only need dropping
+	DiscardDelayedWrite(NormalizedPath);
+	DiscardWriteBack(NormalizedPath);
+
+	// Reads ahead still in flight have to finish before the blocks are freed
+	DropReadAhead(NormalizedPath);
 	const FsPath NormalizedFileName = NormalizedPath.GetLastPath();
 	const FsPath NormalizedDirectoryPath = NormalizedPath.GetPathWithoutFileName();
 
@@ -1648,29 +4013,17 @@ bool FsFilesystem::FsDeleteFile(const FsPath& FileName)
 		return false;
 	}
 
-	// Get all chunks for the file
-	const FsArray<FsFileChunkHeader> AllChunks = GetAllChunksForFile(NormalizedPath, File);
-
-	if (!AllChunks.IsEmpty())
+	FsBlockMap BlockMap = FsBlockMap();
+	if (!LoadBlockMap(NormalizedPath, File, BlockMap))
 	{
-		// Combine all blocks into an array for freeing
-		FsBlockArray FileBlocks = FsBlockArray();
-		FileBlocks.Add(AbsoluteOffsetToBlockIndex(File.FileOffset));
-		for (const FsFileChunkHeader& Chunk : AllChunks)
-		{
-			for (uint64 i = 0; i < Chunk.Blocks; i++)
-			{
-				if (Chunk.NextBlockIndex == 0)
-				{
-					// Last block
-					break;
-				}
-				FileBlocks.Add(Chunk.NextBlockIndex);
-			}
-		}
+		return false;
+	}
 
-		// Free the blocks
-		SetBlocksInUse(FileBlocks, false);
+	// Free every run of blocks owned by the file, along with its map
+	const FsBlockRunArray FileRuns = GetBlockRunsForMap(BlockMap);
+	if (!FileRuns.IsEmpty())
+	{
+		SetBlockRunsInUse(FileRuns, false);
 	}
 
 	// Remove the file from the directory
@@ -1683,8 +4036,8 @@ bool FsFilesystem::FsDeleteFile(const FsPath& FileName)
 		return false;
 	}
 
-	// Clear the cached chunks
-	ClearCachedChunks(NormalizedPath);
+	// Clear the cached block map
+	ClearCachedBlockMap(NormalizedPath);
 
 	return true;
 }
@@ -1692,6 +4045,13 @@ bool FsFilesystem::FsDeleteFile(const FsPath& FileName)
 bool FsFilesystem::FsMoveFile(const FsPath& SourceFileName, const FsPath& DestinationFileName)
 {
 	const FsPath NormalizedSourcePath = SourceFileName.NormalizePath();
+
+	// Staged writes are looked up by path, so write out the ones whose path is about to change
+	if (!FlushFilesUnderPath(NormalizedSourcePath))
+	{
+		return false;
+	}
+
 	const FsPath NormalizedSourceFileName = NormalizedSourcePath.GetLastPath();
 	const FsPath NormalizedSourceDirectoryPath = NormalizedSourcePath.GetPathWithoutFileName();
 	const FsPath NormalizedDestinationPath = DestinationFileName.NormalizePath();
@@ -1766,6 +4126,12 @@ bool FsFilesystem::FsMoveFile(const FsPath& SourceFileName, const FsPath& Destin
 	}
 	DestinationDirectory.Files.Add(SourceFile);
 
+	// Inline files move to blocks if the new entry leaves no room in the directory
+	if (!MakeRoomInDirectory(NormalizedDestinationDirectoryPath, DestinationDirectory))
+	{
+		return false;
+	}
+
 	// Save the directories
 	if (!SaveDirectory(DestinationDirectory, DestinationDirectoryFile.FileOffset))
 	{
@@ -1782,8 +4148,10 @@ bool FsFilesystem::FsMoveFile(const FsPath& SourceFileName, const FsPath& Destin
 		}
 	}
 
-	ClearCachedChunks(NormalizedSourcePath);
-	ClearCachedChunks(NormalizedDestinationPath);
+	ClearCachedBlockMap(NormalizedSourcePath);
+	ClearCachedBlockMap(NormalizedDestinationPath);
+	DropReadAhead(NormalizedSourcePath);
+	DropReadAhead(NormalizedDestinationPath);
 
 	return true;
 }
@@ -1825,28 +4193,13 @@ const char* FsFilesystem::GetCompressedBytesString(uint64 Bytes)
 bool FsFilesystem::GetTotalAndFreeBytes(uint64& OutTotalBytes, uint64& OutFreeBytes)
 {
 	OutTotalBytes = GetPartitionSize();
-	OutFreeBytes = 0;
-	FsBitArray BlockBuffer;
-	BlockBuffer.FillZeroed(GetBlockBufferSizeBytes());
-
-	const FilesystemReadResult ReadResult = Read(GetBlockBufferOffset(), GetBlockBufferSizeBytes(), BlockBuffer.GetInternalArray().GetData());
-	if (ReadResult != FilesystemReadResult::Success)
-	{
-		FsLogger::LogFormat(FilesystemLogType::Error, "GetTotalAndUsedBytes: Failed to read block buffer. Ensure `Read` is implemented correctly.");
-		return false;
-	}
 
-	// Calculate the minimum block index that we should skip to avoid the block buffer.
-	const uint64 MinBlockIndex = GetContentStartOffset() / BlockSize;
+	const uint64 ContentBlocks = GetBlockBufferSizeBits() - GetMinBlockIndex();
 
-	for (uint64 i = MinBlockIndex; i < BlockBuffer.BitLength(); i++)
-	{
-		if (!BlockBuffer.GetBit(i))
-		{
-			OutFreeBytes += BlockSize;
-		}
-	}
+	// Blocks held back for staged writes are not free either
+	const uint64 CurrentUsedBlocks = FsAtomicLoad64(&UsedBlocks) + ReservedBlocks;
 
+	OutFreeBytes = CurrentUsedBlocks < ContentBlocks ? (ContentBlocks - CurrentUsedBlocks) * BlockSize : 0;
 	return true;
 }
 
@@ -1881,41 +4234,250 @@ bool FsFilesystem::GetCachedDirectory(uint64 Offset, FsDirectoryDescriptor& OutD
 	return false;
 }
 
-FsArray<uint8>* FsFilesystem::CacheRead(uint64 BlockIndex)
+FsReadAheadStream* FsFilesystem::GetReadAheadStream(const FsPath& NormalizedPath)
 {
-	fsCheck(false, "Not Implemented (WIP)");
+	if (ReadAheadStreams.IsEmpty())
+	{
+		return nullptr;
+	}
+
+	const uint64 FileNameHash = HashFileName(NormalizedPath);
+	for (FsReadAheadStream& Stream : ReadAheadStreams)
+	{
+		if (Stream.FileNameHash == FileNameHash && Stream.FileName == NormalizedPath)
+		{
+			return &Stream;
+		}
+	}
 	return nullptr;
+}
+
+bool FsFilesystem::ReadFromReadAhead(const FsPath& NormalizedPath, uint64 Offset, uint8* Destination, uint64 Length)
+{
+	FsReadAheadStream* Stream = GetReadAheadStream(NormalizedPath);
+	if (!Stream || Length == 0 || Stream->Data.IsEmpty())
+	{
+		return false;
+	}
+
+	if (Offset < Stream->DataOffset || Offset + Length > Stream->DataOffset + Stream->Data.Length())
+	{
+		return false;
+	}
+
+	WaitForReadAhead(*Stream);
+	if (Stream->bFailed)
+	{
+		// Read from the blocks instead, which reports the failure if it happens again
+		Stream->Data.Empty();
+		return false;
+	}
+
+	FsMemory::Copy(Destination, Stream->Data.GetData() + (Offset - Stream->DataOffset), Length);
+	return true;
+}
+
+void FsFilesystem::UpdateReadAhead(const FsPath& NormalizedPath, const FsFileDescriptor& File, uint64 Offset, uint64 Length, bool bReadFromReadAhead)
+{
+	if (MountOptions.ReadAheadMaxBytes == 0 || Length == 0)
+	{
+		return;
+	}
+
+	FsReadAheadStream* Stream = GetReadAheadStream(NormalizedPath);
+	if (!Stream)
+	{
+		if (ReadAheadStreams.Length() >= FS_MAX_READ_AHEAD_STREAMS)
+		{
+			uint64 OldestIndex = 0;
+			for (uint64 i = 1; i < ReadAheadStreams.Length(); i++)
+			{
+				if (ReadAheadStreams[i].LastUsed < ReadAheadStreams[OldestIndex].LastUsed)
+				{
+					OldestIndex = i;
+				}
+			}
+			RemoveReadAheadStream(OldestIndex);
+		}
+
+		// Nothing is read ahead until the next read carries straight on from this one
+		FsReadAheadStream NewStream = FsReadAheadStream();
+		NewStream.FileName = NormalizedPath;
+		NewStream.FileNameHash = HashFileName(NormalizedPath);
+		NewStream.Id = NextReadAheadId++;
+		NewStream.NextReadOffset = Offset + Length;
+		NewStream.LastUsed = ++ReadAheadClock;
+		ReadAheadStreams.Add(FsMove(NewStream));
+		return;
+	}
+
+	Stream->LastUsed = ++ReadAheadClock;
+
+	if (Offset != Stream->NextReadOffset)
+	{
+		// Read out of order, so what was read ahead probably won't be used. Start again from nothing.
+		Stream->NextReadOffset = Offset + Length;
+		Stream->WindowBytes = 0;
+		WaitForReadAhead(*Stream);
+		Stream->Data.Empty(true);
+		return;
+	}
+
+	Stream->NextReadOffset = Offset + Length;
+
+	// Nothing more is needed until the reader gets to the end of what was read ahead
+	if (!Stream->Data.IsEmpty() && Stream->NextReadOffset < Stream->DataOffset + Stream->Data.Length())
+	{
+		return;
+	}
+
+	if (Stream->WindowBytes == 0)
+	{
+		// Start with a couple of reads worth, in whole blocks
+		const uint64 FirstWindow = Length * 2;
+		Stream->WindowBytes = FirstWindow % BlockSize == 0 ? FirstWindow : FirstWindow + BlockSize - (FirstWindow % BlockSize);
+	}
+	else if (bReadFromReadAhead)
+	{
+		// The last window was used, so the reader can take more
+		Stream->WindowBytes *= 2;
+	}
+
+	if (Stream->WindowBytes > MountOptions.ReadAheadMaxBytes)
+	{
+		Stream->WindowBytes = MountOptions.ReadAheadMaxBytes;
+	}
 
-	ClearCachedRead(BlockIndex);
-	CachedReads.Add({BlockIndex, FsArray<uint8>()});
-	return &CachedReads[CachedReads.Length() - 1].Data;
+	StartReadAhead(*Stream, NormalizedPath, File, Stream->NextReadOffset, Stream->WindowBytes);
 }
 
-void FsFilesystem::ClearCachedRead(uint64 BlockIndex)
+void FsFilesystem::StartReadAhead(FsReadAheadStream& Stream, const FsPath& NormalizedPath, const FsFileDescriptor& File, uint64 StartOffset, uint64 WindowBytes)
 {
-	return;
+	// The buffer is about to be refilled, so nothing can still be reading into it
+	WaitForReadAhead(Stream);
+	Stream.Data.Empty();
+	Stream.bFailed = false;
+
+	if (StartOffset >= File.FileSize)
+	{
+		return;
+	}
+
+	const uint64 Length = File.FileSize - StartOffset < WindowBytes ? File.FileSize - StartOffset : WindowBytes;
+	const uint64 DiskReadLength = StartOffset >= File.WrittenSize ? 0 : (StartOffset + Length < File.WrittenSize ? Length : File.WrittenSize - StartOffset);
+
+	const FsBlockMap* BlockMap = GetBlockMap(NormalizedPath, File);
+	if (!BlockMap)
+	{
+		return;
+	}
+
+	FsArray<FsContentRange> Ranges = FsArray<FsContentRange>();
+	GetContentRanges(BlockMap->Extents, StartOffset, DiskReadLength, Ranges);
+
+	Stream.Data.FillUninitialized(Length);
+	Stream.DataOffset = StartOffset;
+
+	// Holes and the unwritten part read as zeros without touching the blocks
+	uint64 ZeroStart = StartOffset;
+	for (const FsContentRange& Range : Ranges)
+	{
+		FsMemory::Zero(Stream.Data.GetData() + (ZeroStart - StartOffset), Range.FileOffset - ZeroStart);
+		ZeroStart = Range.FileOffset + Range.Length;
+	}
+	FsMemory::Zero(Stream.Data.GetData() + (ZeroStart - StartOffset), StartOffset + Length - ZeroStart);
+
+	for (const FsContentRange& Range : Ranges)
+	{
+		FsIoRequest Request = FsIoRequest();
+		Request.Tag = FS_READ_AHEAD_TAG | Stream.Id;
+		Request.Operation = FsIoOperation::Read;
+		Request.Offset = Range.AbsoluteOffset;
+		Request.Length = Range.Length;
+		Request.Destination = Stream.Data.GetData() + (Range.FileOffset - StartOffset);
+		if (!SubmitIo(Request))
+		{
+			// The requests already submitted still land in the buffer, but it can't be used
+			FsLogger::LogFormat(FilesystemLogType::Warning, "Failed to submit read ahead for file %s", NormalizedPath.GetData());
+			Stream.bFailed = true;
+			break;
+		}
+		Stream.PendingRequests++;
+	}
+}
 
-	for (uint64 i = 0; i < CachedReads.Length(); i++)
+void FsFilesystem::WaitForReadAhead(FsReadAheadStream& Stream)
+{
+	while (Stream.PendingRequests > 0)
 	{
-		if (CachedReads[i].BlockIndex == BlockIndex)
+		FsIoCompletion Completion = FsIoCompletion();
+		if (!WaitForIoCompletion(Completion))
 		{
-			CachedReads.RemoveAt(i);
+			fsCheck(false, "Read ahead never completed");
+			Stream.PendingRequests = 0;
+			Stream.bFailed = true;
 			return;
 		}
+
+		// RunIoRequests waits for all of its own requests before returning, so only read ahead can be in flight here
+		fsCheck(Completion.Tag & FS_READ_AHEAD_TAG, "IO completed that nothing is waiting for");
+		OnReadAheadCompleted(Completion);
 	}
 }
 
-FsArray<uint8>* FsFilesystem::GetCachedRead(uint64 BlockIndex)
+void FsFilesystem::OnReadAheadCompleted(const FsIoCompletion& Completion)
 {
-	return nullptr;
+	const uint64 Id = Completion.Tag & ~FS_READ_AHEAD_TAG;
+	for (FsReadAheadStream& Stream : ReadAheadStreams)
+	{
+		if (Stream.Id != Id)
+		{
+			continue;
+		}
+
+		fsCheck(Stream.PendingRequests > 0, "Read ahead completed more requests than it submitted");
+		Stream.PendingRequests--;
+		if (!Completion.bSucceeded)
+		{
+			FsLogger::LogFormat(FilesystemLogType::Warning, "Failed to read ahead in file %s", Stream.FileName.GetData());
+			Stream.bFailed = true;
+		}
+		return;
+	}
+
+	// Streams are only removed once their requests have finished
+	fsCheck(false, "Read ahead completed for a stream that no longer exists");
+}
+
+void FsFilesystem::DropReadAhead(const FsPath& NormalizedPath)
+{
+	if (ReadAheadStreams.IsEmpty())
+	{
+		return;
+	}
 
-	for (FsReadCache& CachedRead : CachedReads)
+	const uint64 FileNameHash = HashFileName(NormalizedPath);
+	for (uint64 i = 0; i < ReadAheadStreams.Length(); i++)
 	{
-		if (CachedRead.BlockIndex == BlockIndex)
+		if (ReadAheadStreams[i].FileNameHash == FileNameHash && ReadAheadStreams[i].FileName == NormalizedPath)
 		{
-			return &CachedRead.Data;
+			RemoveReadAheadStream(i);
+			return;
 		}
 	}
+}
 
-	return nullptr;
-}
\ No newline at end of file
+void FsFilesystem::RemoveReadAheadStream(uint64 StreamIndex)
+{
+	// The buffer goes with the stream, so its reads have to land first
+	WaitForReadAhead(ReadAheadStreams[StreamIndex]);
+
+	// Move the last stream into this slot rather than shifting, so no buffers get copied
+	const uint64 LastIndex = ReadAheadStreams.Length() - 1;
+	if (StreamIndex != LastIndex)
+	{
+		ReadAheadStreams[StreamIndex] = FsMove(ReadAheadStreams[LastIndex]);
+	}
+	ReadAheadStreams[LastIndex].Data.Empty(true);
+	ReadAheadStreams.RemoveAt(LastIndex);
+}
@@ -0,0 +1,132 @@
+#include "FsFreeExtentIndex.h"
+
+void FsFreeExtentIndex::Build(const FsBitArray& BlockBuffer, uint64 InFirstBlock, uint64 InEndBlock)
+{
+	FirstBlock = InFirstBlock;
+	EndBlock = InEndBlock;
+
+	ExtentsByStart.Empty();
+	ExtentsBySize.Empty();
+	AddFreeRuns(BlockBuffer, FirstBlock, EndBlock);
+}
+
+void FsFreeExtentIndex::Update(const FsBitArray& BlockBuffer, uint64 StartBlock, uint64 Blocks)
+{
+	if (Blocks == 0)
+	{
+		return;
+	}
+
+	// Take out every extent overlapping or touching the changed blocks. The free runs around the change
+	// are all in the index, so rescanning the blocks they covered finds the new runs whole.
+	uint64 RescanStart = StartBlock;
+	uint64 RescanEnd = StartBlock + Blocks;
+
+	uint64 FirstIndex = LowerBoundByStart(StartBlock);
+	if (FirstIndex > 0 && ExtentsByStart[FirstIndex - 1].StartBlock + ExtentsByStart[FirstIndex - 1].Blocks >= StartBlock)
+	{
+		FirstIndex--;
+	}
+
+	uint64 EndIndex = FirstIndex;
+	while (EndIndex < ExtentsByStart.Length() && ExtentsByStart[EndIndex].StartBlock <= RescanEnd)
+	{
+		const FsFreeExtent& Extent = ExtentsByStart[EndIndex];
+		RescanStart = Extent.StartBlock < RescanStart ? Extent.StartBlock : RescanStart;
+		RescanEnd = Extent.StartBlock + Extent.Blocks > RescanEnd ? Extent.StartBlock + Extent.Blocks : RescanEnd;
+
+		const uint64 SizeIndex = LowerBoundBySize(Extent.Blocks, Extent.StartBlock);
+		fsCheck(SizeIndex < ExtentsBySize.Length() && ExtentsBySize[SizeIndex].StartBlock == Extent.StartBlock, "Free extent index is out of sync");
+		ExtentsBySize.RemoveAt(SizeIndex);
+
+		EndIndex++;
+	}
+
+	if (EndIndex > FirstIndex)
+	{
+		ExtentsByStart.RemoveAt(FirstIndex, EndIndex - FirstIndex);
+	}
+
+	RescanStart = RescanStart > FirstBlock ? RescanStart : FirstBlock;
+	RescanEnd = RescanEnd < EndBlock ? RescanEnd : EndBlock;
+	AddFreeRuns(BlockBuffer, RescanStart, RescanEnd);
+}
+
+bool FsFreeExtentIndex::FindBestFit(uint64 RunLength, FsFreeExtent& OutExtent) const
+{
+	if (RunLength == 0)
+	{
+		return false;
+	}
+
+	const uint64 SizeIndex = LowerBoundBySize(RunLength, 0);
+	if (SizeIndex >= ExtentsBySize.Length())
+	{
+		return false;
+	}
+
+	OutExtent = ExtentsBySize[SizeIndex];
+	return true;
+}
+
+uint64 FsFreeExtentIndex::LowerBoundByStart(uint64 StartBlock) const
+{
+	uint64 Low = 0;
+	uint64 High = ExtentsByStart.Length();
+	while (Low < High)
+	{
+		const uint64 Middle = Low + (High - Low) / 2;
+		if (ExtentsByStart[Middle].StartBlock < StartBlock)
+		{
+			Low = Middle + 1;
+		}
+		else
+		{
+			High = Middle;
+		}
+	}
+	return Low;
+}
+
+uint64 FsFreeExtentIndex::LowerBoundBySize(uint64 Blocks, uint64 StartBlock) const
+{
+	uint64 Low = 0;
+	uint64 High = ExtentsBySize.Length();
+	while (Low < High)
+	{
+		const uint64 Middle = Low + (High - Low) / 2;
+		const FsFreeExtent& Extent = ExtentsBySize[Middle];
+		if (Extent.Blocks < Blocks || (Extent.Blocks == Blocks && Extent.StartBlock < StartBlock))
+		{
+			Low = Middle + 1;
+		}
+		else
+		{
+			High = Middle;
+		}
+	}
+	return Low;
+}
+
+void FsFreeExtentIndex::AddFreeRuns(const FsBitArray& BlockBuffer, uint64 RangeStart, uint64 RangeEnd)
+{
+	uint64 StartIndex = LowerBoundByStart(RangeStart);
+
+	uint64 RunStart = RangeStart;
+	while (RunStart < RangeEnd && BlockBuffer.FindFirstClearBit(RunStart, RangeEnd, RunStart))
+	{
+		uint64 RunEnd = RangeEnd;
+		BlockBuffer.FindFirstSetBit(RunStart, RangeEnd, RunEnd);
+
+		FsFreeExtent Extent = FsFreeExtent();
+		Extent.StartBlock = RunStart;
+		Extent.Blocks = RunEnd - RunStart;
+
+		// The runs are found in order, so each one goes straight after the last
+		ExtentsByStart.InsertAt(StartIndex, Extent);
+		StartIndex++;
+		ExtentsBySize.InsertAt(LowerBoundBySize(Extent.Blocks, Extent.StartBlock), Extent);
+
+		RunStart = RunEnd;
+	}
+}
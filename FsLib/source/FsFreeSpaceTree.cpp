@@ -0,0 +1,186 @@
+#include "FsFreeSpaceTree.h"
+
+void FsFreeSpaceTree::Build(const FsBitArray& BlockBuffer, uint64 InFirstBlock, uint64 InEndBlock)
+{
+	FirstBlock = InFirstBlock;
+	EndBlock = InEndBlock;
+	BaseBlock = FirstBlock - FirstBlock % FS_BLOCK_GROUP_SIZE;
+
+	// Round the group count up to a power of two so every node covers the same amount of groups as its sibling.
+	// The padding groups are past EndBlock so they are never free.
+	const uint64 CoveredBlocks = EndBlock - BaseBlock;
+	const uint64 GroupCount = CoveredBlocks % FS_BLOCK_GROUP_SIZE == 0 ? CoveredBlocks / FS_BLOCK_GROUP_SIZE : CoveredBlocks / FS_BLOCK_GROUP_SIZE + 1;
+	LeafCount = 1;
+	while (LeafCount < GroupCount)
+	{
+		LeafCount *= 2;
+	}
+
+	Nodes.Empty();
+	Nodes.FillZeroed(LeafCount * 2);
+
+	for (uint64 GroupIndex = 0; GroupIndex < GroupCount; GroupIndex++)
+	{
+		Nodes[LeafCount + GroupIndex] = ComputeGroup(BlockBuffer, GroupIndex);
+	}
+
+	uint64 SideLength = FS_BLOCK_GROUP_SIZE;
+	for (uint64 LevelStart = LeafCount / 2; LevelStart > 0; LevelStart /= 2)
+	{
+		for (uint64 NodeIndex = LevelStart; NodeIndex < LevelStart * 2; NodeIndex++)
+		{
+			Nodes[NodeIndex] = CombineNodes(Nodes[NodeIndex * 2], Nodes[NodeIndex * 2 + 1], SideLength);
+		}
+		SideLength *= 2;
+	}
+}
+
+void FsFreeSpaceTree::Update(const FsBitArray& BlockBuffer, uint64 StartBlock, uint64 Blocks)
+{
+	if (Nodes.IsEmpty() || Blocks == 0)
+	{
+		return;
+	}
+
+	fsCheck(StartBlock >= BaseBlock, "Block range is outside of the free space tree");
+	uint64 FirstNode = LeafCount + (StartBlock - BaseBlock) / FS_BLOCK_GROUP_SIZE;
+	uint64 LastNode = LeafCount + (StartBlock + Blocks - 1 - BaseBlock) / FS_BLOCK_GROUP_SIZE;
+	fsCheck(LastNode < Nodes.Length(), "Block range is outside of the free space tree");
+
+	for (uint64 NodeIndex = FirstNode; NodeIndex <= LastNode; NodeIndex++)
+	{
+		Nodes[NodeIndex] = ComputeGroup(BlockBuffer, NodeIndex - LeafCount);
+	}
+
+	// Walk up the tree, only recombining the parents of the groups that changed
+	uint64 SideLength = FS_BLOCK_GROUP_SIZE;
+	while (FirstNode > 1)
+	{
+		FirstNode /= 2;
+		LastNode /= 2;
+		for (uint64 NodeIndex = FirstNode; NodeIndex <= LastNode; NodeIndex++)
+		{
+			Nodes[NodeIndex] = CombineNodes(Nodes[NodeIndex * 2], Nodes[NodeIndex * 2 + 1], SideLength);
+		}
+		SideLength *= 2;
+	}
+}
+
+bool FsFreeSpaceTree::FindFreeRun(const FsBitArray& BlockBuffer, uint64 MinStartBlock, uint64 RunLength, uint64& OutStartBlock) const
+{
+	if (Nodes.IsEmpty() || RunLength == 0)
+	{
+		return false;
+	}
+
+	return FindFreeRun_Internal(BlockBuffer, 1, BaseBlock, LeafCount * FS_BLOCK_GROUP_SIZE, MinStartBlock, RunLength, OutStartBlock);
+}
+
+FsFreeSpaceNode FsFreeSpaceTree::ComputeGroup(const FsBitArray& BlockBuffer, uint64 GroupIndex) const
+{
+	FsFreeSpaceNode Node = FsFreeSpaceNode();
+
+	const uint64 GroupStart = BaseBlock + GroupIndex * FS_BLOCK_GROUP_SIZE;
+	const uint64 GroupEnd = GroupStart + FS_BLOCK_GROUP_SIZE;
+	const uint64 SearchStart = GroupStart > FirstBlock ? GroupStart : FirstBlock;
+	const uint64 SearchEnd = GroupEnd < EndBlock ? GroupEnd : EndBlock;
+
+	uint64 RunStart = SearchStart;
+	while (RunStart < SearchEnd && BlockBuffer.FindFirstClearBit(RunStart, SearchEnd, RunStart))
+	{
+		uint64 RunEnd = SearchEnd;
+		BlockBuffer.FindFirstSetBit(RunStart, SearchEnd, RunEnd);
+
+		const uint64 RunBlocks = RunEnd - RunStart;
+		Node.FreeBlocks += RunBlocks;
+		if (RunStart == GroupStart)
+		{
+			Node.PrefixFreeBlocks = RunBlocks;
+		}
+		if (RunEnd == GroupEnd)
+		{
+			Node.SuffixFreeBlocks = RunBlocks;
+		}
+		if (RunBlocks > Node.LongestFreeBlocks)
+		{
+			Node.LongestFreeBlocks = RunBlocks;
+		}
+
+		RunStart = RunEnd;
+	}
+
+	return Node;
+}
+
+FsFreeSpaceNode FsFreeSpaceTree::CombineNodes(const FsFreeSpaceNode& Left, const FsFreeSpaceNode& Right, uint64 SideLength)
+{
+	FsFreeSpaceNode Node = FsFreeSpaceNode();
+	Node.FreeBlocks = Left.FreeBlocks + Right.FreeBlocks;
+
+	// A side that is entirely free lets the run carry on into the other side
+	Node.PrefixFreeBlocks = Left.PrefixFreeBlocks == SideLength ? SideLength + Right.PrefixFreeBlocks : Left.PrefixFreeBlocks;
+	Node.SuffixFreeBlocks = Right.SuffixFreeBlocks == SideLength ? SideLength + Left.SuffixFreeBlocks : Right.SuffixFreeBlocks;
+
+	const uint64 MiddleRun = Left.SuffixFreeBlocks + Right.PrefixFreeBlocks;
+	Node.LongestFreeBlocks = Left.LongestFreeBlocks > Right.LongestFreeBlocks ? Left.LongestFreeBlocks : Right.LongestFreeBlocks;
+	if (MiddleRun > Node.LongestFreeBlocks)
+	{
+		Node.LongestFreeBlocks = MiddleRun;
+	}
+
+	return Node;
+}
+
+bool FsFreeSpaceTree::FindFreeRun_Internal(const FsBitArray& BlockBuffer, uint64 NodeIndex, uint64 NodeStart, uint64 NodeLength, uint64 MinStartBlock, uint64 RunLength, uint64& OutStartBlock) const
+{
+	const FsFreeSpaceNode& Node = Nodes[NodeIndex];
+	if (NodeStart + NodeLength <= MinStartBlock || Node.LongestFreeBlocks < RunLength)
+	{
+		return false;
+	}
+
+	if (NodeIndex >= LeafCount)
+	{
+		// Scan the group itself, runs that carry on past the group are found by the parent nodes
+		const uint64 GroupEnd = NodeStart + NodeLength < EndBlock ? NodeStart + NodeLength : EndBlock;
+		uint64 RunStart = MinStartBlock > NodeStart ? MinStartBlock : NodeStart;
+		RunStart = RunStart > FirstBlock ? RunStart : FirstBlock;
+		while (RunStart < GroupEnd && BlockBuffer.FindFirstClearBit(RunStart, GroupEnd, RunStart))
+		{
+			if (RunStart + RunLength > GroupEnd)
+			{
+				return false;
+			}
+
+			uint64 RunEnd = RunStart + RunLength;
+			if (!BlockBuffer.FindFirstSetBit(RunStart, RunStart + RunLength, RunEnd))
+			{
+				OutStartBlock = RunStart;
+				return true;
+			}
+
+			RunStart = RunEnd;
+		}
+		return false;
+	}
+
+	const uint64 SideLength = NodeLength / 2;
+	const uint64 Middle = NodeStart + SideLength;
+
+	if (FindFreeRun_Internal(BlockBuffer, NodeIndex * 2, NodeStart, SideLength, MinStartBlock, RunLength, OutStartBlock))
+	{
+		return true;
+	}
+
+	// Check the run that crosses from the left side into the right side
+	const FsFreeSpaceNode& Left = Nodes[NodeIndex * 2];
+	const FsFreeSpaceNode& Right = Nodes[NodeIndex * 2 + 1];
+	const uint64 CrossingStart = Middle - Left.SuffixFreeBlocks > MinStartBlock ? Middle - Left.SuffixFreeBlocks : MinStartBlock;
+	if (CrossingStart < Middle && Middle - CrossingStart + Right.PrefixFreeBlocks >= RunLength)
+	{
+		OutStartBlock = CrossingStart;
+		return true;
+	}
+
+	return FindFreeRun_Internal(BlockBuffer, NodeIndex * 2 + 1, Middle, SideLength, MinStartBlock, RunLength, OutStartBlock);
+}
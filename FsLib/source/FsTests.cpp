@@ -3,12 +3,28 @@
 #include "FsLogger.h"
 #include "FsString.h"
 #include "FsBitStream.h"
+#include "FsFreeSpaceTree.h"
+#include "FsFreeExtentIndex.h"
+#include "FsMemory.h"
 
 void FsTests::RunTests(FsFilesystem& InFilesystem)
 {
 	RUN_TEST(BitStreamTest);
+	RUN_TEST(BitArrayRangeTest);
+	RUN_TEST(FreeSpaceTreeTest);
+	RUN_TEST(FreeExtentIndexTest);
 	RUN_TEST(LargeFileTest);
 	RUN_TEST(MidFileWriteTest);
+	RUN_TEST(PreallocateTest);
+	RUN_TEST(TruncateTest);
+	RUN_TEST(SparseFileTest);
+	RUN_TEST(InlineFileTest);
+	RUN_TEST(InlineDirectoryTest);
+	RUN_TEST(DefragmentTest);
+	RUN_TEST(BlockMapTest);
+	RUN_TEST(ReadAheadTest);
+	RUN_TEST(WriteBackTest);
+	RUN_TEST(DelayedAllocationTest);
 
 	FsLogger::LogFormat(FilesystemLogType::Info, "Tests complete");
 }
@@ -83,6 +99,189 @@ FsTestResult FsTests::BitStreamTest(FsFilesystem& InFilesystem)
 	return Result;
 }
 
+FsTestResult FsTests::BitArrayRangeTest(FsFilesystem& /*InFilesystem*/)
+{
+	FsTestResult Result;
+
+	FsBitArray Bits = FsBitArray();
+	Bits.FillZeroed(1000);
+
+	// Set a range that starts and ends in the middle of a word, and one that spans many words
+	Bits.SetBitRange(13, 70);
+	Bits.SetBitRange(300, 4000);
+	Bits.ClearBitRange(1000, 129);
+
+	// Compare the word operations against the bit by bit equivalents
+	uint64 ExpectedSetBits = 0;
+	for (uint64 i = 0; i < Bits.BitLength(); i++)
+	{
+		const bool bExpected = (i >= 13 && i < 83) || (i >= 300 && i < 4300 && !(i >= 1000 && i < 1129));
+		if (Bits.GetBit(i) != bExpected)
+		{
+			FsLogger::LogFormat(FilesystemLogType::Error, "Bit %u has the wrong value", i);
+			Result.bSucceeded = false;
+			Result.TestResult = "SetBitRange or ClearBitRange set the wrong bits";
+			return Result;
+		}
+		ExpectedSetBits += bExpected ? 1 : 0;
+	}
+
+	uint64 FirstClear = 0;
+	uint64 FirstSet = 0;
+	uint64 ClearInsideRange = 0;
+	const bool bFoundClear = Bits.FindFirstClearBit(13, Bits.BitLength(), FirstClear);
+	const bool bFoundSet = Bits.FindFirstSetBit(83, Bits.BitLength(), FirstSet);
+	const bool bFoundClearInRange = Bits.FindFirstClearBit(300, 1000, ClearInsideRange);
+
+	const bool bSucceeded = Bits.CountSetBits(0, Bits.BitLength()) == ExpectedSetBits
+		&& Bits.CountSetBits(20, 310) == 73
+		&& bFoundClear && FirstClear == 83
+		&& bFoundSet && FirstSet == 300
+		&& !bFoundClearInRange;
+
+	Result.bSucceeded = bSucceeded;
+	Result.TestResult = bSucceeded ? "BitArrayRangeTest succeeded" : "Word based bit searches or counts did not match the bits that were set";
+	return Result;
+}
+
+// Finds the first free run the slow way, to compare against the free space tree
+static bool FindFreeRunByScanning(const FsBitArray& Bits, uint64 FirstBlock, uint64 EndBlock, uint64 MinStart, uint64 RunLength, uint64& OutStart)
+{
+	uint64 RunBlocks = 0;
+	for (uint64 i = MinStart > FirstBlock ? MinStart : FirstBlock; i < EndBlock; i++)
+	{
+		RunBlocks = Bits.GetBit(i) ? 0 : RunBlocks + 1;
+		if (RunBlocks == RunLength)
+		{
+			OutStart = i + 1 - RunLength;
+			return true;
+		}
+	}
+	return false;
+}
+
+FsTestResult FsTests::FreeSpaceTreeTest(FsFilesystem& /*InFilesystem*/)
+{
+	FsTestResult Result;
+
+	// Five groups of blocks, with the last one cut short
+	const uint64 FirstBlock = 5;
+	const uint64 EndBlock = FS_BLOCK_GROUP_SIZE * 5 - 100;
+
+	FsBitArray Bits = FsBitArray();
+	Bits.FillZeroed(EndBlock / 8 + 1);
+	Bits.SetBitRange(0, EndBlock);
+
+	// A short run in the first group, a run spanning three groups and a run at the very end
+	Bits.ClearBitRange(20, 10);
+	Bits.ClearBitRange(FS_BLOCK_GROUP_SIZE + 4000, 9000);
+	Bits.ClearBitRange(EndBlock - 50, 50);
+
+	FsFreeSpaceTree Tree = FsFreeSpaceTree();
+	Tree.Build(Bits, FirstBlock, EndBlock);
+
+	const uint64 Searches[][2] = { { 0, 1 }, { 0, 10 }, { 0, 11 }, { 25, 5 }, { 25, 6 }, { 0, 9000 }, { 0, 9001 }, { FS_BLOCK_GROUP_SIZE * 2, 4096 }, { 0, 50 }, { EndBlock - 10, 10 }, { EndBlock - 10, 11 } };
+
+	for (uint64 Pass = 0; Pass < 2; Pass++)
+	{
+		for (const auto& Search : Searches)
+		{
+			uint64 Expected = 0;
+			uint64 Found = 0;
+			const bool bExpected = FindFreeRunByScanning(Bits, FirstBlock, EndBlock, Search[0], Search[1], Expected);
+			const bool bFound = Tree.FindFreeRun(Bits, Search[0], Search[1], Found);
+			if (bFound != bExpected || (bFound && Found != Expected))
+			{
+				FsLogger::LogFormat(FilesystemLogType::Error, "Searching for %u blocks from %u found %u, expected %u", Search[1], Search[0], bFound ? Found : 0, bExpected ? Expected : 0);
+				Result.bSucceeded = false;
+				Result.TestResult = "The free space tree did not find the same run as scanning the bits";
+				return Result;
+			}
+		}
+
+		// Fill part of the long run and free the blocks before the first block, then check everything again
+		Bits.SetBitRange(FS_BLOCK_GROUP_SIZE * 2, 10);
+		Tree.Update(Bits, FS_BLOCK_GROUP_SIZE * 2, 10);
+		Bits.ClearBitRange(0, FirstBlock);
+		Tree.Update(Bits, 0, FirstBlock);
+	}
+
+	Result.bSucceeded = Tree.GetFreeBlocks() == 10 + 9000 - 10 + 50;
+	Result.TestResult = Result.bSucceeded ? "FreeSpaceTreeTest succeeded" : "The free space tree has the wrong amount of free blocks";
+	return Result;
+}
+
+// Finds the shortest free run that fits the slow way, to compare against the free extent index
+static bool FindBestFitByScanning(const FsBitArray& Bits, uint64 FirstBlock, uint64 EndBlock, uint64 RunLength, uint64& OutStart)
+{
+	bool bFound = false;
+	uint64 BestBlocks = 0;
+	uint64 RunStart = FirstBlock;
+	while (RunStart < EndBlock && Bits.FindFirstClearBit(RunStart, EndBlock, RunStart))
+	{
+		uint64 RunEnd = EndBlock;
+		Bits.FindFirstSetBit(RunStart, EndBlock, RunEnd);
+		if (RunEnd - RunStart >= RunLength && (!bFound || RunEnd - RunStart < BestBlocks))
+		{
+			bFound = true;
+			BestBlocks = RunEnd - RunStart;
+			OutStart = RunStart;
+		}
+		RunStart = RunEnd;
+	}
+	return bFound;
+}
+
+FsTestResult FsTests::FreeExtentIndexTest(FsFilesystem& /*InFilesystem*/)
+{
+	FsTestResult Result;
+
+	const uint64 FirstBlock = 3;
+	const uint64 EndBlock = 5000;
+
+	FsBitArray Bits = FsBitArray();
+	Bits.FillZeroed(EndBlock / 8 + 1);
+
+	FsFreeExtentIndex Index = FsFreeExtentIndex();
+	Index.Build(Bits, FirstBlock, EndBlock);
+
+	// Flip pseudo random ranges of blocks, checking best fit searches against a scan after every change
+	uint64 Seed = 12345;
+	for (uint64 Step = 0; Step < 300; Step++)
+	{
+		Seed = Seed * 6364136223846793005ull + 1442695040888963407ull;
+		const uint64 Start = (Seed >> 33) % EndBlock;
+		const uint64 Blocks = ((Seed >> 17) % 200 + 1) < EndBlock - Start ? (Seed >> 17) % 200 + 1 : EndBlock - Start;
+		if (Step % 3 == 0)
+		{
+			Bits.ClearBitRange(Start, Blocks);
+		}
+		else
+		{
+			Bits.SetBitRange(Start, Blocks);
+		}
+		Index.Update(Bits, Start, Blocks);
+
+		for (uint64 RunLength = 1; RunLength < 400; RunLength += 37)
+		{
+			uint64 Expected = 0;
+			FsFreeExtent Found = FsFreeExtent();
+			const bool bExpected = FindBestFitByScanning(Bits, FirstBlock, EndBlock, RunLength, Expected);
+			const bool bFound = Index.FindBestFit(RunLength, Found);
+			if (bFound != bExpected || (bFound && Found.StartBlock != Expected))
+			{
+				FsLogger::LogFormat(FilesystemLogType::Error, "Best fit for %u blocks found %u, expected %u", RunLength, bFound ? Found.StartBlock : 0, bExpected ? Expected : 0);
+				Result.TestResult = "The free extent index did not find the same run as scanning the bits";
+				return Result;
+			}
+		}
+	}
+
+	Result.bSucceeded = true;
+	Result.TestResult = "FreeExtentIndexTest succeeded";
+	return Result;
+}
+
 FsTestResult FsTests::LargeFileTest(FsFilesystem& InFilesystem)
 {
 	FsTestResult Result;
@@ -187,4 +386,905 @@ FsTestResult FsTests::MidFileWriteTest(FsFilesystem& InFilesystem)
 	Result.bSucceeded = false;
 	Result.TestResult = "Failed to match strings after writing and reading from a file after a";
 	return Result;
-}
\ No newline at end of file
+}
+FsTestResult FsTests::PreallocateTest(FsFilesystem& InFilesystem)
+{
+	FsTestResult Result;
+
+	const char* TestFileName = "Foo/Bar/Baz/Preallocated.bin";
+	InFilesystem.CreateFile(TestFileName);
+
+	FsString TestString = "Written before preallocating";
+	const uint64 StringLength = TestString.Length();
+	InFilesystem.WriteToFile(TestFileName, reinterpret_cast<const uint8*>(TestString.GetData()), 0, StringLength);
+
+	// Reserving blocks without growing the file leaves its size alone
+	const uint64 PreallocatedLength = InFilesystem.GetBlockSize() * 20;
+	uint64 FileSize = 0;
+	if (!InFilesystem.PreallocateFile(TestFileName, PreallocatedLength, FsPreallocateMode::KeepSize) || !InFilesystem.GetFileSize(TestFileName, FileSize) || FileSize != StringLength)
+	{
+		Result.TestResult = "Preallocating without growing the file changed its size";
+		return Result;
+	}
+
+	if (!InFilesystem.PreallocateFile(TestFileName, PreallocatedLength, FsPreallocateMode::ExtendSize) || !InFilesystem.GetFileSize(TestFileName, FileSize) || FileSize != PreallocatedLength)
+	{
+		Result.TestResult = "Preallocating did not grow the file";
+		return Result;
+	}
+
+	// Write past a gap, the gap and the end of the file were never written so they must read as zeros
+	const uint64 LateWriteOffset = PreallocatedLength / 2 + 7;
+	InFilesystem.WriteToFile(TestFileName, reinterpret_cast<const uint8*>(TestString.GetData()), LateWriteOffset, StringLength);
+
+	FsArray<uint8> ReadBuffer = FsArray<uint8>();
+	ReadBuffer.FillUninitialized(PreallocatedLength);
+	InFilesystem.ReadFromFile(TestFileName, 0, ReadBuffer.GetData(), PreallocatedLength);
+
+	for (uint64 i = 0; i < PreallocatedLength; i++)
+	{
+		uint8 Expected = 0;
+		if (i < StringLength)
+		{
+			Expected = TestString[i];
+		}
+		else if (i >= LateWriteOffset && i < LateWriteOffset + StringLength)
+		{
+			Expected = TestString[i - LateWriteOffset];
+		}
+
+		if (ReadBuffer[i] != Expected)
+		{
+			FsLogger::LogFormat(FilesystemLogType::Error, "Preallocated file has the wrong byte at %u", i);
+			Result.TestResult = "Preallocated file did not read back as written data and zeros";
+			return Result;
+		}
+	}
+
+	InFilesystem.FsDeleteFile(TestFileName);
+
+	Result.bSucceeded = true;
+	Result.TestResult = "PreallocateTest succeeded";
+	return Result;
+}
+
+FsTestResult FsTests::TruncateTest(FsFilesystem& InFilesystem)
+{
+	FsTestResult Result;
+
+	const char* TestFileName = "Foo/Bar/Baz/Truncated.bin";
+	const uint64 BlockSize = InFilesystem.GetBlockSize();
+
+	uint64 TotalBytes = 0;
+	uint64 FreeBytesBefore = 0;
+	InFilesystem.GetTotalAndFreeBytes(TotalBytes, FreeBytesBefore);
+
+	InFilesystem.CreateFile(TestFileName);
+
+	const uint64 WrittenLength = BlockSize * 10 + 37;
+	FsArray<uint8> WriteBuffer = FsArray<uint8>();
+	WriteBuffer.FillUninitialized(WrittenLength);
+	for (uint64 i = 0; i < WrittenLength; i++)
+	{
+		WriteBuffer[i] = static_cast<uint8>(i * 13 + 1);
+	}
+	InFilesystem.WriteToFile(TestFileName, WriteBuffer.GetData(), 0, WrittenLength);
+
+	// Space preallocated past the end goes too
+	InFilesystem.PreallocateFile(TestFileName, BlockSize * 20, FsPreallocateMode::KeepSize);
+	uint64 FreeBytesFull = 0;
+	InFilesystem.GetTotalAndFreeBytes(TotalBytes, FreeBytesFull);
+
+	// Cut the file partway into a block, only that block is kept of the ones past the new end
+	const uint64 TruncatedLength = BlockSize * 3 + 5;
+	uint64 FileSize = 0;
+	if (!InFilesystem.TruncateFile(TestFileName, TruncatedLength) || !InFilesystem.GetFileSize(TestFileName, FileSize) || FileSize != TruncatedLength)
+	{
+		Result.TestResult = "Truncating did not shrink the file";
+		return Result;
+	}
+
+	uint64 FreeBytesTruncated = 0;
+	InFilesystem.GetTotalAndFreeBytes(TotalBytes, FreeBytesTruncated);
+	if (FreeBytesTruncated - FreeBytesFull != BlockSize * 16)
+	{
+		FsLogger::LogFormat(FilesystemLogType::Error, "Truncating freed %u bytes, expected %u", FreeBytesTruncated - FreeBytesFull, BlockSize * 16);
+		Result.TestResult = "Truncating did not free the blocks past the new end";
+		return Result;
+	}
+
+	// Grow it again, the bytes cut off must not come back
+	const uint64 RegrownLength = BlockSize * 6;
+	FsArray<uint8> ReadBuffer = FsArray<uint8>();
+	ReadBuffer.FillUninitialized(RegrownLength);
+	if (!InFilesystem.TruncateFile(TestFileName, RegrownLength) || !InFilesystem.ReadFromFile(TestFileName, 0, ReadBuffer.GetData(), RegrownLength))
+	{
+		Result.TestResult = "Failed to grow the truncated file";
+		return Result;
+	}
+
+	for (uint64 i = 0; i < RegrownLength; i++)
+	{
+		const uint8 Expected = i < TruncatedLength ? WriteBuffer[i] : 0;
+		if (ReadBuffer[i] != Expected)
+		{
+			FsLogger::LogFormat(FilesystemLogType::Error, "Truncated file has the wrong byte at %u", i);
+			Result.TestResult = "Truncated file did not keep its start and read zeros after it";
+			return Result;
+		}
+	}
+
+	// Truncating to nothing leaves the file holding no blocks at all
+	uint64 FreeBytesEmpty = 0;
+	if (!InFilesystem.TruncateFile(TestFileName, 0) || !InFilesystem.GetTotalAndFreeBytes(TotalBytes, FreeBytesEmpty) || FreeBytesEmpty != FreeBytesBefore)
+	{
+		Result.TestResult = "Truncating to zero did not free every block of the file";
+		return Result;
+	}
+
+	InFilesystem.FsDeleteFile(TestFileName);
+
+	Result.bSucceeded = true;
+	Result.TestResult = "TruncateTest succeeded";
+	return Result;
+}
+
+FsTestResult FsTests::SparseFileTest(FsFilesystem& InFilesystem)
+{
+	FsTestResult Result;
+
+	const char* TestFileName = "Foo/Bar/Baz/Sparse.bin";
+	const uint64 BlockSize = InFilesystem.GetBlockSize();
+	InFilesystem.CreateFile(TestFileName);
+
+	uint64 TotalBytes = 0;
+	uint64 FreeBytesBefore = 0;
+	InFilesystem.GetTotalAndFreeBytes(TotalBytes, FreeBytesBefore);
+
+	// Writing far into an empty file only takes the block the data lands in, plus one for the map
+	FsString TestString = "Data past a hole";
+	const uint64 StringLength = TestString.Length();
+	const uint64 FarOffset = BlockSize * 50 + 3;
+	InFilesystem.WriteToFile(TestFileName, reinterpret_cast<const uint8*>(TestString.GetData()), FarOffset, StringLength);
+	InFilesystem.FlushFile(TestFileName);
+
+	uint64 FreeBytes = 0;
+	InFilesystem.GetTotalAndFreeBytes(TotalBytes, FreeBytes);
+	if (FreeBytesBefore - FreeBytes != BlockSize * 2)
+	{
+		FsLogger::LogFormat(FilesystemLogType::Error, "Sparse write used %u bytes, expected %u", FreeBytesBefore - FreeBytes, BlockSize * 2);
+		Result.TestResult = "Writing past a hole allocated blocks for the hole";
+		return Result;
+	}
+
+	// Fill part of the hole across a block boundary, the rest of the new blocks must still read as zeros
+	const uint64 MiddleOffset = BlockSize * 10 - 5;
+	InFilesystem.WriteToFile(TestFileName, reinterpret_cast<const uint8*>(TestString.GetData()), MiddleOffset, StringLength);
+
+	// Growing the file only moves its end
+	const uint64 GrownLength = BlockSize * 200;
+	InFilesystem.FlushFile(TestFileName);
+	InFilesystem.GetTotalAndFreeBytes(TotalBytes, FreeBytesBefore);
+	uint64 FileSize = 0;
+	if (!InFilesystem.TruncateFile(TestFileName, GrownLength) || !InFilesystem.GetFileSize(TestFileName, FileSize) || FileSize != GrownLength)
+	{
+		Result.TestResult = "Failed to grow the sparse file";
+		return Result;
+	}
+
+	InFilesystem.GetTotalAndFreeBytes(TotalBytes, FreeBytes);
+	if (FreeBytes != FreeBytesBefore)
+	{
+		Result.TestResult = "Growing the sparse file allocated blocks";
+		return Result;
+	}
+
+	// Filling the holes below the data must not bring back what the blocks held before
+	for (uint64 Pass = 0; Pass < 2; Pass++)
+	{
+		if (Pass == 1)
+		{
+			InFilesystem.PreallocateFile(TestFileName, BlockSize * 60, FsPreallocateMode::KeepSize);
+		}
+
+		FsArray<uint8> ReadBuffer = FsArray<uint8>();
+		ReadBuffer.FillUninitialized(GrownLength);
+		if (!InFilesystem.ReadFromFile(TestFileName, 0, ReadBuffer.GetData(), GrownLength))
+		{
+			Result.TestResult = "Failed to read the sparse file";
+			return Result;
+		}
+
+		for (uint64 i = 0; i < GrownLength; i++)
+		{
+			uint8 Expected = 0;
+			if (i >= FarOffset && i < FarOffset + StringLength)
+			{
+				Expected = TestString[i - FarOffset];
+			}
+			else if (i >= MiddleOffset && i < MiddleOffset + StringLength)
+			{
+				Expected = TestString[i - MiddleOffset];
+			}
+
+			if (ReadBuffer[i] != Expected)
+			{
+				FsLogger::LogFormat(FilesystemLogType::Error, "Sparse file has the wrong byte at %u", i);
+				Result.TestResult = "Sparse file did not read back as its data and zeros";
+				return Result;
+			}
+		}
+	}
+
+	InFilesystem.FsDeleteFile(TestFileName);
+
+	Result.bSucceeded = true;
+	Result.TestResult = "SparseFileTest succeeded";
+	return Result;
+}
+
+FsTestResult FsTests::InlineFileTest(FsFilesystem& InFilesystem)
+{
+	FsTestResult Result;
+
+	const uint64 InlineFileMaxBytes = InFilesystem.GetMountOptions().InlineFileMaxBytes;
+	if (InlineFileMaxBytes == 0)
+	{
+		Result.bSucceeded = true;
+		Result.TestResult = "InlineFileTest skipped, inline files are turned off";
+		return Result;
+	}
+
+	const char* TestFileName = "Foo/Bar/Baz/Inline.txt";
+	InFilesystem.CreateFile(TestFileName);
+	InFilesystem.FlushFile(TestFileName);
+
+	uint64 TotalBytes = 0;
+	uint64 FreeBytesBefore = 0;
+	InFilesystem.GetTotalAndFreeBytes(TotalBytes, FreeBytesBefore);
+
+	// A small file lives in its directory entry and takes no blocks
+	FsString TestString = "Small enough to inline";
+	const uint64 StringLength = TestString.Length();
+	InFilesystem.WriteToFile(TestFileName, reinterpret_cast<const uint8*>(TestString.GetData()), 0, StringLength);
+	InFilesystem.FlushFile(TestFileName);
+
+	uint64 FreeBytes = 0;
+	InFilesystem.GetTotalAndFreeBytes(TotalBytes, FreeBytes);
+	FsFileDescriptor File{};
+	if (FreeBytes != FreeBytesBefore || !InFilesystem.GetFile(TestFileName, File) || File.FileOffset != 0)
+	{
+		Result.TestResult = "Small file was not stored in its directory entry";
+		return Result;
+	}
+
+	FsArray<uint8> InlineBuffer = FsArray<uint8>();
+	InlineBuffer.FillUninitialized(StringLength);
+	InFilesystem.ReadFromFile(TestFileName, 0, InlineBuffer.GetData(), StringLength);
+	for (uint64 i = 0; i < StringLength; i++)
+	{
+		if (InlineBuffer[i] != static_cast<uint8>(TestString[i]))
+		{
+			Result.TestResult = "Small file did not read back from its directory entry";
+			return Result;
+		}
+	}
+
+	// Grow it past the limit so it moves into blocks, its first bytes must come along
+	const uint64 GrownLength = InlineFileMaxBytes + InFilesystem.GetBlockSize();
+	InFilesystem.WriteToFile(TestFileName, reinterpret_cast<const uint8*>(TestString.GetData()), GrownLength - StringLength, StringLength);
+	InFilesystem.FlushFile(TestFileName);
+
+	if (!InFilesystem.GetFile(TestFileName, File) || File.FileOffset == 0 || !File.InlineData.IsEmpty())
+	{
+		Result.TestResult = "File did not move into blocks once it grew";
+		return Result;
+	}
+
+	FsArray<uint8> ReadBuffer = FsArray<uint8>();
+	ReadBuffer.FillUninitialized(GrownLength);
+	if (!InFilesystem.ReadFromFile(TestFileName, 0, ReadBuffer.GetData(), GrownLength))
+	{
+		Result.TestResult = "Failed to read the grown file";
+		return Result;
+	}
+
+	for (uint64 i = 0; i < GrownLength; i++)
+	{
+		uint8 Expected = 0;
+		if (i < StringLength)
+		{
+			Expected = TestString[i];
+		}
+		else if (i >= GrownLength - StringLength)
+		{
+			Expected = TestString[i - (GrownLength - StringLength)];
+		}
+
+		if (ReadBuffer[i] != Expected)
+		{
+			FsLogger::LogFormat(FilesystemLogType::Error, "Grown inline file has the wrong byte at %u", i);
+			Result.TestResult = "File read back wrong after moving out of its directory entry";
+			return Result;
+		}
+	}
+
+	InFilesystem.FsDeleteFile(TestFileName);
+
+	Result.bSucceeded = true;
+	Result.TestResult = "InlineFileTest succeeded";
+	return Result;
+}
+
+// Writes everything out and loads the filesystem again from the storage, as unmounting and mounting it would
+static void Remount(FsFilesystem& InFilesystem)
+{
+	InFilesystem.FlushAllFiles();
+	InFilesystem.FlushDiscards();
+
+	const FsMountOptions MountOptions = InFilesystem.GetMountOptions();
+	InFilesystem.Initialize(MountOptions);
+}
+
+// Fills Files files named Prefix followed by their index, each with FileBytes bytes of its own pattern
+static bool WriteNumberedFiles(FsFilesystem& InFilesystem, const char* Prefix, uint64 Files, uint64 FileBytes)
+{
+	FsArray<uint8> WriteBuffer = FsArray<uint8>();
+	WriteBuffer.FillUninitialized(FileBytes);
+	for (uint64 FileIndex = 0; FileIndex < Files; FileIndex++)
+	{
+		FsString FileName = Prefix;
+		FileName.Append(FileIndex);
+		if (!InFilesystem.CreateFile(FileName))
+		{
+			FsLogger::LogFormat(FilesystemLogType::Error, "Failed to create %s", FileName.GetData());
+			return false;
+		}
+
+		for (uint64 i = 0; i < FileBytes; i++)
+		{
+			WriteBuffer[i] = static_cast<uint8>(FileIndex * 7 + i);
+		}
+		if (!InFilesystem.WriteToFile(FileName, WriteBuffer.GetData(), 0, FileBytes))
+		{
+			FsLogger::LogFormat(FilesystemLogType::Error, "Failed to write %s", FileName.GetData());
+			return false;
+		}
+	}
+	return true;
+}
+
+static bool CheckNumberedFiles(FsFilesystem& InFilesystem, const char* Prefix, uint64 Files, uint64 FileBytes)
+{
+	FsArray<uint8> ReadBuffer = FsArray<uint8>();
+	ReadBuffer.FillUninitialized(FileBytes);
+	for (uint64 FileIndex = 0; FileIndex < Files; FileIndex++)
+	{
+		FsString FileName = Prefix;
+		FileName.Append(FileIndex);
+		if (!InFilesystem.ReadFromFile(FileName, 0, ReadBuffer.GetData(), FileBytes))
+		{
+			FsLogger::LogFormat(FilesystemLogType::Error, "Failed to read %s", FileName.GetData());
+			return false;
+		}
+
+		for (uint64 i = 0; i < FileBytes; i++)
+		{
+			if (ReadBuffer[i] != static_cast<uint8>(FileIndex * 7 + i))
+			{
+				FsLogger::LogFormat(FilesystemLogType::Error, "File %s has the wrong byte at %u", FileName.GetData(), i);
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+static void DeleteNumberedFiles(FsFilesystem& InFilesystem, const char* Prefix, uint64 Files)
+{
+	for (uint64 FileIndex = 0; FileIndex < Files; FileIndex++)
+	{
+		FsString FileName = Prefix;
+		FileName.Append(FileIndex);
+		InFilesystem.FsDeleteFile(FileName);
+	}
+}
+
+FsTestResult FsTests::InlineDirectoryTest(FsFilesystem& InFilesystem)
+{
+	FsTestResult Result;
+
+	const uint64 InlineFileMaxBytes = InFilesystem.GetMountOptions().InlineFileMaxBytes;
+	if (InlineFileMaxBytes == 0)
+	{
+		Result.bSucceeded = true;
+		Result.TestResult = "InlineDirectoryTest skipped, inline files are turned off";
+		return Result;
+	}
+
+	const char* DirPath = "InlineDir";
+	InFilesystem.CreateDirectory(DirPath);
+
+	// A directory is one block however its files are stored, so small blocks only have room for a few entries
+	FsFileDescriptor LongestEntry{};
+	LongestEntry.FileName = "File1000";
+	FsBitArray EntryBuffer = FsBitArray();
+	FsBitWriter EntryWriter = FsBitWriter(EntryBuffer);
+	LongestEntry.Serialize(EntryWriter);
+	const uint64 MaxEntries = InFilesystem.GetBlockSize() / EntryBuffer.ByteLength() - 2;
+
+	// Enough full size inline files to fill the directory's block, then some empty entries on top of them
+	uint64 InlineFiles = InFilesystem.GetBlockSize() / InlineFileMaxBytes + 8;
+	InlineFiles = InlineFiles < MaxEntries ? InlineFiles : MaxEntries;
+	const uint64 EmptyFiles = MaxEntries - InlineFiles < 8 ? MaxEntries - InlineFiles : 8;
+
+	if (!WriteNumberedFiles(InFilesystem, "InlineDir/File", InlineFiles, InlineFileMaxBytes)
+		|| !WriteNumberedFiles(InFilesystem, "InlineDir/Empty", EmptyFiles, 0))
+	{
+		Result.TestResult = "Failed to add an entry to a directory full of inline files";
+		return Result;
+	}
+
+	// The root directory is stored in the filesystem header, so it is bounded by the header rather than a block
+	const uint64 RootFiles = FS_HEADER_MAXSIZE / InlineFileMaxBytes + 4;
+	if (!WriteNumberedFiles(InFilesystem, "InlineRoot", RootFiles, InlineFileMaxBytes))
+	{
+		Result.TestResult = "Failed to add inline files to the root directory";
+		return Result;
+	}
+
+	// Whether they stayed inline or were moved out to make room, every file must still hold its content
+	if (!CheckNumberedFiles(InFilesystem, "InlineDir/File", InlineFiles, InlineFileMaxBytes)
+		|| !CheckNumberedFiles(InFilesystem, "InlineRoot", RootFiles, InlineFileMaxBytes))
+	{
+		Result.TestResult = "File read back wrong after its directory filled up";
+		return Result;
+	}
+
+	// Full directories must load back as they were saved
+	Remount(InFilesystem);
+	if (!CheckNumberedFiles(InFilesystem, "InlineDir/File", InlineFiles, InlineFileMaxBytes)
+		|| !CheckNumberedFiles(InFilesystem, "InlineRoot", RootFiles, InlineFileMaxBytes))
+	{
+		Result.TestResult = "File read back wrong after remounting a full directory";
+		return Result;
+	}
+
+	DeleteNumberedFiles(InFilesystem, "InlineDir/File", InlineFiles);
+	DeleteNumberedFiles(InFilesystem, "InlineDir/Empty", EmptyFiles);
+	DeleteNumberedFiles(InFilesystem, "InlineRoot", RootFiles);
+	InFilesystem.FsDeleteDirectory(DirPath);
+
+	Result.bSucceeded = true;
+	Result.TestResult = "InlineDirectoryTest succeeded";
+	return Result;
+}
+
+FsTestResult FsTests::DefragmentTest(FsFilesystem& InFilesystem)
+{
+	FsTestResult Result;
+
+	const char* FragmentedFileName = "Foo/Bar/Baz/Fragmented.bin";
+	const char* OtherFileName = "Foo/Bar/Baz/Interleaved.bin";
+	InFilesystem.CreateFile(FragmentedFileName);
+	InFilesystem.CreateFile(OtherFileName);
+
+	// Appending to two files in turn makes their extents alternate across the partition
+	const uint64 PieceLength = InFilesystem.GetBlockSize() * 2;
+	const uint64 Pieces = 8;
+	FsArray<uint8> Piece = FsArray<uint8>();
+	Piece.FillUninitialized(PieceLength);
+	for (uint64 PieceIndex = 0; PieceIndex < Pieces; PieceIndex++)
+	{
+		for (uint64 i = 0; i < PieceLength; i++)
+		{
+			Piece[i] = static_cast<uint8>((PieceIndex * PieceLength + i) * 7);
+		}
+		InFilesystem.WriteToFile(FragmentedFileName, Piece.GetData(), PieceIndex * PieceLength, PieceLength);
+		InFilesystem.WriteToFile(OtherFileName, Piece.GetData(), PieceIndex * PieceLength, PieceLength);
+		InFilesystem.FlushFile(FragmentedFileName);
+		InFilesystem.FlushFile(OtherFileName);
+	}
+
+	if (InFilesystem.GetFileFragmentCount(FragmentedFileName) <= 1)
+	{
+		Result.TestResult = "Interleaved appends did not fragment the file";
+		return Result;
+	}
+
+	if (!InFilesystem.DefragmentFile(FragmentedFileName) || InFilesystem.GetFileFragmentCount(FragmentedFileName) != 1)
+	{
+		Result.TestResult = "Failed to defragment the file into one run";
+		return Result;
+	}
+
+	FsArray<uint8> ReadBuffer = FsArray<uint8>();
+	ReadBuffer.FillUninitialized(PieceLength * Pieces);
+	InFilesystem.ReadFromFile(FragmentedFileName, 0, ReadBuffer.GetData(), PieceLength * Pieces);
+	for (uint64 i = 0; i < PieceLength * Pieces; i++)
+	{
+		if (ReadBuffer[i] != static_cast<uint8>(i * 7))
+		{
+			FsLogger::LogFormat(FilesystemLogType::Error, "Defragmented file has the wrong byte at %u", i);
+			Result.TestResult = "Defragmented file did not keep its contents";
+			return Result;
+		}
+	}
+
+	InFilesystem.FsDeleteFile(FragmentedFileName);
+	InFilesystem.FsDeleteFile(OtherFileName);
+
+	Result.bSucceeded = true;
+	Result.TestResult = "DefragmentTest succeeded";
+	return Result;
+}
+
+FsTestResult FsTests::BlockMapTest(FsFilesystem& InFilesystem)
+{
+	FsTestResult Result;
+
+	const char* FirstFileName = "Foo/Bar/Baz/Mapped.bin";
+	const char* SecondFileName = "Foo/Bar/Baz/MappedInterleaved.bin";
+
+	uint64 TotalBytes = 0;
+	uint64 FreeBytesBefore = 0;
+	InFilesystem.GetTotalAndFreeBytes(TotalBytes, FreeBytesBefore);
+
+	InFilesystem.CreateFile(FirstFileName);
+	InFilesystem.CreateFile(SecondFileName);
+
+	// Appending a block at a time to two files in turn gives each of them lots of extents.
+	// With small blocks there are more extents than fit in one map block, so the map has to be chained.
+	const uint64 BlockSize = InFilesystem.GetBlockSize();
+	const uint64 ExtentsPerMapBlock = (BlockSize - sizeof(FsBlockMapHeader)) / sizeof(FsFileExtent);
+	const uint64 Pieces = ExtentsPerMapBlock + 2 < 64 ? ExtentsPerMapBlock + 2 : 64;
+	FsArray<uint8> Piece = FsArray<uint8>();
+	Piece.FillUninitialized(BlockSize);
+	for (uint64 PieceIndex = 0; PieceIndex < Pieces; PieceIndex++)
+	{
+		for (uint64 i = 0; i < BlockSize; i++)
+		{
+			Piece[i] = static_cast<uint8>((PieceIndex * BlockSize + i) * 13);
+		}
+		InFilesystem.WriteToFile(FirstFileName, Piece.GetData(), PieceIndex * BlockSize, BlockSize);
+		InFilesystem.WriteToFile(SecondFileName, Piece.GetData(), PieceIndex * BlockSize, BlockSize);
+		InFilesystem.FlushFile(FirstFileName);
+		InFilesystem.FlushFile(SecondFileName);
+	}
+
+	if (InFilesystem.GetFileFragmentCount(FirstFileName) <= 1)
+	{
+		Result.TestResult = "Interleaved appends did not give the file several extents";
+		return Result;
+	}
+
+	// Read across every extent boundary, starting and ending in the middle of a block
+	const uint64 ReadOffset = BlockSize / 2;
+	const uint64 ReadLength = Pieces * BlockSize - BlockSize;
+	FsArray<uint8> ReadBuffer = FsArray<uint8>();
+	ReadBuffer.FillUninitialized(ReadLength);
+	const char* FileNames[] = { FirstFileName, SecondFileName };
+	for (const char* FileName : FileNames)
+	{
+		if (!InFilesystem.ReadFromFile(FileName, ReadOffset, ReadBuffer.GetData(), ReadLength))
+		{
+			Result.TestResult = "Failed to read a file with many extents";
+			return Result;
+		}
+
+		for (uint64 i = 0; i < ReadLength; i++)
+		{
+			if (ReadBuffer[i] != static_cast<uint8>((ReadOffset + i) * 13))
+			{
+				FsLogger::LogFormat(FilesystemLogType::Error, "File %s has the wrong byte at %u", FileName, ReadOffset + i);
+				Result.TestResult = "File with many extents did not read back as written";
+				return Result;
+			}
+		}
+	}
+
+	// Small reads across each boundary, last to first, so the extent holding the offset is looked up from anywhere in the map
+	for (uint64 PieceIndex = Pieces - 1; PieceIndex > 0; PieceIndex--)
+	{
+		const uint64 BoundaryOffset = PieceIndex * BlockSize - 8;
+		uint8 BoundaryBytes[16] = {};
+		InFilesystem.ReadFromFile(FirstFileName, BoundaryOffset, BoundaryBytes, sizeof(BoundaryBytes));
+		for (uint64 i = 0; i < sizeof(BoundaryBytes); i++)
+		{
+			if (BoundaryBytes[i] != static_cast<uint8>((BoundaryOffset + i) * 13))
+			{
+				FsLogger::LogFormat(FilesystemLogType::Error, "Read across block %u has the wrong byte at %u", PieceIndex, BoundaryOffset + i);
+				Result.TestResult = "Small read across an extent boundary did not read back as written";
+				return Result;
+			}
+		}
+	}
+
+	InFilesystem.FsDeleteFile(FirstFileName);
+	InFilesystem.FsDeleteFile(SecondFileName);
+
+	// Deleting the files has to free their map blocks along with their content
+	uint64 FreeBytesAfter = 0;
+	InFilesystem.GetTotalAndFreeBytes(TotalBytes, FreeBytesAfter);
+	if (FreeBytesAfter != FreeBytesBefore)
+	{
+		FsLogger::LogFormat(FilesystemLogType::Error, "%u bytes free before the test, %u after", FreeBytesBefore, FreeBytesAfter);
+		Result.TestResult = "Deleting files with many extents did not free all of their blocks";
+		return Result;
+	}
+
+	Result.bSucceeded = true;
+	Result.TestResult = "BlockMapTest succeeded";
+	return Result;
+}
+
+static bool BytesMatch(const uint8* A, const uint8* B, uint64 Length)
+{
+	for (uint64 i = 0; i < Length; i++)
+	{
+		if (A[i] != B[i])
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+FsTestResult FsTests::ReadAheadTest(FsFilesystem& InFilesystem)
+{
+	FsTestResult Result;
+
+	const char* FileName = "Foo/Bar/Baz/ReadAhead.bin";
+	InFilesystem.CreateFile(FileName);
+
+	// Only the first half is written, the rest is preallocated so read ahead has to give back zeros for it
+	const uint64 PieceLength = 16 * 1024;
+	const uint64 Pieces = 64;
+	const uint64 WrittenLength = PieceLength * Pieces / 2;
+	FsArray<uint8> Content = FsArray<uint8>();
+	Content.FillUninitialized(WrittenLength);
+	for (uint64 i = 0; i < WrittenLength; i++)
+	{
+		Content[i] = static_cast<uint8>(i * 7 + i / 4096);
+	}
+	InFilesystem.WriteToFile(FileName, Content.GetData(), 0, WrittenLength);
+	InFilesystem.PreallocateFile(FileName, PieceLength * Pieces, FsPreallocateMode::ExtendSize);
+
+	FsArray<uint8> Expected = FsArray<uint8>();
+	Expected.FillZeroed(PieceLength * Pieces);
+	FsMemory::Copy(Expected.GetData(), Content.GetData(), WrittenLength);
+
+	// Read the whole file in order, changing a piece the reader hasn't got to yet partway through.
+	// The change has to be seen even though that piece has probably been read ahead already.
+	FsArray<uint8> ReadBuffer = FsArray<uint8>();
+	ReadBuffer.FillUninitialized(PieceLength);
+	for (uint64 PieceIndex = 0; PieceIndex < Pieces; PieceIndex++)
+	{
+		if (PieceIndex == 8)
+		{
+			const uint64 ChangedOffset = 10 * PieceLength + 100;
+			const uint8 Changed[] = { 1, 2, 3, 4, 5, 6, 7, 8 };
+			InFilesystem.WriteToFile(FileName, Changed, ChangedOffset, sizeof(Changed));
+			FsMemory::Copy(Expected.GetData() + ChangedOffset, Changed, sizeof(Changed));
+		}
+
+		const uint64 Offset = PieceIndex * PieceLength;
+		if (!InFilesystem.ReadFromFile(FileName, Offset, ReadBuffer.GetData(), PieceLength))
+		{
+			Result.TestResult = "Failed to read a file in order";
+			return Result;
+		}
+
+		if (!BytesMatch(ReadBuffer.GetData(), Expected.GetData() + Offset, PieceLength))
+		{
+			FsLogger::LogFormat(FilesystemLogType::Error, "Piece %u read in order does not match", PieceIndex);
+			Result.TestResult = "File read in order did not read back as written";
+			return Result;
+		}
+	}
+
+	// Jumping about has to give the right content too, including going back over what was read ahead
+	for (uint64 Step = 0; Step < Pieces; Step++)
+	{
+		const uint64 Offset = (Step * 7919 * 13) % (PieceLength * Pieces - 4096);
+		if (!InFilesystem.ReadFromFile(FileName, Offset, ReadBuffer.GetData(), 4096) || !BytesMatch(ReadBuffer.GetData(), Expected.GetData() + Offset, 4096))
+		{
+			FsLogger::LogFormat(FilesystemLogType::Error, "Read at %u does not match", Offset);
+			Result.TestResult = "File read out of order did not read back as written";
+			return Result;
+		}
+	}
+
+	InFilesystem.FsDeleteFile(FileName);
+
+	Result.bSucceeded = true;
+	Result.TestResult = "ReadAheadTest succeeded";
+	return Result;
+}
+
+FsTestResult FsTests::WriteBackTest(FsFilesystem& InFilesystem)
+{
+	FsTestResult Result;
+
+	const char* FileName = "Foo/Bar/Baz/WriteBack.bin";
+	InFilesystem.CreateFile(FileName);
+
+	// Small pieces written in order, each overlapping the end of the one before, then one far past the end of the file.
+	// With write-back on these stay in memory until the flush, and have to read back the same either way.
+	const uint64 PieceLength = 4096;
+	const uint64 Pieces = 32;
+	const uint64 FarOffset = PieceLength * Pieces * 2;
+	const uint64 FileLength = FarOffset + PieceLength;
+	FsArray<uint8> Expected = FsArray<uint8>();
+	Expected.FillZeroed(FileLength);
+
+	FsArray<uint8> Piece = FsArray<uint8>();
+	Piece.FillUninitialized(PieceLength);
+	for (uint64 PieceIndex = 0; PieceIndex <= Pieces; PieceIndex++)
+	{
+		const uint64 Offset = PieceIndex == Pieces ? FarOffset : (PieceIndex == 0 ? 0 : PieceIndex * PieceLength - 100);
+		for (uint64 i = 0; i < PieceLength; i++)
+		{
+			Piece[i] = static_cast<uint8>(PieceIndex * 31 + i);
+		}
+		InFilesystem.WriteToFile(FileName, Piece.GetData(), Offset, PieceLength);
+		FsMemory::Copy(Expected.GetData() + Offset, Piece.GetData(), PieceLength);
+	}
+
+	FsArray<uint8> ReadBuffer = FsArray<uint8>();
+	ReadBuffer.FillUninitialized(FileLength);
+	for (uint64 Pass = 0; Pass < 2; Pass++)
+	{
+		uint64 FileSize = 0;
+		InFilesystem.GetFileSize(FileName, FileSize);
+		if (FileSize != FileLength)
+		{
+			FsLogger::LogFormat(FilesystemLogType::Error, "File is %u bytes, expected %u", FileSize, FileLength);
+			Result.TestResult = "Small writes did not give the file the right size";
+			return Result;
+		}
+
+		// Read it in two halves, so one read ends in the middle of the written pieces
+		const uint64 FirstHalf = PieceLength * Pieces / 2 + 7;
+		if (!InFilesystem.ReadFromFile(FileName, 0, ReadBuffer.GetData(), FirstHalf) ||
+			!InFilesystem.ReadFromFile(FileName, FirstHalf, ReadBuffer.GetData() + FirstHalf, FileLength - FirstHalf) ||
+			!BytesMatch(ReadBuffer.GetData(), Expected.GetData(), FileLength))
+		{
+			Result.TestResult = Pass == 0 ? "Small writes did not read back before the flush" : "Small writes did not read back after the flush";
+			return Result;
+		}
+
+		InFilesystem.FlushFile(FileName);
+	}
+
+	InFilesystem.FsDeleteFile(FileName);
+
+	Result.bSucceeded = true;
+	Result.TestResult = "WriteBackTest succeeded";
+	return Result;
+}
+
+// Writes a pattern to the file and to Expected at the same place
+static bool WriteExpectedPiece(FsFilesystem& InFilesystem, const char* FileName, FsArray<uint8>& Expected, uint64 Offset, uint64 Length)
+{
+	for (uint64 i = 0; i < Length; i++)
+	{
+		Expected[Offset + i] = static_cast<uint8>((Offset + i) * 11 + 3);
+	}
+	return InFilesystem.WriteToFile(FileName, Expected.GetData() + Offset, Offset, Length);
+}
+
+// Checks the file is FileLength bytes long and holds the start of Expected
+static bool FileMatchesExpected(FsFilesystem& InFilesystem, const char* FileName, const FsArray<uint8>& Expected, uint64 FileLength)
+{
+	uint64 FileSize = 0;
+	if (!InFilesystem.GetFileSize(FileName, FileSize) || FileSize != FileLength)
+	{
+		FsLogger::LogFormat(FilesystemLogType::Error, "File is %u bytes, expected %u", FileSize, FileLength);
+		return false;
+	}
+
+	FsArray<uint8> ReadBuffer = FsArray<uint8>();
+	ReadBuffer.FillUninitialized(FileLength);
+	return InFilesystem.ReadFromFile(FileName, 0, ReadBuffer.GetData(), FileLength) && BytesMatch(ReadBuffer.GetData(), Expected.GetData(), FileLength);
+}
+
+FsTestResult FsTests::DelayedAllocationTest(FsFilesystem& InFilesystem)
+{
+	FsTestResult Result;
+
+	if (!InFilesystem.GetMountOptions().bDelayedAllocation)
+	{
+		Result.bSucceeded = true;
+		Result.TestResult = "DelayedAllocationTest skipped, delayed allocation is turned off";
+		return Result;
+	}
+
+	const char* FileName = "Foo/Bar/Baz/Delayed.bin";
+	InFilesystem.CreateFile(FileName);
+
+	FsArray<uint8> Expected = FsArray<uint8>();
+	Expected.FillZeroed(300000);
+
+	// Stage a piece, then write below it. The hole between the low piece and the staged one is read
+	// before anything is flushed, so the read has to count the staged bytes in the file's size.
+	const uint64 StagedOffset = 238977;
+	const uint64 LowOffset = 123544;
+	if (!WriteExpectedPiece(InFilesystem, FileName, Expected, StagedOffset, 3606) ||
+		!WriteExpectedPiece(InFilesystem, FileName, Expected, LowOffset, 2885))
+	{
+		Result.TestResult = "Failed to write below staged data";
+		return Result;
+	}
+
+	const uint64 HoleOffset = 131005;
+	const uint64 HoleLength = 88854;
+	FsArray<uint8> HoleBuffer = FsArray<uint8>();
+	HoleBuffer.FillUninitialized(HoleLength);
+	if (!InFilesystem.ReadFromFile(FileName, HoleOffset, HoleBuffer.GetData(), HoleLength) ||
+		!BytesMatch(HoleBuffer.GetData(), Expected.GetData() + HoleOffset, HoleLength))
+	{
+		Result.TestResult = "Hole below staged data did not read back as zeros";
+		return Result;
+	}
+
+	// Then write past it, leaving another hole
+	const uint64 PastOffset = 250000;
+	if (!WriteExpectedPiece(InFilesystem, FileName, Expected, PastOffset, 2000))
+	{
+		Result.TestResult = "Failed to write past staged data";
+		return Result;
+	}
+
+	uint64 FileLength = PastOffset + 2000;
+	if (!FileMatchesExpected(InFilesystem, FileName, Expected, FileLength))
+	{
+		Result.TestResult = "Staged data did not read back before the flush";
+		return Result;
+	}
+
+	InFilesystem.FlushFile(FileName);
+	if (!FileMatchesExpected(InFilesystem, FileName, Expected, FileLength))
+	{
+		Result.TestResult = "Staged data did not read back after the flush";
+		return Result;
+	}
+
+	// Cutting the file in the middle of staged data keeps only the staged bytes before the cut
+	if (!WriteExpectedPiece(InFilesystem, FileName, Expected, FileLength, 5000))
+	{
+		Result.TestResult = "Failed to stage an append";
+		return Result;
+	}
+
+	const uint64 TruncatedLength = FileLength + 1500;
+	InFilesystem.TruncateFile(FileName, TruncatedLength);
+	FsMemory::Zero(Expected.GetData() + TruncatedLength, Expected.Length() - TruncatedLength);
+	FileLength = TruncatedLength;
+	if (!FileMatchesExpected(InFilesystem, FileName, Expected, FileLength))
+	{
+		Result.TestResult = "Truncating through staged data did not keep the bytes before the cut";
+		return Result;
+	}
+
+	// Staged data has to reach the storage when the filesystem is unmounted
+	if (!WriteExpectedPiece(InFilesystem, FileName, Expected, FileLength, 3000))
+	{
+		Result.TestResult = "Failed to stage an append";
+		return Result;
+	}
+	FileLength += 3000;
+
+	Remount(InFilesystem);
+	if (!FileMatchesExpected(InFilesystem, FileName, Expected, FileLength))
+	{
+		Result.TestResult = "Staged data did not read back after remounting";
+		return Result;
+	}
+
+	InFilesystem.FsDeleteFile(FileName);
+
+	Result.bSucceeded = true;
+	Result.TestResult = "DelayedAllocationTest succeeded";
+	return Result;
+}
@@ -90,16 +90,136 @@ FsFilesystemImpl::FsFilesystemImpl(uint64 InPartitionSize, uint64 InBlockSize)
 		FsLogger::LogFormat(FilesystemLogType::Error, "Failed to open file: %s", VirtualFileName);
 		return;
 	}
+
+	// Unbuffered, so bytes written by the IO workers through their own handles are never hidden behind stale buffered data
+	File.rdbuf()->pubsetbuf(nullptr, 0);
+
+	StartIoWorkers();
 }
 
 FsFilesystemImpl::~FsFilesystemImpl()
 {
+	StopIoWorkers();
+
 	if (File.is_open())
 	{
 		File.close();
 	}
 }
 
+void FsFilesystemImpl::StartIoWorkers()
+{
+	for (int i = 0; i < IoWorkerCount; i++)
+	{
+		IoWorkers.emplace_back(&FsFilesystemImpl::IoWorkerMain, this);
+	}
+}
+
+void FsFilesystemImpl::StopIoWorkers()
+{
+	{
+		std::lock_guard<std::mutex> Lock(IoMutex);
+		bStopIoWorkers = true;
+	}
+	IoRequestReady.notify_all();
+
+	for (std::thread& Worker : IoWorkers)
+	{
+		Worker.join();
+	}
+	IoWorkers.clear();
+}
+
+void FsFilesystemImpl::IoWorkerMain()
+{
+	// Each worker seeks its own handle, so workers never wait on each other for the file position
+	std::fstream WorkerFile;
+	WorkerFile.open(VirtualFileName, std::ios::in | std::ios::out | std::ios::binary);
+	WorkerFile.rdbuf()->pubsetbuf(nullptr, 0);
+
+	while (true)
+	{
+		FsIoRequest Request;
+		{
+			std::unique_lock<std::mutex> Lock(IoMutex);
+			IoRequestReady.wait(Lock, [this] { return bStopIoWorkers || !QueuedIo.empty(); });
+			if (QueuedIo.empty())
+			{
+				return;
+			}
+			Request = QueuedIo.front();
+			QueuedIo.pop_front();
+		}
+
+		// The logger isn't safe to use from several threads, so failures are only reported through the completion
+		bool bSucceeded = WorkerFile.is_open();
+		if (bSucceeded && Request.Operation == FsIoOperation::Read)
+		{
+			WorkerFile.seekg(Request.Offset);
+			WorkerFile.read(reinterpret_cast<char*>(Request.Destination), Request.Length);
+		}
+		else if (bSucceeded)
+		{
+			WorkerFile.seekp(Request.Offset);
+			WorkerFile.write(reinterpret_cast<const char*>(Request.Source), Request.Length);
+			WorkerFile.flush();
+		}
+		bSucceeded = bSucceeded && !WorkerFile.fail();
+		WorkerFile.clear();
+
+		{
+			std::lock_guard<std::mutex> Lock(IoMutex);
+			FsIoCompletion Completion;
+			Completion.Tag = Request.Tag;
+			Completion.bSucceeded = bSucceeded;
+			FinishedIo.push_back(Completion);
+		}
+		IoCompletionReady.notify_one();
+	}
+}
+
+bool FsFilesystemImpl::SubmitIo(const FsIoRequest& Request)
+{
+	if (IoWorkers.empty())
+	{
+		return FsFilesystem::SubmitIo(Request);
+	}
+
+	{
+		std::lock_guard<std::mutex> Lock(IoMutex);
+		QueuedIo.push_back(Request);
+		IoInFlight++;
+	}
+	IoRequestReady.notify_one();
+	return true;
+}
+
+bool FsFilesystemImpl::WaitForIoCompletion(FsIoCompletion& OutCompletion)
+{
+	if (IoWorkers.empty())
+	{
+		return FsFilesystem::WaitForIoCompletion(OutCompletion);
+	}
+
+	std::unique_lock<std::mutex> Lock(IoMutex);
+	if (IoInFlight == 0)
+	{
+		return false;
+	}
+
+	IoCompletionReady.wait(Lock, [this] { return !FinishedIo.empty(); });
+	OutCompletion = FinishedIo.front();
+	FinishedIo.pop_front();
+	IoInFlight--;
+	return true;
+}
+
+uint64 FsFilesystemImpl::GetTimeMilliseconds()
+{
+	const std::chrono::steady_clock::duration SinceEpoch = std::chrono::steady_clock::now().time_since_epoch();
+	return static_cast<uint64>(std::chrono::duration_cast<std::chrono::milliseconds>(SinceEpoch).count());
+}
+
 FilesystemReadResult FsFilesystemImpl::Read(uint64 Offset, uint64 Length, uint8* Destination)
 {
 	//FsLogger::LogFormat(FilesystemLogType::Info, "Reading %u bytes from %u", Length, Offset);
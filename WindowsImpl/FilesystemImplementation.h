@@ -4,6 +4,12 @@
 #include "FsMemory.h"
 #include "FsLogger.h"
 #include <fstream>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <vector>
+#include <chrono>
 
 class FsLoggerImpl : public FsLogger
 {
@@ -28,12 +34,35 @@ protected:
 	virtual FilesystemReadResult Read(uint64 Offset, uint64 Length, uint8* Destination) override;
 	virtual FilesystemWriteResult Write(uint64 Offset, uint64 Length, const uint8* Source) override;
 
+	// Requests are queued for a pool of worker threads, each with its own handle to the virtual file, so several can be in flight at once
+	virtual bool SubmitIo(const FsIoRequest& Request) override;
+	virtual bool WaitForIoCompletion(FsIoCompletion& OutCompletion) override;
+
+	// Lets write-back commit buffers that have been held too long
+	virtual uint64 GetTimeMilliseconds() override;
+
 	void CreateVirtualFile(uint64 InPartitionSize);
 
+	void StartIoWorkers();
+	void StopIoWorkers();
+	void IoWorkerMain();
+
 	// The name of the file that we will use for the FsFilesystem implementation
 	const char* VirtualFileName = "VirtualFileSystem.dat";
 
 	std::fstream File;
 
+	static constexpr int IoWorkerCount = 4;
+	std::vector<std::thread> IoWorkers;
+
+	// Guards everything below
+	std::mutex IoMutex;
+	std::condition_variable IoRequestReady;
+	std::condition_variable IoCompletionReady;
+	std::deque<FsIoRequest> QueuedIo;
+	std::deque<FsIoCompletion> FinishedIo;
+	uint64 IoInFlight = 0;
+	bool bStopIoWorkers = false;
+
 };
 
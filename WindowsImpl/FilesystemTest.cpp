@@ -208,7 +208,10 @@ NTSTATUS DOKAN_CALLBACK FsDokanCreateFile(LPCWSTR FileName,
 					return STATUS_OBJECT_NAME_NOT_FOUND;
 				}
 
-				// TODO: Truncate
+				if (!GlobalFilesystem->TruncateFile(FileNameString, 0))
+				{
+					return STATUS_ACCESS_DENIED;
+				}
 				break;
 			}
 			default:
@@ -249,6 +252,11 @@ void DOKAN_CALLBACK FsCleanup(LPCWSTR FileName,
 	}
 
 	std::scoped_lock lock(Mutex);
+	if (!DokanFileInfo->IsDirectory && !GlobalFilesystem->FlushFile(FileNameString))
+	{
+		FsLogger::LogFormat(FilesystemLogType::Error, "Failed to flush file: %s", FileNameString.GetData());
+	}
+
 	if (!DokanFileInfo->DeleteOnClose ||
 		(!GlobalFilesystem->FileExists(FileNameString) && !GlobalFilesystem->DirectoryExists(FileNameString)))
 	{
@@ -294,6 +302,11 @@ void DOKAN_CALLBACK FsCloseFile(LPCWSTR FileName,
 	}
 
 	std::scoped_lock lock(Mutex);
+	if (!DokanFileInfo->IsDirectory && !GlobalFilesystem->FlushFile(FileNameString))
+	{
+		FsLogger::LogFormat(FilesystemLogType::Error, "Failed to flush file: %s", FileNameString.GetData());
+	}
+
 	if (!DokanFileInfo->DeleteOnClose ||
 		(!GlobalFilesystem->FileExists(FileNameString) && !GlobalFilesystem->DirectoryExists(FileNameString)))
 	{
@@ -403,6 +416,12 @@ NTSTATUS DOKAN_CALLBACK FsFlushFileBuffers(LPCWSTR FileName,
 		FsLogger::LogFormat(FilesystemLogType::Error, "GlobalFilesystem is null");
 		return STATUS_NOT_IMPLEMENTED;
 	}
+
+	std::scoped_lock lock(Mutex);
+	if (!GlobalFilesystem->FlushFile(FileNameString))
+	{
+		return STATUS_DISK_FULL;
+	}
 	return STATUS_SUCCESS;
 }
 
@@ -726,17 +745,15 @@ NTSTATUS DOKAN_CALLBACK FsSetEndOfFile(LPCWSTR FileName,
 		return STATUS_NO_SUCH_FILE;
 	}
 
-	// Calculate the amount of bytes to add
-	uint64 BytesToAdd = ByteOffset - FileSize;
-	if (BytesToAdd == 0)
+	if (static_cast<uint64>(ByteOffset) == FileSize)
 	{
 		return STATUS_SUCCESS;
 	}
 
-	// Write the zeroed bytes to the file	
-	if (!GlobalFilesystem->WriteToFile(FileNameString, nullptr, FileSize, BytesToAdd))
+	// Shrinking frees the blocks past the new end, growing leaves a hole that reads as zeros and takes no blocks
+	if (!GlobalFilesystem->TruncateFile(FileNameString, ByteOffset))
 	{
-		return STATUS_NO_SUCH_FILE;
+		return STATUS_ACCESS_DENIED;
 	}
 
 	return STATUS_SUCCESS;
@@ -757,6 +774,13 @@ NTSTATUS DOKAN_CALLBACK FsSetAllocationSize(LPCWSTR FileName,
 		FsLogger::LogFormat(FilesystemLogType::Error, "GlobalFilesystem is null");
 		return STATUS_NOT_IMPLEMENTED;
 	}
+
+	// Copies set the final size up front, reserving it now keeps the file in one piece
+	std::scoped_lock lock(Mutex);
+	if (!GlobalFilesystem->PreallocateFile(FileNameString, AllocSize, FsPreallocateMode::KeepSize))
+	{
+		return STATUS_DISK_FULL;
+	}
 	return STATUS_SUCCESS;
 }
 
@@ -885,6 +909,10 @@ NTSTATUS DOKAN_CALLBACK FsUnmounted(PDOKAN_FILE_INFO DokanFileInfo)
 		FsLogger::LogFormat(FilesystemLogType::Error, "GlobalFilesystem is null");
 		return STATUS_NOT_IMPLEMENTED;
 	}
+
+	std::scoped_lock lock(Mutex);
+	GlobalFilesystem->FlushAllFiles();
+	GlobalFilesystem->FlushDiscards();
 	return STATUS_SUCCESS;
 }
 
@@ -960,7 +988,13 @@ int main()
 	FsFilesystemImpl FsFilesystem = FsFilesystemImpl(1024ull * 1024ull * 1024ull * 4ull, 1024 * 128);
 	GlobalFilesystem = &FsFilesystem;
 
-	FsFilesystem.Initialize();
+	// Explorer copies files in small pieces, delaying allocation until close keeps them in one extent
+	FsMountOptions MountOptions = FsMountOptions();
+	MountOptions.bDelayedAllocation = true;
+
+	// Applications rewrite and append in 4-64KB pieces, buffering them turns each run of pieces into one write
+	MountOptions.bWriteBack = true;
+	FsFilesystem.Initialize(MountOptions);
 
 	//FsTests::RunTests(FsFilesystem);
 